@@ -1,424 +1,5867 @@
 #include <bits/stdc++.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 using namespace std;
 
-class Slot
+// The day is divided into slots of equal length between the clinic's opening and closing time, 30 min slots from
+// 9 am to 9 pm unless configured otherwise, so every slot is identified by its index 0..slotsPerDay - 1.
+// Times are parsed into a SlotIndex once at the API boundary and only formatted back for output.
+using SlotIndex = int;
+
+// Bit i stands for slot i. Two 64 bit words cover the largest grid, so every operation is a couple of word-sized
+// instructions; the mask is trivially copyable and goes to the journal and snapshots as raw words.
+class SlotMask
+{
+public:
+    static const int WORD_COUNT = 2;
+    uint64_t words[WORD_COUNT];
+
+    static SlotMask of(SlotIndex slot)
+    {
+        SlotMask mask = {};
+        mask.set(slot);
+        return mask;
+    }
+
+    // Slots first..last - 1; empty if last <= first
+    static SlotMask range(SlotIndex first, SlotIndex last)
+    {
+        SlotMask mask = {};
+        for (int word = 0; word < WORD_COUNT; word++)
+        {
+            int from = max(first - word * 64, 0);
+            int to = min(last - word * 64, 64);
+            if (from < to)
+            {
+                uint64_t bits = to - from == 64 ? ~uint64_t(0) : ((uint64_t(1) << (to - from)) - 1);
+                mask.words[word] = bits << from;
+            }
+        }
+        return mask;
+    }
+
+    bool test(SlotIndex slot) const
+    {
+        return (words[slot >> 6] >> (slot & 63)) & 1;
+    }
+
+    void set(SlotIndex slot)
+    {
+        words[slot >> 6] |= uint64_t(1) << (slot & 63);
+    }
+
+    void reset(SlotIndex slot)
+    {
+        words[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+    }
+
+    bool any() const
+    {
+        return (words[0] | words[1]) != 0;
+    }
+
+    int count() const
+    {
+        return __builtin_popcountll(words[0]) + __builtin_popcountll(words[1]);
+    }
+
+    // The earliest slot in the mask, or -1 if it is empty
+    SlotIndex first() const
+    {
+        if (words[0] != 0)
+        {
+            return __builtin_ctzll(words[0]);
+        }
+        return words[1] != 0 ? 64 + __builtin_ctzll(words[1]) : -1;
+    }
+
+    SlotMask operator|(const SlotMask &other) const
+    {
+        return {{words[0] | other.words[0], words[1] | other.words[1]}};
+    }
+
+    SlotMask operator&(const SlotMask &other) const
+    {
+        return {{words[0] & other.words[0], words[1] & other.words[1]}};
+    }
+
+    SlotMask operator~() const
+    {
+        return {{~words[0], ~words[1]}};
+    }
+
+    SlotMask &operator|=(const SlotMask &other)
+    {
+        return *this = *this | other;
+    }
+
+    // Calls visitor(slot) for every slot in the mask, earliest first
+    template <typename Visitor>
+    void forEach(Visitor visitor) const
+    {
+        for (int word = 0; word < WORD_COUNT; word++)
+        {
+            for (uint64_t bits = words[word]; bits != 0; bits &= bits - 1)
+            {
+                visitor(SlotIndex(word * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+};
+
+// Slots of slotMinutes each from openMinutes to closeMinutes, in minutes since midnight. The index <-> time tables
+// are built once per grid, so parsing a time is a table lookup and formatting a slot hands out a ready string.
+class SlotGrid
+{
+public:
+    // 15 min slots around the clock
+    static const int MAX_SLOTS_PER_DAY = 96;
+    static const int MINUTES_PER_DAY = 24 * 60;
+    int slotMinutes;
+    int openMinutes;
+    int closeMinutes;
+    int slotsPerDay;
+    // Minute of the day -> the slot that starts then, or -1
+    array<int8_t, MINUTES_PER_DAY + 1> slotStartingAt;
+    // "HH:MM" and "HH:MM-HH:MM" of every slot
+    vector<string> startTexts;
+    vector<string> rangeTexts;
+
+    // The hours have to split into whole slots, and into no more than MAX_SLOTS_PER_DAY of them
+    static bool isValid(int slotMinutes, int openMinutes, int closeMinutes)
+    {
+        return slotMinutes > 0 && openMinutes >= 0 && openMinutes < closeMinutes && closeMinutes <= MINUTES_PER_DAY &&
+               (closeMinutes - openMinutes) % slotMinutes == 0 && (closeMinutes - openMinutes) / slotMinutes <= MAX_SLOTS_PER_DAY;
+    }
+
+    // Expects isValid
+    SlotGrid(int slotMinutes, int openMinutes, int closeMinutes)
+    {
+        this->slotMinutes = slotMinutes;
+        this->openMinutes = openMinutes;
+        this->closeMinutes = closeMinutes;
+        slotsPerDay = (closeMinutes - openMinutes) / slotMinutes;
+        slotStartingAt.fill(-1);
+        for (SlotIndex slot = 0; slot < slotsPerDay; slot++)
+        {
+            int startMinutes = openMinutes + slot * slotMinutes;
+            slotStartingAt[startMinutes] = slot;
+            startTexts.push_back(format(startMinutes));
+            rangeTexts.push_back(format(startMinutes) + "-" + format(startMinutes + slotMinutes));
+        }
+    }
+
+    static string format(int minutes)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%02d:%02d", minutes / 60, minutes % 60);
+        return buffer;
+    }
+};
+
+class SlotTime
+{
+private:
+    inline static SlotGrid grid{30, 9 * 60, 21 * 60};
+
+public:
+    // Replaces the slot grid, e.g. with 15 min slots or round the clock hours. Call before FlipCare is used.
+    // Returns false, keeping the current grid, if SlotGrid::isValid rejects the configuration.
+    static bool configure(int slotMinutes, int openMinutes, int closeMinutes)
+    {
+        if (!SlotGrid::isValid(slotMinutes, openMinutes, closeMinutes))
+        {
+            return false;
+        }
+        grid = SlotGrid(slotMinutes, openMinutes, closeMinutes);
+        return true;
+    }
+
+    static const SlotGrid &getGrid()
+    {
+        return grid;
+    }
+
+    static int slotsPerDay()
+    {
+        return grid.slotsPerDay;
+    }
+
+    // Parses "H:MM" / "HH:MM" into minutes since midnight. "24:00" is only accepted as the end of the day.
+    static bool parseMinutes(const string &time, int &minutes, bool endOfDay = false)
+    {
+        size_t colonPos = time.find(':');
+        if (colonPos == string::npos || colonPos == 0 || colonPos > 2 || time.size() != colonPos + 3)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < time.size(); i++)
+        {
+            if (i != colonPos && !isdigit(time[i]))
+            {
+                return false;
+            }
+        }
+        int hour = stoi(time.substr(0, colonPos));
+        int minute = stoi(time.substr(colonPos + 1));
+        if ((hour > 23 || minute > 59) && !(endOfDay && hour == 24 && minute == 0))
+        {
+            return false;
+        }
+        minutes = hour * 60 + minute;
+        return true;
+    }
+
+    // Parses clinic hours, e.g. "9:00-21:00" or "0:00-24:00"
+    static bool parseHours(const string &hours, int &openMinutes, int &closeMinutes)
+    {
+        size_t dashPos = hours.find('-');
+        return dashPos != string::npos && parseMinutes(hours.substr(0, dashPos), openMinutes) &&
+               parseMinutes(hours.substr(dashPos + 1), closeMinutes, true);
+    }
+
+    // Parses the start time of a slot, e.g. "12:30"
+    static bool parseSlotStart(const string &time, SlotIndex &slot)
+    {
+        int minutes;
+        if (!parseMinutes(time, minutes) || grid.slotStartingAt[minutes] < 0)
+        {
+            return false;
+        }
+        slot = grid.slotStartingAt[minutes];
+        return true;
+    }
+
+    // Parses a full slot, e.g. "12:30-13:00". The slot has to be exactly one slot long.
+    static bool parseSlotRange(const string &range, SlotIndex &slot)
+    {
+        size_t dashPos = range.find('-');
+        if (dashPos == string::npos)
+        {
+            return false;
+        }
+        int endMinutes;
+        if (!parseSlotStart(range.substr(0, dashPos), slot) || !parseMinutes(range.substr(dashPos + 1), endMinutes, true))
+        {
+            return false;
+        }
+        return endMinutes == startMinutes(slot) + grid.slotMinutes;
+    }
+
+    static int startMinutes(SlotIndex slot)
+    {
+        return grid.openMinutes + slot * grid.slotMinutes;
+    }
+
+    // The first slot that starts at or after minutes since midnight; slotsPerDay() if there is none
+    static SlotIndex firstSlotStartingFrom(int minutes)
+    {
+        int offset = max(minutes - grid.openMinutes, 0);
+        return min(grid.slotsPerDay, (offset + grid.slotMinutes - 1) / grid.slotMinutes);
+    }
+
+    // The slots 0..slotsEndingBy(minutes) - 1 are over by minutes since midnight
+    static SlotIndex slotsEndingBy(int minutes)
+    {
+        int offset = max(minutes - grid.openMinutes, 0);
+        return min(grid.slotsPerDay, offset / grid.slotMinutes);
+    }
+
+    static const string &startTime(SlotIndex slot)
+    {
+        return grid.startTexts[slot];
+    }
+
+    static const string &toString(SlotIndex slot)
+    {
+        return grid.rangeTexts[slot];
+    }
+};
+
+// Bookings are open for the next WINDOW_DAYS days, today included. A Day counts days since 1970-01-01, and every
+// per-day structure is a ring of WINDOW_DAYS entries indexed by date, so a day leaving the window frees its entry
+// for the day that enters it.
+using Day = int32_t;
+// Stands for the first day of the window wherever a Day is optional
+const Day TODAY = INT32_MIN;
+
+class Calendar
+{
+public:
+    static const int WINDOW_DAYS = 30;
+
+    static int ringIndex(Day day)
+    {
+        return ((day % WINDOW_DAYS) + WINDOW_DAYS) % WINDOW_DAYS;
+    }
+
+    // The local date
+    static Day systemToday()
+    {
+        time_t now = time(nullptr);
+        tm local;
+        localtime_r(&now, &local);
+        return fromCivil(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+    }
+
+    // Parses "YYYY-MM-DD"
+    static bool parseDate(string_view date, Day &day)
+    {
+        if (date.size() != 10 || date[4] != '-' || date[7] != '-')
+        {
+            return false;
+        }
+        for (size_t i = 0; i < date.size(); i++)
+        {
+            if (i != 4 && i != 7 && !isdigit(static_cast<unsigned char>(date[i])))
+            {
+                return false;
+            }
+        }
+        auto number = [&date](int position, int length)
+        {
+            int value = 0;
+            for (int i = position; i < position + length; i++)
+            {
+                value = value * 10 + (date[i] - '0');
+            }
+            return value;
+        };
+        int year = number(0, 4), month = number(5, 2), dayOfMonth = number(8, 2);
+        if (month < 1 || month > 12 || dayOfMonth < 1)
+        {
+            return false;
+        }
+        // Rejects e.g. 2025-02-30, which would otherwise roll over into March
+        Day parsed = fromCivil(year, month, dayOfMonth);
+        int checkYear, checkMonth, checkDayOfMonth;
+        toCivil(parsed, checkYear, checkMonth, checkDayOfMonth);
+        if (checkMonth != month || checkDayOfMonth != dayOfMonth)
+        {
+            return false;
+        }
+        day = parsed;
+        return true;
+    }
+
+    static string toString(Day day)
+    {
+        int year, month, dayOfMonth;
+        toCivil(day, year, month, dayOfMonth);
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%04d-%02d-%02d", year, month, dayOfMonth);
+        return buffer;
+    }
+
+private:
+    // Proleptic Gregorian calendar, counted in 400 year eras of 146097 days that start on March 1st
+    static Day fromCivil(int year, int month, int dayOfMonth)
+    {
+        year -= month <= 2;
+        int era = (year >= 0 ? year : year - 399) / 400;
+        int yearOfEra = year - era * 400;
+        int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + dayOfMonth - 1;
+        int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+        return era * 146097 + dayOfEra - 719468;
+    }
+
+    static void toCivil(Day day, int &year, int &month, int &dayOfMonth)
+    {
+        int shifted = day + 719468;
+        int era = (shifted >= 0 ? shifted : shifted - 146096) / 146097;
+        int dayOfEra = shifted - era * 146097;
+        int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        int monthFromMarch = (5 * dayOfYear + 2) / 153;
+        dayOfMonth = dayOfYear - (153 * monthFromMarch + 2) / 5 + 1;
+        month = monthFromMarch < 10 ? monthFromMarch + 3 : monthFromMarch - 9;
+        year = yearOfEra + era * 400 + (month <= 2);
+    }
+};
+
+// Arena for long-lived entities. Objects are constructed in place in blocks of CHUNK_SIZE, so consecutive objects
+// share cache lines, a pointer or handle stays valid for the life of the pool, and everything is destroyed in one
+// deterministic sweep instead of leaking individual allocations.
+template <typename T>
+class ObjectPool
+{
+private:
+    static const size_t CHUNK_SIZE = 1024;
+    struct Chunk
+    {
+        alignas(T) unsigned char storage[CHUNK_SIZE * sizeof(T)];
+    };
+    vector<unique_ptr<Chunk>> chunks;
+    size_t objectCount = 0;
+
+    T *slotFor(size_t handle)
+    {
+        return reinterpret_cast<T *>(chunks[handle / CHUNK_SIZE]->storage) + handle % CHUNK_SIZE;
+    }
+
+public:
+    ObjectPool() {}
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    ~ObjectPool()
+    {
+        reset();
+    }
+
+    template <typename... Args>
+    T *create(Args &&...args)
+    {
+        if (objectCount == chunks.size() * CHUNK_SIZE)
+        {
+            chunks.push_back(unique_ptr<Chunk>(new Chunk));
+        }
+        T *object = new (slotFor(objectCount)) T(forward<Args>(args)...);
+        objectCount++;
+        return object;
+    }
+
+    // Handles are dense: the n-th created object has handle n
+    T *get(size_t handle)
+    {
+        return slotFor(handle);
+    }
+
+    size_t size()
+    {
+        return objectCount;
+    }
+
+    // Visits the objects chunk by chunk in creation order
+    template <typename Function>
+    void forEach(Function function)
+    {
+        for (size_t handle = 0; handle < objectCount; handle++)
+        {
+            function(slotFor(handle));
+        }
+    }
+
+    void reset()
+    {
+        forEach([](T *object)
+                { object->~T(); });
+        chunks.clear();
+        objectCount = 0;
+    }
+};
+
+// Doctors, patients and specialities are referred to by dense 32 bit ids inside the engine. A name is resolved once
+// at the API edge; a doctor's or patient's id is also its handle in the entity pool, so later lookups are array indexing.
+using DoctorId = uint32_t;
+using PatientId = uint32_t;
+using SpecialityId = uint32_t;
+
+class NameInterner
 {
+private:
+    unordered_map<string, uint32_t> idsByName;
+    vector<string> names;
+
 public:
-    string startTime;
-    string endTime;
-    bool isCurrSlotAvailable;
-    queue<string> slotWaitListQ;
-    Slot(string startTime, string endTime)
+    // Returns false if the name was never interned
+    bool find(const string &name, uint32_t &id)
+    {
+        auto it = idsByName.find(name);
+        if (it == idsByName.end())
+        {
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
+
+    // Hands out the next id the first time a name is seen
+    uint32_t intern(const string &name)
+    {
+        auto it = idsByName.find(name);
+        if (it != idsByName.end())
+        {
+            return it->second;
+        }
+        uint32_t id = names.size();
+        idsByName.insert({name, id});
+        names.push_back(name);
+        return id;
+    }
+
+    const string &nameOf(uint32_t id)
+    {
+        return names[id];
+    }
+
+    // Room for count names without rehashing, e.g. before a recovery interns a known number of them
+    void reserve(size_t count)
+    {
+        idsByName.reserve(count);
+        names.reserve(count);
+    }
+
+    size_t size()
     {
-        this->startTime = startTime;
-        this->endTime = endTime;
-        this->isCurrSlotAvailable = true;
+        return names.size();
     }
 };
 
+// A patient waiting for a (doctor, slot), identified by the booking id handed out when they joined the waitlist
+class WaitlistEntry
+{
+public:
+    int bookingId;
+    PatientId patientId;
+};
+
+// Position of an entry in its waitlist, so that a patient who withdraws is removed in O(1)
+using WaitlistHandle = list<WaitlistEntry>::iterator;
+
+// One day of a doctor's calendar
+class DoctorDay
+{
+public:
+    // Bit i is set when the doctor declared slot i / when slot i is still free to book
+    SlotMask declaredSlots = {};
+    SlotMask availableSlots = {};
+    // Waitlist per slot, created only once somebody actually has to wait for that slot
+    unordered_map<SlotIndex, list<WaitlistEntry>> slotWaitlists;
+    // Booking id of the appointment in each booked slot, so that a withdrawn slot finds its booking. Sized on the
+    // day's first booking.
+    vector<int> slotBookingIds;
+};
+
 class Doctor
 {
 public:
+    DoctorId doctorId;
     string doctorName;
+    SpecialityId specialityId;
     string doctorSpecialization;
-    vector<Slot *> doctorSlots;
-    int doctorAppointmentCount;
-    Doctor(string doctorName, string doctorSpecialization)
+    // The booking window; day d lives at Calendar::ringIndex(d)
+    array<DoctorDay, Calendar::WINDOW_DAYS> days;
+    // Booked appointments over the whole window. Changed under doctorMutex; atomic so that searches can rank by it
+    // without taking the lock
+    atomic<int> doctorAppointmentCount;
+    // Rating 0..5 in tenths, parsed once when a patient rates the doctor
+    atomic<int> ratingTenths;
+    // Guards the days and the appointment count, so bookings for different doctors run in parallel
+    mutex doctorMutex;
+    Doctor(DoctorId doctorId, string doctorName, SpecialityId specialityId, string doctorSpecialization)
     {
+        this->doctorId = doctorId;
         this->doctorName = doctorName;
+        this->specialityId = specialityId;
         this->doctorSpecialization = doctorSpecialization;
         this->doctorAppointmentCount = 0;
+        this->ratingTenths = 0;
+    }
+
+    DoctorDay &dayOf(Day day)
+    {
+        return days[Calendar::ringIndex(day)];
+    }
+
+    // The day left the window: its availability, waitlists and appointments are dropped
+    void clearDay(Day day)
+    {
+        DoctorDay &doctorDay = dayOf(day);
+        doctorAppointmentCount -= (doctorDay.declaredSlots & ~doctorDay.availableSlots).count();
+        doctorDay.declaredSlots = {};
+        doctorDay.availableSlots = {};
+        doctorDay.slotWaitlists.clear();
+        doctorDay.slotBookingIds.clear();
+    }
+
+    // Returns false if the slot was already declared
+    bool markAvailability(Day day, SlotIndex slot)
+    {
+        if (isSlotDeclared(day, slot))
+        {
+            return false;
+        }
+        dayOf(day).declaredSlots.set(slot);
+        dayOf(day).availableSlots.set(slot);
+        return true;
+    }
+
+    bool isSlotDeclared(Day day, SlotIndex slot)
+    {
+        return dayOf(day).declaredSlots.test(slot);
     }
-    bool isValid(string startTime, string endTime)
+
+    bool isSlotAvailable(Day day, SlotIndex slot)
     {
-        int startHour, startMin, endHour, endMin;
-        startHour = stoi(startTime.substr(0, startTime.find(":")));
-        startMin = stoi(startTime.substr(startTime.find(":") + 1));
-        endHour = stoi(endTime.substr(0, endTime.find(":")));
-        endMin = stoi(endTime.substr(endTime.find(":") + 1));
-        if (startHour < 0 || startHour > 23 || endHour < 0 || endHour > 23 || startMin < 0 || startMin > 59 || endMin < 0 || endMin > 59)
+        return dayOf(day).availableSlots.test(slot);
+    }
+
+    bool bookSlot(Day day, SlotIndex slot, int bookingId)
+    {
+        if (isSlotAvailable(day, slot))
+        {
+            DoctorDay &doctorDay = dayOf(day);
+            doctorDay.availableSlots.reset(slot);
+            if (doctorDay.slotBookingIds.empty())
+            {
+                doctorDay.slotBookingIds.resize(SlotTime::slotsPerDay());
+            }
+            doctorDay.slotBookingIds[slot] = bookingId;
+            doctorAppointmentCount++;
+            return true;
+        }
+        return false;
+    }
+
+    // If the patient wishes to book a slot for a particular doctor that is already booked, then add this patient to the waitlist
+    WaitlistHandle addToWaitlist(Day day, SlotIndex slot, WaitlistEntry entry)
+    {
+        list<WaitlistEntry> &waitlist = dayOf(day).slotWaitlists[slot];
+        return waitlist.insert(waitlist.end(), entry);
+    }
+
+    void removeFromWaitlist(Day day, SlotIndex slot, WaitlistHandle handle)
+    {
+        unordered_map<SlotIndex, list<WaitlistEntry>> &slotWaitlists = dayOf(day).slotWaitlists;
+        auto it = slotWaitlists.find(slot);
+        it->second.erase(handle);
+        if (it->second.empty())
+        {
+            slotWaitlists.erase(it);
+        }
+    }
+
+    // Frees a booked slot, a free slot is left as it is. Returns the waitlisted patient who got the slot instead, or an entry with bookingId 0.
+    WaitlistEntry cancelSlot(Day day, SlotIndex slot)
+    {
+        WaitlistEntry newPatient = {0, 0};
+        if (isSlotDeclared(day, slot) && !isSlotAvailable(day, slot))
+        {
+            dayOf(day).availableSlots.set(slot);
+            doctorAppointmentCount--;
+            // If the patient with whom the appointment is booked originally, cancels the appointment, then the first in the waitlist gets the appointment.
+            unordered_map<SlotIndex, list<WaitlistEntry>> &slotWaitlists = dayOf(day).slotWaitlists;
+            auto it = slotWaitlists.find(slot);
+            if (it != slotWaitlists.end())
+            {
+                newPatient = it->second.front();
+                removeFromWaitlist(day, slot, it->second.begin());
+                bookSlot(day, slot, newPatient.bookingId); // Book the slot for the patient in the waitlist
+            }
+        }
+        return newPatient;
+    }
+
+    // The doctor cannot see patients in the slot after all: it is no longer declared, and the ids of its bookings
+    // are appended to bookingIds, the booked one first and then the waitlist in order. Returns false if the slot was
+    // not declared.
+    bool withdrawSlot(Day day, SlotIndex slot, vector<int> &bookingIds)
+    {
+        if (!isSlotDeclared(day, slot))
+        {
+            return false;
+        }
+        DoctorDay &doctorDay = dayOf(day);
+        if (!doctorDay.availableSlots.test(slot))
+        {
+            bookingIds.push_back(doctorDay.slotBookingIds[slot]);
+            doctorAppointmentCount--;
+            auto it = doctorDay.slotWaitlists.find(slot);
+            if (it != doctorDay.slotWaitlists.end())
+            {
+                for (const WaitlistEntry &entry : it->second)
+                {
+                    bookingIds.push_back(entry.bookingId);
+                }
+                doctorDay.slotWaitlists.erase(it);
+            }
+        }
+        doctorDay.declaredSlots.reset(slot);
+        doctorDay.availableSlots.reset(slot);
+        return true;
+    }
+};
+
+enum class AppointmentStatus : uint8_t
+{
+    Booked,
+    Waitlisted
+};
+
+const char *toString(AppointmentStatus status)
+{
+    return status == AppointmentStatus::Booked ? "Booked" : "Waitlisted";
+}
+
+class PatientAppointment
+{
+public:
+    DoctorId doctorId;
+    Day day;
+    SlotIndex slot;
+    AppointmentStatus status;
+};
+
+// A patient's appointments in time order. A patient holds one appointment per slot; only a recovery may briefly
+// replay two, hence the multimap.
+using AppointmentsByTime = multimap<pair<Day, SlotIndex>, PatientAppointment>;
+
+// A patient's appointment as its booking refers to it, so that a cancellation or a promotion finds it in O(1).
+// Valid until the appointment is cancelled or dropped once its day has passed.
+using AppointmentHandle = AppointmentsByTime::iterator;
+
+class Patient
+{
+public:
+    PatientId patientId;
+    string patientName;
+    // Appointments of days that have passed sort first and are dropped lazily, the next time the patient books
+    AppointmentsByTime appointmentsByTime;
+    // Leaf lock for appointmentsByTime; nothing else is acquired while holding it
+    mutex appointmentsMutex;
+    Patient(PatientId patientId, string patientName)
+    {
+        this->patientId = patientId;
+        this->patientName = patientName;
+    }
+
+    // Returns false, and records nothing, if the patient already holds an appointment in that slot of that day.
+    // Checked and recorded under one lock, so two concurrent bookings of the same slot cannot both win.
+    bool bookAppointment(PatientAppointment appointment, Day firstLiveDay, AppointmentHandle &handle)
+    {
+        lock_guard<mutex> lock(appointmentsMutex);
+        appointmentsByTime.erase(appointmentsByTime.begin(), appointmentsByTime.lower_bound({firstLiveDay, 0}));
+        if (appointmentsByTime.count({appointment.day, appointment.slot}) != 0)
+        {
+            return false;
+        }
+        handle = appointmentsByTime.insert({{appointment.day, appointment.slot}, appointment});
+        return true;
+    }
+
+    // Records an appointment as it was saved. A recovery may replay it ahead of the cancellation of an appointment
+    // with another doctor in the same slot, so it is not checked for conflicts.
+    AppointmentHandle restoreAppointment(PatientAppointment appointment)
+    {
+        lock_guard<mutex> lock(appointmentsMutex);
+        return appointmentsByTime.insert({{appointment.day, appointment.slot}, appointment});
+    }
+
+    void cancelAppointment(AppointmentHandle handle)
+    {
+        lock_guard<mutex> lock(appointmentsMutex);
+        appointmentsByTime.erase(handle);
+    }
+
+    // The patient got the slot from the waitlist
+    void markBooked(AppointmentHandle handle)
+    {
+        lock_guard<mutex> lock(appointmentsMutex);
+        handle->second.status = AppointmentStatus::Booked;
+    }
+
+    // Returns false if the patient has no appointment in this slot of this day
+    bool doctorAt(Day day, SlotIndex slot, DoctorId &doctorId)
+    {
+        lock_guard<mutex> lock(appointmentsMutex);
+        auto it = appointmentsByTime.find({day, slot});
+        if (it == appointmentsByTime.end())
+        {
+            return false;
+        }
+        doctorId = it->second.doctorId;
+        return true;
+    }
+
+    // Appointments on firstLiveDay or later, earliest first
+    vector<PatientAppointment> getAppointments(Day firstLiveDay)
+    {
+        lock_guard<mutex> lock(appointmentsMutex);
+        vector<PatientAppointment> appointments;
+        for (auto it = appointmentsByTime.lower_bound({firstLiveDay, 0}); it != appointmentsByTime.end(); it++)
+        {
+            appointments.push_back(it->second);
+        }
+        return appointments;
+    }
+};
+
+// Fixed size record with no heap allocations of its own
+class Booking
+{
+public:
+    PatientId patientId;
+    DoctorId doctorId;
+    Day day;
+    SlotIndex slot;
+    bool isWaitlisted;
+    // Only meaningful while isWaitlisted is set
+    WaitlistHandle waitlistPosition;
+    // The patient's record of the booking
+    AppointmentHandle appointment;
+};
+
+// Booking id -> booking. Ids are handed out by a counter, so bookings live in a dense table indexed by id:
+// fixed size chunks allocated on first use, published through an atomic directory so lookups never hash and
+// never see a chunk move. A cancelled booking leaves a tombstone, which keeps the live bookings in id order.
+// Entries are guarded by striped locks, so concurrent bookings and cancellations rarely contend on the same lock.
+// The directory is a ring: chunk n, holding ids n * CHUNK_SIZE + 1 onwards, sits at n % MAX_CHUNKS, and the oldest
+// chunks are freed once every day booked in them has passed, so the table grows with the window and not with history.
+class BookingTable
+{
+public:
+    static const int CHUNK_SIZE = 4096;
+    // Up to 64M booking ids in the window
+    static const int MAX_CHUNKS = 16384;
+    static const int STRIPE_COUNT = 64;
+    enum BookingState : uint8_t
+    {
+        Empty,
+        Live,
+        Cancelled
+    };
+    class Chunk
+    {
+    public:
+        Booking bookings[CHUNK_SIZE];
+        uint8_t states[CHUNK_SIZE] = {};
+        // Latest day any booking in the chunk is for
+        atomic<Day> lastDay{TODAY};
+    };
+    unique_ptr<atomic<Chunk *>[]> chunks;
+    array<mutex, STRIPE_COUNT> stripes;
+    atomic<int> bookingIdCounter;
+    // Number of the oldest chunk still held; lower ids are gone
+    int firstChunk;
+    // Bookings for earlier days have expired and are no longer found
+    Day firstLiveDay;
+
+    BookingTable() : chunks(new atomic<Chunk *>[MAX_CHUNKS])
+    {
+        for (int i = 0; i < MAX_CHUNKS; i++)
+        {
+            chunks[i] = nullptr;
+        }
+        bookingIdCounter = 1;
+        firstChunk = 0;
+        firstLiveDay = TODAY;
+    }
+
+    ~BookingTable()
+    {
+        for (int i = 0; i < MAX_CHUNKS; i++)
+        {
+            delete chunks[i].exchange(nullptr);
+        }
+    }
+
+    // Returns 0 once the table cannot hold the next id, i.e. MAX_CHUNKS chunks of the window are in use
+    int newBookingId()
+    {
+        int bookingId = bookingIdCounter;
+        do
+        {
+            if (!canHold(bookingId))
+            {
+                return 0;
+            }
+        } while (!bookingIdCounter.compare_exchange_weak(bookingId, bookingId + 1));
+        return bookingId;
+    }
+
+    // Smallest id the table can still hold
+    int firstBookingId()
+    {
+        return firstChunk * CHUNK_SIZE + 1;
+    }
+
+    // Whether a booking with this id can be stored, i.e. its chunk has not been freed and lies within MAX_CHUNKS.
+    // The largest int is never held, so the counter moving past a held id cannot overflow.
+    bool canHold(int bookingId)
+    {
+        int chunkNumber = (bookingId - 1) / CHUNK_SIZE;
+        return bookingId >= 1 && bookingId < INT_MAX && chunkNumber >= firstChunk && chunkNumber - firstChunk < MAX_CHUNKS;
+    }
+
+    // A recovery re-adds bookings under their original ids, so the counter has to move past every one of them
+    void reserveBookingId(int bookingId)
+    {
+        if (bookingIdCounter <= bookingId)
+        {
+            bookingIdCounter = bookingId + 1;
+        }
+    }
+
+    // Restores the id range saved by a snapshot. Called on an empty table.
+    void restart(int firstBookingId, int nextBookingId)
+    {
+        firstChunk = (firstBookingId - 1) / CHUNK_SIZE;
+        bookingIdCounter = nextBookingId;
+    }
+
+    // The id comes from newBookingId, or a recovery checked it with canHold. Returns false if it cannot be held.
+    bool addBooking(int bookingId, Booking booking)
+    {
+        Chunk *chunk = chunkFor(bookingId, true);
+        if (chunk == nullptr)
+        {
+            return false;
+        }
+        lock_guard<mutex> lock(stripeFor(bookingId));
+        chunk->bookings[(bookingId - 1) % CHUNK_SIZE] = booking;
+        chunk->states[(bookingId - 1) % CHUNK_SIZE] = Live;
+        if (chunk->lastDay < booking.day)
+        {
+            chunk->lastDay = booking.day;
+        }
+        return true;
+    }
+
+    bool findBooking(int bookingId, Booking &booking)
+    {
+        Chunk *chunk = chunkFor(bookingId, false);
+        if (chunk == nullptr)
+        {
+            return false;
+        }
+        int offset = (bookingId - 1) % CHUNK_SIZE;
+        lock_guard<mutex> lock(stripeFor(bookingId));
+        if (!isLive(chunk, offset))
+        {
+            return false;
+        }
+        booking = chunk->bookings[offset];
+        return true;
+    }
+
+    // The waitlisted booking got its slot. Called with the doctor's lock held. Returns false if the booking is not
+    // live; otherwise booking is the updated record.
+    bool markBooked(int bookingId, Booking &booking)
+    {
+        Chunk *chunk = chunkFor(bookingId, false);
+        if (chunk == nullptr)
+        {
+            return false;
+        }
+        int offset = (bookingId - 1) % CHUNK_SIZE;
+        lock_guard<mutex> lock(stripeFor(bookingId));
+        if (!isLive(chunk, offset))
+        {
+            return false;
+        }
+        chunk->bookings[offset].isWaitlisted = false;
+        booking = chunk->bookings[offset];
+        return true;
+    }
+
+    // Tombstones the booking, so that only one of several concurrent cancellations of the same id succeeds.
+    // Called with the doctor's lock held, since the waitlist state of the booking is owned by the doctor.
+    bool takeBooking(int bookingId, Booking &booking)
+    {
+        Chunk *chunk = chunkFor(bookingId, false);
+        if (chunk == nullptr)
+        {
+            return false;
+        }
+        int offset = (bookingId - 1) % CHUNK_SIZE;
+        lock_guard<mutex> lock(stripeFor(bookingId));
+        if (!isLive(chunk, offset))
+        {
+            return false;
+        }
+        booking = chunk->bookings[offset];
+        chunk->states[offset] = Cancelled;
+        return true;
+    }
+
+    // Bookings for days before day expire, and the oldest chunks are freed up to the first one that still holds a
+    // booking for day or later. Called while no other thread touches the table.
+    void expireDaysBefore(Day day)
+    {
+        firstLiveDay = day;
+        // The chunk the next id goes to is kept, since ids up to it may still be added
+        int nextChunk = (bookingIdCounter - 1) / CHUNK_SIZE;
+        while (firstChunk < nextChunk)
+        {
+            atomic<Chunk *> &slot = chunks[firstChunk % MAX_CHUNKS];
+            Chunk *chunk = slot;
+            if (chunk != nullptr && chunk->lastDay >= day)
+            {
+                break;
+            }
+            delete chunk;
+            slot = nullptr;
+            firstChunk++;
+        }
+    }
+
+    // Visits the live bookings in id order. Called while no other thread changes the table.
+    template <typename Visitor>
+    void forEachLive(Visitor visitor)
+    {
+        int lastChunk = (bookingIdCounter - 1) / CHUNK_SIZE;
+        for (int chunkNumber = firstChunk; chunkNumber <= lastChunk; chunkNumber++)
+        {
+            Chunk *chunk = chunks[chunkNumber % MAX_CHUNKS];
+            if (chunk == nullptr)
+            {
+                continue;
+            }
+            for (int offset = 0; offset < CHUNK_SIZE; offset++)
+            {
+                if (isLive(chunk, offset))
+                {
+                    visitor(chunkNumber * CHUNK_SIZE + offset + 1, chunk->bookings[offset]);
+                }
+            }
+        }
+    }
+
+private:
+    bool isLive(Chunk *chunk, int offset)
+    {
+        return chunk->states[offset] == Live && chunk->bookings[offset].day >= firstLiveDay;
+    }
+
+    mutex &stripeFor(int bookingId)
+    {
+        return stripes[((bookingId % STRIPE_COUNT) + STRIPE_COUNT) % STRIPE_COUNT];
+    }
+
+    // Chunk holding the given id, or nullptr if the id is out of range or its chunk was never written and create is false
+    Chunk *chunkFor(int bookingId, bool create)
+    {
+        if (!canHold(bookingId))
+        {
+            return nullptr;
+        }
+        atomic<Chunk *> &slot = chunks[((bookingId - 1) / CHUNK_SIZE) % MAX_CHUNKS];
+        Chunk *chunk = slot.load(memory_order_acquire);
+        if (chunk != nullptr || !create)
+        {
+            return chunk;
+        }
+        // Two bookings may race to open the same chunk; the loser frees its copy and uses the winner's
+        Chunk *newChunk = new Chunk();
+        if (slot.compare_exchange_strong(chunk, newChunk, memory_order_acq_rel))
+        {
+            return newChunk;
+        }
+        delete newChunk;
+        return chunk;
+    }
+};
+
+// Epoch based reclamation for structures that searches read without taking a lock. A reader pins the current epoch
+// with an EpochGuard while it uses what it loaded. A writer first publishes the replacement and then retires the old
+// object, which is freed once every pinned reader started after the retirement. Neither side ever waits for the other;
+// the price is that retired memory lingers until the readers that might still see it are gone.
+class Epochs
+{
+private:
+    class alignas(64) ReaderSlot
+    {
+    public:
+        // The epoch the reader pinned, 0 while it reads nothing
+        atomic<uint64_t> pinnedEpoch;
+        atomic<bool> leased;
+    };
+
+    // Gives the slot back when its thread ends
+    class SlotLease
+    {
+    public:
+        ReaderSlot *slot;
+        // Guards nest; only the outermost one pins and unpins
+        int depth;
+
+        SlotLease() : slot(nullptr), depth(0) {}
+
+        ~SlotLease()
+        {
+            if (slot != nullptr)
+            {
+                slot->leased.store(false, memory_order_release);
+            }
+        }
+    };
+
+    class RetiredObject
+    {
+    public:
+        uint64_t epoch;
+        const void *object;
+        void (*destroy)(const void *);
+    };
+
+    // Frees whatever is still waiting when the program ends, once no thread reads any more
+    class RetiredList
+    {
+    public:
+        vector<RetiredObject> objects;
+
+        ~RetiredList()
+        {
+            for (RetiredObject &retiredObject : objects)
+            {
+                retiredObject.destroy(retiredObject.object);
+            }
+        }
+    };
+
+    // Retired objects are freed in batches, so the reader slots are scanned once per this many retirements
+    static const int RECLAIM_INTERVAL = 64;
+    inline static atomic<uint64_t> globalEpoch{1};
+    inline static mutex readersMutex;
+    inline static vector<unique_ptr<ReaderSlot>> readers;
+    inline static thread_local SlotLease lease;
+    inline static mutex retiredMutex;
+    inline static RetiredList retiredObjects;
+    inline static int retiredSinceReclaim = 0;
+
+    static ReaderSlot &localSlot()
+    {
+        if (lease.slot == nullptr)
+        {
+            lock_guard<mutex> lock(readersMutex);
+            for (unique_ptr<ReaderSlot> &slot : readers)
+            {
+                if (!slot->leased.load(memory_order_acquire))
+                {
+                    lease.slot = slot.get();
+                    break;
+                }
+            }
+            if (lease.slot == nullptr)
+            {
+                readers.push_back(unique_ptr<ReaderSlot>(new ReaderSlot()));
+                lease.slot = readers.back().get();
+            }
+            lease.slot->leased.store(true, memory_order_relaxed);
+        }
+        return *lease.slot;
+    }
+
+    // Frees every retired object that no pinned reader can still hold. Called with retiredMutex held.
+    static void reclaim()
+    {
+        uint64_t oldestPinnedEpoch = UINT64_MAX;
+        {
+            lock_guard<mutex> lock(readersMutex);
+            for (unique_ptr<ReaderSlot> &slot : readers)
+            {
+                uint64_t pinnedEpoch = slot->pinnedEpoch.load();
+                if (pinnedEpoch != 0)
+                {
+                    oldestPinnedEpoch = min(oldestPinnedEpoch, pinnedEpoch);
+                }
+            }
+        }
+        // An object retired at epoch e was unlinked before any reader pinned e + 1 or later
+        vector<RetiredObject> &objects = retiredObjects.objects;
+        size_t keptCount = 0;
+        for (RetiredObject &retiredObject : objects)
+        {
+            if (retiredObject.epoch < oldestPinnedEpoch)
+            {
+                retiredObject.destroy(retiredObject.object);
+            }
+            else
+            {
+                objects[keptCount++] = retiredObject;
+            }
+        }
+        objects.resize(keptCount);
+    }
+
+public:
+    // Keeps everything loaded in its scope alive. Pinning is a store to the thread's own slot, so readers do not
+    // contend with each other or with writers.
+    class EpochGuard
+    {
+    public:
+        EpochGuard()
+        {
+            ReaderSlot &slot = localSlot();
+            if (lease.depth++ == 0)
+            {
+                // Sequentially consistent, so no pointer is loaded before a writer scanning the slots can see the pin
+                slot.pinnedEpoch.store(globalEpoch.load());
+            }
+        }
+
+        ~EpochGuard()
+        {
+            if (--lease.depth == 0)
+            {
+                lease.slot->pinnedEpoch.store(0, memory_order_release);
+            }
+        }
+
+        EpochGuard(const EpochGuard &) = delete;
+        EpochGuard &operator=(const EpochGuard &) = delete;
+    };
+
+    // Deletes object once no reader can reach it any more. Call after the object has been unlinked.
+    template <typename T>
+    static void retire(const T *object)
+    {
+        if (object == nullptr)
+        {
+            return;
+        }
+        uint64_t epoch = globalEpoch.fetch_add(1);
+        lock_guard<mutex> lock(retiredMutex);
+        retiredObjects.objects.push_back({epoch, object, [](const void *retired)
+                                          { delete static_cast<const T *>(retired); }});
+        if (++retiredSinceReclaim == RECLAIM_INTERVAL)
+        {
+            retiredSinceReclaim = 0;
+            reclaim();
+        }
+    }
+};
+
+// Keeps the currently available slots of every speciality and day ordered by start time, so that
+// a search only walks the slots it returns instead of every registered doctor.
+// Searches read it without locks: every speciality and day is an immutable AvailabilityVersion behind an atomic
+// pointer. Writers stage their changes while they hold the doctor's lock and publish them in one new version per
+// speciality and day when the lock is released (see IndexCommit); the slots a change did not touch are shared with the
+// previous version, and replaced versions are retired through Epochs.
+class SpecialityAvailabilityIndex
+{
+public:
+    // The doctors offering one slot, ordered by id
+    using SlotDoctors = vector<Doctor *>;
+
+    class AvailabilityVersion
+    {
+    public:
+        Day day;
+        // Indexed by slot; nullptr when no doctor offers the slot
+        array<const SlotDoctors *, SlotGrid::MAX_SLOTS_PER_DAY> slotDoctors;
+        // The slots with a non-empty list, so that a query can rule out or find a slot with a mask AND
+        SlotMask freeSlots;
+    };
+
+    class SpecialitySlots
+    {
+    public:
+        // Orders the writers of the speciality; searches never take it
+        mutex writerMutex;
+        // The current version of every day of the window, at Calendar::ringIndex(day), or nullptr if nothing is free
+        array<atomic<const AvailabilityVersion *>, Calendar::WINDOW_DAYS> versions;
+
+        SpecialitySlots()
+        {
+            for (atomic<const AvailabilityVersion *> &version : versions)
+            {
+                version.store(nullptr, memory_order_relaxed);
+            }
+        }
+    };
+
+    // Speciality name -> slots. Replaced as a whole when a speciality is added, which is rare.
+    using SpecialityDirectory = unordered_map<string, SpecialitySlots *>;
+
+private:
+    class SlotChange
+    {
+    public:
+        SpecialitySlots *specialitySlots;
+        Day day;
+        SlotIndex slot;
+        Doctor *doctor;
+        bool available;
+    };
+
+    inline static thread_local vector<SlotChange> stagedChanges;
+
+    static bool byDoctorId(const Doctor *a, const Doctor *b)
+    {
+        return a->doctorId < b->doctorId;
+    }
+
+    // Unlinks a version together with its slot lists
+    static void retireVersion(const AvailabilityVersion *version)
+    {
+        if (version == nullptr)
+        {
+            return;
+        }
+        for (const SlotDoctors *doctors : version->slotDoctors)
+        {
+            Epochs::retire(doctors);
+        }
+        Epochs::retire(version);
+    }
+
+    static void clearVersion(atomic<const AvailabilityVersion *> &version)
+    {
+        retireVersion(version.exchange(nullptr));
+    }
+
+    // Applies the staged changes [first, last), all of one speciality and day and ordered by slot, as one new version
+    void publish(vector<SlotChange>::iterator first, vector<SlotChange>::iterator last)
+    {
+        SpecialitySlots *specialitySlots = first->specialitySlots;
+        Day day = first->day;
+        lock_guard<mutex> lock(specialitySlots->writerMutex);
+        atomic<const AvailabilityVersion *> &currentVersion = specialitySlots->versions[Calendar::ringIndex(day)];
+        const AvailabilityVersion *oldVersion = currentVersion.load(memory_order_relaxed);
+        if (oldVersion != nullptr && oldVersion->day != day)
+        {
+            // Left over from a day that already left the window
+            clearVersion(currentVersion);
+            oldVersion = nullptr;
+        }
+        AvailabilityVersion *newVersion = new AvailabilityVersion();
+        newVersion->day = day;
+        if (oldVersion != nullptr)
+        {
+            newVersion->slotDoctors = oldVersion->slotDoctors;
+            newVersion->freeSlots = oldVersion->freeSlots;
+        }
+        else
+        {
+            newVersion->slotDoctors.fill(nullptr);
+            newVersion->freeSlots = {};
+        }
+        vector<const SlotDoctors *> replacedSlots;
+        while (first != last)
+        {
+            SlotIndex slot = first->slot;
+            const SlotDoctors *oldDoctors = newVersion->slotDoctors[slot];
+            SlotDoctors *doctors = oldDoctors != nullptr ? new SlotDoctors(*oldDoctors) : new SlotDoctors();
+            for (; first != last && first->slot == slot; first++)
+            {
+                auto position = lower_bound(doctors->begin(), doctors->end(), first->doctor, byDoctorId);
+                bool isListed = position != doctors->end() && *position == first->doctor;
+                if (first->available && !isListed)
+                {
+                    doctors->insert(position, first->doctor);
+                }
+                else if (!first->available && isListed)
+                {
+                    doctors->erase(position);
+                }
+            }
+            if (doctors->empty())
+            {
+                delete doctors;
+                doctors = nullptr;
+                newVersion->freeSlots.reset(slot);
+            }
+            else
+            {
+                newVersion->freeSlots.set(slot);
+            }
+            newVersion->slotDoctors[slot] = doctors;
+            replacedSlots.push_back(oldDoctors);
+        }
+        currentVersion.store(newVersion);
+        Epochs::retire(oldVersion);
+        for (const SlotDoctors *doctors : replacedSlots)
+        {
+            Epochs::retire(doctors);
+        }
+    }
+
+public:
+    // Indexed by SpecialityId. Specialities are only added while FlipCare holds its registry lock exclusively,
+    // so writers, which hold it shared, need no lock of their own to look one up
+    vector<SpecialitySlots *> availableSlotsBySpeciality;
+    ObjectPool<SpecialitySlots> specialitySlotsPool;
+    atomic<const SpecialityDirectory *> specialities;
+
+    SpecialityAvailabilityIndex() : specialities(new SpecialityDirectory()) {}
+
+    SpecialityAvailabilityIndex(const SpecialityAvailabilityIndex &) = delete;
+    SpecialityAvailabilityIndex &operator=(const SpecialityAvailabilityIndex &) = delete;
+
+    ~SpecialityAvailabilityIndex()
+    {
+        // Only the writers free memory, so the objects that are still current belong to nobody else
+        for (SpecialitySlots *specialitySlots : availableSlotsBySpeciality)
+        {
+            for (atomic<const AvailabilityVersion *> &version : specialitySlots->versions)
+            {
+                const AvailabilityVersion *current = version.load();
+                if (current != nullptr)
+                {
+                    for (const SlotDoctors *doctors : current->slotDoctors)
+                    {
+                        delete doctors;
+                    }
+                    delete current;
+                }
+            }
+        }
+        delete specialities.load();
+    }
+
+    void addSpeciality(SpecialityId specialityId, const string &speciality)
+    {
+        while (availableSlotsBySpeciality.size() <= specialityId)
+        {
+            availableSlotsBySpeciality.push_back(specialitySlotsPool.create());
+        }
+        const SpecialityDirectory *oldDirectory = specialities.load();
+        if (oldDirectory->count(speciality) == 0)
+        {
+            SpecialityDirectory *newDirectory = new SpecialityDirectory(*oldDirectory);
+            (*newDirectory)[speciality] = availableSlotsBySpeciality[specialityId];
+            specialities.store(newDirectory);
+            Epochs::retire(oldDirectory);
+        }
+    }
+
+    // addSlot and removeSlot stage a change of the calling thread; it becomes visible at publishStaged
+    void addSlot(Doctor *doctor, Day day, SlotIndex slot)
+    {
+        stagedChanges.push_back({availableSlotsBySpeciality[doctor->specialityId], day, slot, doctor, true});
+    }
+
+    void removeSlot(Doctor *doctor, Day day, SlotIndex slot)
+    {
+        stagedChanges.push_back({availableSlotsBySpeciality[doctor->specialityId], day, slot, doctor, false});
+    }
+
+    // Publishes what this thread staged, one version per speciality and day; the changes to a slot apply in the order
+    // they were made
+    void publishStaged()
+    {
+        if (stagedChanges.empty())
+        {
+            return;
+        }
+        stable_sort(stagedChanges.begin(), stagedChanges.end(), [](const SlotChange &a, const SlotChange &b)
+                    { return tie(a.specialitySlots, a.day, a.slot) < tie(b.specialitySlots, b.day, b.slot); });
+        for (auto first = stagedChanges.begin(); first != stagedChanges.end();)
+        {
+            auto last = find_if(first, stagedChanges.end(), [&](const SlotChange &change)
+                                { return change.specialitySlots != first->specialitySlots || change.day != first->day; });
+            publish(first, last);
+            first = last;
+        }
+        stagedChanges.clear();
+    }
+
+    // clearDay and clearSlots take effect at once. They are called with FlipCare's registry lock held exclusively,
+    // so nothing is staged meanwhile.
+    void clearDay(Day day)
+    {
+        for (SpecialitySlots *specialitySlots : availableSlotsBySpeciality)
+        {
+            clearVersion(specialitySlots->versions[Calendar::ringIndex(day)]);
+        }
+    }
+
+    void clearSlots()
+    {
+        for (SpecialitySlots *specialitySlots : availableSlotsBySpeciality)
+        {
+            for (atomic<const AvailabilityVersion *> &version : specialitySlots->versions)
+            {
+                clearVersion(version);
+            }
+        }
+    }
+
+    // At most limit slots, earliest first, as {slot, doctor}
+    vector<pair<SlotIndex, Doctor *>> getSlots(const string &speciality, Day day, size_t limit = SIZE_MAX)
+    {
+        return getSlotsAfter(speciality, day, {-1, 0}, limit);
+    }
+
+    // At most limit slots that come strictly after the given {slot, doctorId} in start time order. Lock-free: the
+    // result is read from the version that was current when the search started.
+    vector<pair<SlotIndex, Doctor *>> getSlotsAfter(const string &speciality, Day day, pair<SlotIndex, DoctorId> after, size_t limit)
+    {
+        vector<pair<SlotIndex, Doctor *>> slots;
+        Epochs::EpochGuard epochGuard;
+        const AvailabilityVersion *version = findVersion(speciality, day);
+        if (version == nullptr)
+        {
+            return slots;
+        }
+        for (SlotIndex slot = max(after.first, 0); slot < SlotTime::slotsPerDay() && slots.size() < limit; slot++)
+        {
+            const SlotDoctors *doctors = version->slotDoctors[slot];
+            if (doctors == nullptr)
+            {
+                continue;
+            }
+            auto doctorIt = doctors->begin();
+            if (slot == after.first)
+            {
+                doctorIt = partition_point(doctors->begin(), doctors->end(), [&](const Doctor *doctor)
+                                           { return doctor->doctorId <= after.second; });
+            }
+            for (; doctorIt != doctors->end() && slots.size() < limit; doctorIt++)
+            {
+                slots.push_back({slot, *doctorIt});
+            }
+        }
+        return slots;
+    }
+
+    // The earliest of the given slots that a doctor of the speciality has free, once for each of the first limit
+    // doctors free then
+    vector<pair<SlotIndex, Doctor *>> getEarliestSlot(const string &speciality, Day day, SlotMask candidateSlots, size_t limit)
+    {
+        vector<pair<SlotIndex, Doctor *>> slots;
+        Epochs::EpochGuard epochGuard;
+        const AvailabilityVersion *version = findVersion(speciality, day);
+        SlotIndex slot = version != nullptr ? (version->freeSlots & candidateSlots).first() : -1;
+        if (slot >= 0)
+        {
+            const SlotDoctors &doctors = *version->slotDoctors[slot];
+            for (auto doctorIt = doctors.begin(); doctorIt != doctors.end() && slots.size() < limit; doctorIt++)
+            {
+                slots.push_back({slot, *doctorIt});
+            }
+        }
+        return slots;
+    }
+
+    // Every free slot of the speciality among the given slots, earliest first
+    vector<pair<SlotIndex, Doctor *>> getSlotsIn(const string &speciality, Day day, SlotMask candidateSlots)
+    {
+        vector<pair<SlotIndex, Doctor *>> slots;
+        Epochs::EpochGuard epochGuard;
+        const AvailabilityVersion *version = findVersion(speciality, day);
+        if (version != nullptr)
+        {
+            (version->freeSlots & candidateSlots).forEach([&](SlotIndex slot)
+                                                         {
+                for (Doctor *doctor : *version->slotDoctors[slot])
+                {
+                    slots.push_back({slot, doctor});
+                } });
+        }
+        return slots;
+    }
+
+private:
+    // The speciality's current version of the day, or nullptr if it has nothing free. Call under an EpochGuard.
+    const AvailabilityVersion *findVersion(const string &speciality, Day day)
+    {
+        const SpecialityDirectory *directory = specialities.load();
+        auto specialityIt = directory->find(speciality);
+        if (specialityIt == directory->end())
+        {
+            return nullptr;
+        }
+        const AvailabilityVersion *version = specialityIt->second->versions[Calendar::ringIndex(day)].load();
+        // A version of another day is one that is about to be cleared by a rollover
+        return version != nullptr && version->day == day ? version : nullptr;
+    }
+};
+
+// Declared right after a doctor's lock: publishes the index changes made under the lock before the lock is released,
+// so a speciality's versions follow each doctor's changes in order
+class IndexCommit
+{
+private:
+    SpecialityAvailabilityIndex &availabilityIndex;
+
+public:
+    IndexCommit(SpecialityAvailabilityIndex &availabilityIndex) : availabilityIndex(availabilityIndex) {}
+
+    ~IndexCommit()
+    {
+        availabilityIndex.publishStaged();
+    }
+};
+
+// Trending Doctor: doctors ordered by their number of booked appointments, globally and per speciality.
+// Every change in a doctor's count is a single erase + insert, so the leaders can be read at any point of time.
+class TrendingDoctors
+{
+public:
+    // {-appointmentCount, doctorId}, so that the most booked doctor comes first
+    set<pair<int, DoctorId>> allDoctors;
+    // Indexed by SpecialityId
+    vector<set<pair<int, DoctorId>>> doctorsBySpeciality;
+    mutex trendingMutex;
+
+    void addDoctor(Doctor *doctor)
+    {
+        lock_guard<mutex> lock(trendingMutex);
+        if (doctorsBySpeciality.size() <= doctor->specialityId)
+        {
+            doctorsBySpeciality.resize(doctor->specialityId + 1);
+        }
+        allDoctors.insert({-doctor->doctorAppointmentCount, doctor->doctorId});
+        doctorsBySpeciality[doctor->specialityId].insert({-doctor->doctorAppointmentCount, doctor->doctorId});
+    }
+
+    void updateCount(Doctor *doctor, int oldAppointmentCount)
+    {
+        if (oldAppointmentCount == doctor->doctorAppointmentCount)
+        {
+            return;
+        }
+        lock_guard<mutex> lock(trendingMutex);
+        set<pair<int, DoctorId>> &specialityDoctors = doctorsBySpeciality[doctor->specialityId];
+        allDoctors.erase({-oldAppointmentCount, doctor->doctorId});
+        specialityDoctors.erase({-oldAppointmentCount, doctor->doctorId});
+        allDoctors.insert({-doctor->doctorAppointmentCount, doctor->doctorId});
+        specialityDoctors.insert({-doctor->doctorAppointmentCount, doctor->doctorId});
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lock(trendingMutex);
+        allDoctors.clear();
+        for (set<pair<int, DoctorId>> &specialityDoctors : doctorsBySpeciality)
+        {
+            specialityDoctors.clear();
+        }
+    }
+
+    // Top k doctors as {doctorId, appointmentCount}, among all doctors or within one speciality
+    vector<pair<DoctorId, int>> getTopDoctors(int k)
+    {
+        lock_guard<mutex> lock(trendingMutex);
+        return topOf(allDoctors, k);
+    }
+
+    vector<pair<DoctorId, int>> getTopDoctors(int k, SpecialityId specialityId)
+    {
+        lock_guard<mutex> lock(trendingMutex);
+        return topOf(doctorsBySpeciality[specialityId], k);
+    }
+
+private:
+    static vector<pair<DoctorId, int>> topOf(const set<pair<int, DoctorId>> &rankedDoctors, int k)
+    {
+        vector<pair<DoctorId, int>> topDoctors;
+        for (auto it = rankedDoctors.begin(); it != rankedDoctors.end() && int(topDoctors.size()) < k; it++)
+        {
+            topDoctors.push_back({it->second, -it->first});
+        }
+        return topDoctors;
+    }
+};
+
+// Ranking policies for the speciality search. A policy maps every candidate slot to one integer key up front, and
+// candidates are ordered by that key alone (lower first; ties keep start time order), so ranking never calls
+// back into the policy or compares strings. Policies are template parameters, so the key is inlined.
+class RankingInput
+{
+public:
+    SlotIndex slot;
+    // Doctor rating 0..5 in tenths
+    int ratingTenths;
+    int appointmentCount;
+};
+
+class RankByStartTime
+{
+public:
+    // The availability index is already ordered by start time, so the top k are just its first k entries
+    static const bool FOLLOWS_INDEX_ORDER = true;
+    static int64_t key(const RankingInput &input)
+    {
+        return input.slot;
+    }
+};
+
+class RankByRating
+{
+public:
+    static const bool FOLLOWS_INDEX_ORDER = false;
+    static int64_t key(const RankingInput &input)
+    {
+        return -input.ratingTenths;
+    }
+};
+
+class RankByAppointmentCount
+{
+public:
+    static const bool FOLLOWS_INDEX_ORDER = false;
+    static int64_t key(const RankingInput &input)
+    {
+        return -input.appointmentCount;
+    }
+};
+
+// Higher rating and more appointments rank a slot up, a later start ranks it down
+template <int RatingWeight, int AppointmentCountWeight, int StartTimeWeight>
+class RankWeighted
+{
+public:
+    static const bool FOLLOWS_INDEX_ORDER = false;
+    static int64_t key(const RankingInput &input)
+    {
+        return -int64_t(RatingWeight) * input.ratingTenths - int64_t(AppointmentCountWeight) * input.appointmentCount +
+               int64_t(StartTimeWeight) * input.slot;
+    }
+};
+
+// Durability. Every change is appended to a write-ahead journal of compact binary records, and snapshots of the
+// whole state bound how much of the journal a restart has to replay. Both are plain files; no database is involved.
+// CRC-32 (IEEE), eight bytes per step with the slicing-by-8 tables, so checksumming a whole journal at recovery
+// costs far less than replaying it
+class Crc32
+{
+public:
+    static uint32_t compute(const char *data, size_t length)
+    {
+        static const array<array<uint32_t, 256>, 8> tables = makeTables();
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        uint32_t crc = 0xFFFFFFFF;
+        for (; length >= 8; bytes += 8, length -= 8)
+        {
+            uint32_t low, high;
+            memcpy(&low, bytes, 4);
+            memcpy(&high, bytes + 4, 4);
+            low ^= crc;
+            crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24] ^
+                  tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+        }
+        for (; length > 0; bytes++, length--)
+        {
+            crc = tables[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+private:
+    static array<array<uint32_t, 256>, 8> makeTables()
+    {
+        array<array<uint32_t, 256>, 8> tables;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+            }
+            tables[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            for (int table = 1; table < 8; table++)
+            {
+                tables[table][i] = (tables[table - 1][i] >> 8) ^ tables[0][tables[table - 1][i] & 0xFF];
+            }
+        }
+        return tables;
+    }
+};
+
+// Every record is its type byte followed by fixed width little endian fields; names are a uint32 length and the bytes.
+//   RegisterDoctor   doctorId, name, speciality
+//   RegisterPatient  patientId, name
+//   Availability     doctorId, day, SlotMask of the newly declared slots (two uint64 words)
+//   Book             bookingId, doctorId, patientId, day, slot (uint8)
+//   Cancel           bookingId
+//   WaitlistPromote  bookingId of the waitlisted booking that got the slot, right after the Cancel that freed it
+//   Rate             doctorId, ratingTenths
+//   NewDay           first day of the window; also the first record of a journal, so a replay starts from its window
+//   Withdraw         doctorId, day, SlotMask of the withdrawn slots; their bookings are cancelled without promotions,
+//                    and the rebookings with other doctors follow as Book records
+enum class JournalRecordType : uint8_t
+{
+    RegisterDoctor = 1,
+    RegisterPatient,
+    Availability,
+    Book,
+    Cancel,
+    WaitlistPromote,
+    Rate,
+    NewDay,
+    Withdraw
+};
+
+class JournalOptions
+{
+public:
+    string journalPath;
+    // Optional. Without a snapshot a restart replays the whole journal.
+    string snapshotPath;
+    // A snapshot is taken this often while the journal is open, 0 only on saveSnapshot()
+    int snapshotIntervalMillis = 0;
+    // Records appended within this window go to the file as one batch
+    int groupCommitMicros = 200;
+    // fdatasync at most this often; 0 syncs every batch, negative never syncs and leaves write back to the OS
+    int syncIntervalMicros = 5000;
+    // Mutating calls return only once their records are durable. Concurrent callers share one fdatasync.
+    bool synchronousCommit = false;
+    // Appenders wait while this much is buffered and not yet written
+    size_t maxBufferedBytes = 64 << 20;
+};
+
+class JournalStats
+{
+public:
+    uint64_t fileBytes;
+    long long batchCount;
+    long long syncCount;
+    // errno of the first failed write or sync, 0 if there was none
+    int errorNumber;
+};
+
+// Append-only journal file. Engine threads copy their records into a shared buffer under a short lock; a writer
+// thread hands the buffer to the file as one checksummed batch (group commit) and syncs it as configured, so a
+// booking pays for a memcpy rather than a system call. File layout: a 20 byte header {MAGIC, VERSION, slot minutes,
+// opening minute, closing minute}, then batches of {uint32 payload size, uint32 CRC-32 of the payload, records}.
+// A batch torn by a crash fails its checksum and is dropped by the recovery, together with everything after it.
+class Journal
+{
+public:
+    static const uint32_t MAGIC = 0x4A434646;
+    static const uint32_t VERSION = 3;
+    static const size_t FILE_HEADER_SIZE = 20;
+    static const size_t BATCH_HEADER_SIZE = 8;
+    // A batch is written early once it grows this large
+    static const size_t BATCH_TRIGGER_BYTES = 1 << 20;
+    // Position after this thread's latest record, in bytes of records appended since the journal was opened
+    inline static thread_local uint64_t lastAppendedLsn = 0;
+
+private:
+    int fd;
+    JournalOptions options;
+    mutex bufferMutex;
+    condition_variable writerWakeup;
+    condition_variable bufferSpace;
+    condition_variable progress;
+    string pending;
+    string writing;
+    uint64_t appendedLsn = 0;
+    uint64_t writtenLsn = 0;
+    uint64_t syncedLsn = 0;
+    uint64_t fileOffset;
+    int durabilityWaiters = 0;
+    bool flushRequested = false;
+    bool stopping = false;
+    long long batchCount = 0;
+    long long syncCount = 0;
+    int errorNumber = 0;
+    thread writer;
+
+    void put(JournalRecordType type)
+    {
+        pending.push_back(static_cast<char>(type));
+    }
+
+    void put(uint8_t value)
+    {
+        pending.push_back(static_cast<char>(value));
+    }
+
+    void put(uint32_t value)
+    {
+        pending.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void put(int32_t value)
+    {
+        pending.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void put(const SlotMask &mask)
+    {
+        pending.append(reinterpret_cast<const char *>(mask.words), sizeof(mask.words));
+    }
+
+    void put(string_view text)
+    {
+        put(uint32_t(text.size()));
+        pending.append(text);
+    }
+
+    uint64_t durableLsn()
+    {
+        return options.syncIntervalMicros < 0 ? writtenLsn : syncedLsn;
+    }
+
+    bool writeFully(const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    void writerLoop()
+    {
+        unique_lock<mutex> lock(bufferMutex);
+        auto lastSync = chrono::steady_clock::now();
+        auto hasWork = [this]
+        { return stopping || flushRequested || !pending.empty() || (durabilityWaiters > 0 && durableLsn() < appendedLsn); };
+        while (true)
+        {
+            if (options.syncIntervalMicros >= 0 && syncedLsn < writtenLsn)
+            {
+                writerWakeup.wait_until(lock, lastSync + chrono::microseconds(options.syncIntervalMicros), hasWork);
+            }
+            else
+            {
+                writerWakeup.wait(lock, hasWork);
+            }
+            // Group commit: let other threads add their records to this batch, unless somebody is waiting for it
+            if (!pending.empty() && !stopping && !flushRequested && durabilityWaiters == 0 && options.groupCommitMicros > 0)
+            {
+                writerWakeup.wait_for(lock, chrono::microseconds(options.groupCommitMicros), [this]
+                                      { return stopping || flushRequested || durabilityWaiters > 0 || pending.size() >= BATCH_TRIGGER_BYTES; });
+            }
+            bool stop = stopping;
+            uint64_t batchLsn = appendedLsn;
+            bool sync = options.syncIntervalMicros >= 0 && syncedLsn < batchLsn &&
+                        (stop || flushRequested || durabilityWaiters > 0 || chrono::steady_clock::now() - lastSync >= chrono::microseconds(options.syncIntervalMicros));
+            flushRequested = false;
+            swap(pending, writing);
+            bufferSpace.notify_all();
+            lock.unlock();
+
+            bool ok = true;
+            uint64_t batchBytes = 0;
+            if (!writing.empty())
+            {
+                uint32_t header[2] = {uint32_t(writing.size()), Crc32::compute(writing.data(), writing.size())};
+                ok = writeFully(reinterpret_cast<const char *>(header), sizeof(header)) && writeFully(writing.data(), writing.size());
+                batchBytes = BATCH_HEADER_SIZE + writing.size();
+                writing.clear();
+            }
+            if (ok && sync)
+            {
+                ok = fdatasync(fd) == 0;
+            }
+            int writeError = ok ? 0 : errno;
+
+            lock.lock();
+            if (writeError != 0 && errorNumber == 0)
+            {
+                errorNumber = writeError;
+            }
+            batchCount += batchBytes > 0;
+            syncCount += sync;
+            fileOffset += batchBytes;
+            writtenLsn = batchLsn;
+            if (sync)
+            {
+                syncedLsn = batchLsn;
+                lastSync = chrono::steady_clock::now();
+            }
+            progress.notify_all();
+            if (stop)
+            {
+                return;
+            }
+        }
+    }
+
+public:
+    // Takes over fd, positioned at fileOffset, the end of the last intact batch
+    Journal(int fd, uint64_t fileOffset, JournalOptions options)
+    {
+        this->fd = fd;
+        this->fileOffset = fileOffset;
+        this->options = options;
+        writer = thread(&Journal::writerLoop, this);
+    }
+
+    ~Journal()
+    {
+        close();
+    }
+
+    // Appends the fields as one unit, so records appended together are never split across batches.
+    // Blocks while maxBufferedBytes are waiting for the writer.
+    template <typename... Fields>
+    void append(const Fields &...fields)
+    {
+        unique_lock<mutex> lock(bufferMutex);
+        bufferSpace.wait(lock, [this]
+                         { return pending.size() < options.maxBufferedBytes || stopping; });
+        bool wasEmpty = pending.empty();
+        size_t sizeBefore = pending.size();
+        (put(fields), ...);
+        appendedLsn += pending.size() - sizeBefore;
+        lastAppendedLsn = appendedLsn;
+        if (wasEmpty || pending.size() >= BATCH_TRIGGER_BYTES)
+        {
+            writerWakeup.notify_one();
+        }
+    }
+
+    // With synchronousCommit, waits until the records up to lsn are durable
+    void commit(uint64_t lsn)
+    {
+        if (!options.synchronousCommit)
+        {
+            return;
+        }
+        unique_lock<mutex> lock(bufferMutex);
+        if (durableLsn() >= lsn)
+        {
+            return;
+        }
+        durabilityWaiters++;
+        writerWakeup.notify_one();
+        progress.wait(lock, [this, lsn]
+                      { return durableLsn() >= lsn || errorNumber != 0; });
+        durabilityWaiters--;
+    }
+
+    // Writes and syncs everything appended so far. Returns the file offset right after it, which is exact only
+    // while nobody appends concurrently.
+    uint64_t flush()
+    {
+        unique_lock<mutex> lock(bufferMutex);
+        uint64_t target = appendedLsn;
+        flushRequested = true;
+        writerWakeup.notify_one();
+        progress.wait(lock, [this, target]
+                      { return durableLsn() >= target || errorNumber != 0; });
+        return fileOffset;
+    }
+
+    const JournalOptions &getOptions()
+    {
+        return options;
+    }
+
+    JournalStats getStats()
+    {
+        lock_guard<mutex> lock(bufferMutex);
+        return {fileOffset, batchCount, syncCount, errorNumber};
+    }
+
+    // Writes out and syncs what is left, then closes the file
+    void close()
+    {
+        {
+            lock_guard<mutex> lock(bufferMutex);
+            if (!writer.joinable())
+            {
+                return;
+            }
+            stopping = true;
+            writerWakeup.notify_one();
+            bufferSpace.notify_all();
+        }
+        writer.join();
+        ::close(fd);
+    }
+};
+
+// Declared ahead of the locks of a mutating call. With synchronousCommit the call then waits for its records to become
+// durable after it has released its locks, and threads waiting together share one fdatasync.
+class JournalCommit
+{
+private:
+    Journal *journal;
+
+public:
+    JournalCommit(Journal *journal) : journal(journal)
+    {
+        Journal::lastAppendedLsn = 0;
+    }
+
+    ~JournalCommit()
+    {
+        if (journal != nullptr && Journal::lastAppendedLsn != 0)
+        {
+            journal->commit(Journal::lastAppendedLsn);
+        }
+    }
+};
+
+// Bounded queue between many producers and one consumer. Producers hand over whole batches and wait while the
+// queue is full, so a consumer that falls behind slows the producers down instead of letting the backlog grow.
+template <typename T>
+class BoundedQueue
+{
+private:
+    mutex queueMutex;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    long long producerWaitCount = 0;
+
+public:
+    BoundedQueue(size_t capacity) : capacity(max<size_t>(1, capacity)) {}
+
+    // Appends the items in order, waiting for room whenever the queue is full. Leaves batch empty.
+    void pushAll(vector<T> &batch)
+    {
+        unique_lock<mutex> lock(queueMutex);
+        for (size_t next = 0; next < batch.size();)
+        {
+            if (items.size() >= capacity)
+            {
+                producerWaitCount++;
+                notFull.wait(lock, [this]
+                             { return items.size() < capacity; });
+            }
+            // The consumer only ever waits for an empty queue
+            if (items.empty())
+            {
+                notEmpty.notify_one();
+            }
+            while (next < batch.size() && items.size() < capacity)
+            {
+                items.push_back(move(batch[next++]));
+            }
+        }
+        batch.clear();
+    }
+
+    // Waits for items and moves up to maxCount of them into batch. Returns false once the queue is closed and empty.
+    bool popBatch(vector<T> &batch, size_t maxCount)
+    {
+        unique_lock<mutex> lock(queueMutex);
+        notEmpty.wait(lock, [this]
+                      { return closed || !items.empty(); });
+        batch.clear();
+        while (!items.empty() && batch.size() < maxCount)
+        {
+            batch.push_back(move(items.front()));
+            items.pop_front();
+        }
+        notFull.notify_all();
+        return !batch.empty();
+    }
+
+    // The consumer drains what is left, then popBatch returns false
+    void close()
+    {
+        lock_guard<mutex> lock(queueMutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+    long long getProducerWaitCount()
+    {
+        lock_guard<mutex> lock(queueMutex);
+        return producerWaitCount;
+    }
+};
+
+// A waitlisted booking that was handed the slot its holder cancelled
+class WaitlistPromotion
+{
+public:
+    int bookingId;
+    PatientId patientId;
+    DoctorId doctorId;
+    Day day;
+    SlotIndex slot;
+};
+
+// Promotions are staged per thread while the engine holds its locks and queued in one go by the destructor, after
+// the locks are released and the journal commit has returned, so a patient only hears of a slot that is theirs.
+class NotificationCommit
+{
+private:
+    BoundedQueue<WaitlistPromotion> *queue;
+
+public:
+    inline static thread_local vector<WaitlistPromotion> stagedPromotions;
+
+    NotificationCommit(BoundedQueue<WaitlistPromotion> *queue) : queue(queue)
+    {
+        stagedPromotions.clear();
+    }
+
+    ~NotificationCommit()
+    {
+        if (queue != nullptr && !stagedPromotions.empty())
+        {
+            queue->pushAll(stagedPromotions);
+        }
+    }
+};
+
+// Read-only mapping of a whole file
+class MappedFile
+{
+public:
+    const char *data = nullptr;
+    size_t size = 0;
+
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (data != nullptr)
+        {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+
+    bool map(int fd, size_t fileSize)
+    {
+        if (fileSize == 0)
+        {
+            return true;
+        }
+        void *mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        // Recovery reads front to back exactly once
+        madvise(mapping, fileSize, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(mapping);
+        size = fileSize;
+        return true;
+    }
+
+    // Returns false if the file does not exist or cannot be mapped
+    bool open(const string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat fileStat;
+        bool mapped = fstat(fd, &fileStat) == 0 && map(fd, fileStat.st_size);
+        ::close(fd);
+        return mapped;
+    }
+};
+
+// Replaces the file in one step: a crash leaves either the old or the new contents, never a mix
+bool writeFileAtomically(const string &path, const string &contents)
+{
+    string temporaryPath = path + ".tmp";
+    int fd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    size_t written = 0;
+    while (written < contents.size())
+    {
+        ssize_t count = ::write(fd, contents.data() + written, contents.size() - written);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            break;
+        }
+        written += count;
+    }
+    bool ok = written == contents.size() && fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(temporaryPath.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+    // The rename is durable once the directory is
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : path.substr(0, slash + 1);
+    int directoryFd = ::open(directory.c_str(), O_RDONLY);
+    if (directoryFd >= 0)
+    {
+        fsync(directoryFd);
+        ::close(directoryFd);
+    }
+    return true;
+}
+
+// Bounds checked decoding of journal records
+class JournalReader
+{
+private:
+    const char *position;
+    const char *end;
+
+public:
+    bool ok = true;
+
+    JournalReader(const char *data, size_t length) : position(data), end(data + length) {}
+
+    bool atEnd()
+    {
+        return position == end;
+    }
+
+    uint8_t readByte()
+    {
+        if (position == end)
+        {
+            ok = false;
+            return 0;
+        }
+        return static_cast<uint8_t>(*position++);
+    }
+
+    uint32_t readUint32()
+    {
+        uint32_t value = 0;
+        if (end - position < 4)
+        {
+            ok = false;
+            position = end;
+            return 0;
+        }
+        memcpy(&value, position, sizeof(value));
+        position += sizeof(value);
+        return value;
+    }
+
+    int32_t readInt32()
+    {
+        return static_cast<int32_t>(readUint32());
+    }
+
+    SlotMask readSlotMask()
+    {
+        SlotMask mask = {};
+        if (size_t(end - position) < sizeof(mask.words))
+        {
+            ok = false;
+            position = end;
+            return mask;
+        }
+        memcpy(mask.words, position, sizeof(mask.words));
+        position += sizeof(mask.words);
+        return mask;
+    }
+
+    string_view readText()
+    {
+        uint32_t length = readUint32();
+        if (end - position < length)
+        {
+            ok = false;
+            position = end;
+            return string_view();
+        }
+        string_view text(position, length);
+        position += length;
+        return text;
+    }
+};
+
+// Snapshot file: a SnapshotHeader, then doctorCount SnapshotDoctor, patientCount SnapshotPatient and
+// bookingCount SnapshotBooking entries, then the names they point into. All fields are 4 or 8 byte integers at
+// naturally aligned offsets, so a recovery maps the file and reads the arrays in place without parsing. A snapshot
+// only restores under the slot grid it was taken with.
+class SnapshotHeader
+{
+public:
+    static const uint32_t MAGIC = 0x53434646;
+    static const uint32_t VERSION = 3;
+    uint32_t magic;
+    uint32_t version;
+    // Journal records from this offset on came after the snapshot
+    uint64_t journalOffset;
+    // Bytes after the header, and their CRC-32
+    uint64_t payloadBytes;
+    uint32_t payloadCrc;
+    uint32_t doctorCount;
+    uint32_t patientCount;
+    uint32_t bookingCount;
+    int32_t firstBookingId;
+    int32_t nextBookingId;
+    // First day of the window, and Calendar::WINDOW_DAYS when the snapshot was taken
+    int32_t today;
+    uint32_t windowDays;
+    // The SlotGrid
+    uint32_t slotMinutes;
+    uint32_t openMinutes;
+    uint32_t closeMinutes;
+    uint32_t slotsPerDay;
+};
+
+class SnapshotDoctor
+{
+public:
+    // Offsets into the names
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t specialityOffset;
+    uint32_t specialityLength;
+    int32_t ratingTenths;
+    // Zero, keeps the masks 8 byte aligned
+    uint32_t reserved;
+    // Entry i is day today + i
+    SlotMask declaredSlots[Calendar::WINDOW_DAYS];
+};
+
+class SnapshotPatient
+{
+public:
+    uint32_t nameOffset;
+    uint32_t nameLength;
+};
+
+// Live bookings in id order. Whether a booking holds its slot or waits for it follows from that order: the
+// holder of a slot always has the smallest id of the live bookings for it, and waitlists are first come first served.
+class SnapshotBooking
+{
+public:
+    int32_t bookingId;
+    uint32_t patientId;
+    uint32_t doctorId;
+    int32_t day;
+    int32_t slot;
+};
+
+enum class ResultCode
+{
+    Ok,
+    Booked,
+    Waitlisted,
+    DoctorNotFound,
+    PatientNotFound,
+    InvalidSlot,
+    SlotNotDeclared,
+    SlotConflict,
+    BookingNotFound,
+    DoctorAlreadyExists,
+    PatientAlreadyExists,
+    InvalidRating,
+    // The date lies outside the booking window
+    DayOutOfRange,
+    // Every booking id the window can hold is in use
+    BookingCapacityExceeded,
+    JournalError
+};
+
+class AvailabilityRequest
+{
+public:
+    string doctorName;
+    vector<string> times;
+    Day day = TODAY;
+};
+
+class AvailabilityResult
+{
+public:
+    ResultCode code;
+    int invalidTimeSlotCount;
+};
+
+class BookingRequest
+{
+public:
+    string doctorName;
+    string patientName;
+    string time;
+    Day day = TODAY;
+};
+
+class BookingResult
+{
+public:
+    ResultCode code;
+    // Set when code is Booked or Waitlisted
+    int bookingId;
+    // Set when code is SlotConflict: the doctor the patient already sees in that slot
+    string conflictingDoctorName;
+};
+
+// What became of one booking of a withdrawn slot
+class Rebooking
+{
+public:
+    int bookingId;
+    string patientName;
+    SlotIndex slot;
+    bool wasWaitlisted;
+    // The patient's new booking with doctorName at the same time, or 0 if no doctor of the speciality could take them
+    int newBookingId;
+    string doctorName;
+};
+
+class WithdrawalResult
+{
+public:
+    // InvalidSlot if some of the times do not parse; the others are withdrawn all the same
+    ResultCode code;
+    int invalidTimeSlotCount;
+    // Per slot, the booked patient first and then the waitlist in order
+    vector<Rebooking> rebookings;
+};
+
+class DoctorSlotsResult
+{
+public:
+    ResultCode code;
+    SlotMask declaredSlots;
+    SlotMask availableSlots;
+};
+
+class AppointmentView
+{
+public:
+    string doctorName;
+    Day day;
+    SlotIndex slot;
+    AppointmentStatus status;
+};
+
+class PatientAppointmentsResult
+{
+public:
+    ResultCode code;
+    vector<AppointmentView> appointments;
+};
+
+class RecoveryResult
+{
+public:
+    // Ok, or JournalError with errorMessage set
+    ResultCode code;
+    string errorMessage;
+    // False also when the snapshot was damaged; the whole journal is replayed then
+    bool snapshotLoaded;
+    long long snapshotBookingCount;
+    long long replayedRecordCount;
+    // Records that did not fit the recovered state and were skipped
+    long long inconsistentRecordCount;
+    // Torn tail of the journal that was cut off
+    uint64_t discardedBytes;
+    double seconds;
+};
+
+class NotificationOptions
+{
+public:
+    // Producers wait while this many notifications are queued
+    size_t queueCapacity = 4096;
+    // The handler gets at most this many notifications per call
+    size_t maxBatch = 256;
+    // After a batch that was not full the consumer waits this long, so that notifications arriving meanwhile go
+    // out together and cancellations seldom have to wake it
+    int batchDelayMicros = 1000;
+};
+
+// "You got the slot": patientName was promoted from the waitlist and now holds the slot under bookingId
+class SlotNotification
+{
+public:
+    int bookingId;
+    string patientName;
+    string doctorName;
+    Day day;
+    SlotIndex slot;
+};
+
+class NotificationStats
+{
+public:
+    long long notificationCount;
+    long long batchCount;
+    // Times a cancellation had to wait for room in the queue
+    long long producerWaitCount;
+};
+
+// Opaque position in a start time ordered search: the {slot, doctorId} of the last result of a page, so the next page
+// resumes right after it even if slots were booked or freed in between. FIRST_PAGE starts from the earliest slot.
+using SearchCursor = uint64_t;
+const SearchCursor FIRST_PAGE = 0;
+
+class AvailableSlot
+{
+public:
+    DoctorId doctorId;
+    string doctorName;
+    SlotIndex slot;
+};
+
+class AvailabilityPage
+{
+public:
+    vector<AvailableSlot> slots;
+    // Pass back to get the next page
+    SearchCursor nextCursor;
+    bool hasMore;
+};
+
+// Slots found by time. InvalidSlot if a time does not parse.
+class SlotSearchResult
+{
+public:
+    ResultCode code;
+    vector<AvailableSlot> slots;
+};
+
+// Instrumentation: per operation counters by result and latency histograms, recorded by the engine itself.
+// Every thread records into a MetricsShard of its own, so an operation costs two timestamps and a few plain adds on
+// cache lines no other thread writes: no locks and no atomic read-modify-writes. Reading the metrics adds the shards up.
+enum class MetricOperation : uint8_t
+{
+    Book,
+    Cancel,
+    MarkAvailability,
+    SearchBySpeciality,
+    SearchPage,
+    FindEarliest,
+    FindInWindow,
+    Withdraw,
+    // Batch calls. Their latency is per call; every request in them is counted under the operation it performs.
+    BookBatch,
+    CancelBatch,
+    AvailabilityBatch
+};
+
+const int METRIC_OPERATION_COUNT = int(MetricOperation::AvailabilityBatch) + 1;
+const int RESULT_CODE_COUNT = int(ResultCode::JournalError) + 1;
+
+// Label values, as Prometheus spells them
+const char *metricLabel(MetricOperation operation)
+{
+    static const char *const labels[METRIC_OPERATION_COUNT] = {"book", "cancel", "mark_availability", "search_by_speciality",
+                                                               "search_page", "find_earliest", "find_in_window", "withdraw",
+                                                               "book_batch", "cancel_batch", "availability_batch"};
+    return labels[int(operation)];
+}
+
+const char *metricLabel(ResultCode code)
+{
+    static const char *const labels[RESULT_CODE_COUNT] = {"ok", "booked", "waitlisted", "doctor_not_found", "patient_not_found",
+                                                          "invalid_slot", "slot_not_declared", "slot_conflict", "booking_not_found",
+                                                          "doctor_already_exists", "patient_already_exists", "invalid_rating",
+                                                          "day_out_of_range", "booking_capacity_exceeded", "journal_error"};
+    return labels[int(code)];
+}
+
+// Timestamps for the latency histograms: the time stamp counter on x86, which runs at a constant rate and is read
+// without a system call, steady_clock elsewhere. Ticks are converted to seconds only when the metrics are read.
+class MetricsClock
+{
+public:
+    static uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+private:
+    // The tick rate is measured from here on
+    inline static const uint64_t startTicks = now();
+    inline static const chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+public:
+    static double secondsPerTick()
+    {
+        uint64_t ticks = now() - startTicks;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        return ticks > 0 ? seconds / ticks : 0;
+    }
+};
+
+// Log-linear buckets in the style of HdrHistogram: values below SUB_BUCKET_COUNT get a bucket each, and every power of
+// two above is split into SUB_BUCKET_COUNT equal buckets. A bucket is thus never wider than 1/16 of the values in
+// it, and 592 buckets cover everything up to 2^40 ticks, several minutes; longer calls land in the last bucket.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int MAX_VALUE_BITS = 40;
+    static const int BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+    array<uint64_t, BUCKET_COUNT> bucketCounts = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    static int bucketOf(uint64_t value)
+    {
+        value = min(value, (uint64_t(1) << MAX_VALUE_BITS) - 1);
+        if (value < SUB_BUCKET_COUNT)
+        {
+            return int(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKET_COUNT + int(value >> shift) - SUB_BUCKET_COUNT;
+    }
+
+    // Largest value that falls into bucket
+    static uint64_t highestValueOf(int bucket)
+    {
+        if (bucket < SUB_BUCKET_COUNT)
+        {
+            return bucket;
+        }
+        int shift = bucket / SUB_BUCKET_COUNT - 1;
+        return ((uint64_t(bucket % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT) + 1) << shift) - 1;
+    }
+
+    // The value that quantile of the recorded values do not exceed, rounded up to the end of its bucket
+    uint64_t valueAt(double quantile) const
+    {
+        uint64_t rank = max<uint64_t>(1, ceil(quantile * count));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKET_COUNT; bucket++)
+        {
+            seen += bucketCounts[bucket];
+            if (seen >= rank)
+            {
+                return highestValueOf(bucket);
+            }
+        }
+        return 0;
+    }
+};
+
+// One thread's counts. Only the thread holding the shard writes it.
+class alignas(64) MetricsShard
+{
+public:
+    atomic<uint64_t> resultCounts[METRIC_OPERATION_COUNT][RESULT_CODE_COUNT];
+    atomic<uint64_t> latencyCounts[METRIC_OPERATION_COUNT][LatencyHistogram::BUCKET_COUNT];
+    atomic<uint64_t> latencySums[METRIC_OPERATION_COUNT];
+    atomic<uint64_t> promotionCount;
+    // Held by a live thread
+    atomic<bool> leased;
+};
+
+// Everything the metrics know at one point of time. The gauges come from the engine's state, see FlipCare::getMetrics.
+class EngineMetrics
+{
+public:
+    array<array<uint64_t, RESULT_CODE_COUNT>, METRIC_OPERATION_COUNT> resultCounts = {};
+    // In ticks
+    array<LatencyHistogram, METRIC_OPERATION_COUNT> latencies;
+    double secondsPerTick = 0;
+    // Waitlisted bookings that were handed the slot by a cancellation
+    uint64_t promotionCount = 0;
+    long long liveBookingCount = 0;
+    long long waitlistedBookingCount = 0;
+    // Slots with a waitlist, and the longest waitlist of them
+    long long waitlistedSlotCount = 0;
+    long long longestWaitlist = 0;
+};
+
+// The process wide registry of shards. A shard outlives its thread and is handed to the next thread that starts
+// recording, so totals never go down and there are never more shards than threads ever ran at the same time.
+class Metrics
+{
+private:
+    // Gives the shard back when its thread ends
+    class ShardLease
+    {
+    public:
+        MetricsShard *shard;
+
+        ShardLease() : shard(nullptr) {}
+
+        ~ShardLease()
+        {
+            if (shard != nullptr)
+            {
+                shard->leased.store(false, memory_order_release);
+            }
+        }
+    };
+
+    inline static atomic<bool> enabled{true};
+    inline static mutex shardsMutex;
+    inline static vector<unique_ptr<MetricsShard>> shards;
+    inline static thread_local ShardLease lease;
+
+    static MetricsShard &localShard()
+    {
+        if (lease.shard == nullptr)
+        {
+            lock_guard<mutex> lock(shardsMutex);
+            for (unique_ptr<MetricsShard> &shard : shards)
+            {
+                if (!shard->leased.load(memory_order_acquire))
+                {
+                    lease.shard = shard.get();
+                    break;
+                }
+            }
+            if (lease.shard == nullptr)
+            {
+                // Value-initialised, so every count starts at zero
+                shards.push_back(unique_ptr<MetricsShard>(new MetricsShard()));
+                lease.shard = shards.back().get();
+            }
+            lease.shard->leased.store(true, memory_order_relaxed);
+        }
+        return *lease.shard;
+    }
+
+    // The owning thread is the only writer, so a relaxed load and store make a plain add
+    static void add(atomic<uint64_t> &counter, uint64_t amount)
+    {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+public:
+    // On by default. While off, operations are neither timed nor counted.
+    static void setEnabled(bool on)
+    {
+        enabled.store(on, memory_order_relaxed);
+    }
+
+    // Taken before a measured call; 0 while the metrics are off
+    static uint64_t startTicks()
+    {
+        return enabled.load(memory_order_relaxed) ? MetricsClock::now() : 0;
+    }
+
+    static void record(MetricOperation operation, ResultCode code, uint64_t startTicks)
+    {
+        if (startTicks == 0)
+        {
+            return;
+        }
+        uint64_t endTicks = MetricsClock::now();
+        // The counters of two cores may be slightly apart
+        uint64_t elapsedTicks = endTicks > startTicks ? endTicks - startTicks : 0;
+        MetricsShard &shard = localShard();
+        add(shard.resultCounts[int(operation)][int(code)], 1);
+        add(shard.latencyCounts[int(operation)][LatencyHistogram::bucketOf(elapsedTicks)], 1);
+        add(shard.latencySums[int(operation)], elapsedTicks);
+    }
+
+    // Counts a request of a batch call, whose latency went to the batch operation
+    static void count(MetricOperation operation, ResultCode code)
+    {
+        if (enabled.load(memory_order_relaxed))
+        {
+            add(localShard().resultCounts[int(operation)][int(code)], 1);
+        }
+    }
+
+    static void countPromotion()
+    {
+        if (enabled.load(memory_order_relaxed))
+        {
+            add(localShard().promotionCount, 1);
+        }
+    }
+
+    // Adds up the shards. The gauges are left at zero.
+    static EngineMetrics read()
+    {
+        EngineMetrics metrics;
+        metrics.secondsPerTick = MetricsClock::secondsPerTick();
+        lock_guard<mutex> lock(shardsMutex);
+        for (unique_ptr<MetricsShard> &shard : shards)
+        {
+            for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
+            {
+                for (int code = 0; code < RESULT_CODE_COUNT; code++)
+                {
+                    metrics.resultCounts[operation][code] += shard->resultCounts[operation][code].load(memory_order_relaxed);
+                }
+                LatencyHistogram &latency = metrics.latencies[operation];
+                for (int bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT; bucket++)
+                {
+                    uint64_t bucketCount = shard->latencyCounts[operation][bucket].load(memory_order_relaxed);
+                    latency.bucketCounts[bucket] += bucketCount;
+                    latency.count += bucketCount;
+                }
+                latency.sum += shard->latencySums[operation].load(memory_order_relaxed);
+            }
+            metrics.promotionCount += shard->promotionCount.load(memory_order_relaxed);
+        }
+        return metrics;
+    }
+};
+
+// FlipCare is safe to use from many threads. Lock order: snapshotMutex -> registryMutex (shared for everything but
+// registration, day rollover and snapshots) -> Doctor::doctorMutex -> leaf locks (speciality index writers -> epoch
+// reclamation, trending doctors, patient appointments, booking shards, journal buffer). The speciality searches take
+// no lock at all. Journal records are appended under the lock that orders the change, the doctor's lock for slot
+// changes and the exclusive registry lock for registrations.
+// A patient's slot conflicts are checked and recorded under the patient's appointments lock, a leaf lock.
+// Every day-scoped call takes a Day within the booking window [today, today + Calendar::WINDOW_DAYS), TODAY by default.
+class FlipCare
+{
+private:
+    ObjectPool<Doctor> doctorPool;
+    ObjectPool<Patient> patientPool;
+    // Name -> id; an id is the entity's handle in its pool
+    NameInterner doctorIds;
+    NameInterner patientIds;
+    NameInterner specialityIds;
+    shared_mutex registryMutex;
+    BookingTable bookingIdToPatientDoctorMap;
+    SpecialityAvailabilityIndex availabilityIndex;
+    TrendingDoctors trendingDoctors;
+    // Set while a journal is open
+    atomic<Journal *> journal;
+    mutex snapshotMutex;
+    // Periodic snapshots
+    thread snapshotThread;
+    mutex snapshotThreadMutex;
+    condition_variable snapshotWakeup;
+    bool snapshotStopping = false;
+    // Set during a recovery: the search index and the trending counts are rebuilt once at the end instead of
+    // following every replayed change
+    bool indexesDeferred = false;
+    // First day of the booking window. Changed only with registryMutex held exclusively; atomic because searches read
+    // it without that lock.
+    atomic<Day> today;
+    // Set while waitlist notifications are on
+    atomic<BoundedQueue<WaitlistPromotion> *> notificationQueue;
+    thread notificationThread;
+    long long notificationCount = 0;
+    long long notificationBatchCount = 0;
+
+    FlipCare() : journal(nullptr), notificationQueue(nullptr)
+    {
+        today = Calendar::systemToday();
+        bookingIdToPatientDoctorMap.expireDaysBefore(today);
+    }
+
+    Doctor *findDoctor(const string &doctorName)
+    {
+        DoctorId doctorId;
+        return doctorIds.find(doctorName, doctorId) ? doctorPool.get(doctorId) : nullptr;
+    }
+
+    Patient *findPatient(const string &patientName)
+    {
+        PatientId patientId;
+        return patientIds.find(patientName, patientId) ? patientPool.get(patientId) : nullptr;
+    }
+
+    // Top limit available slots of a speciality under RankingPolicy. Keys are computed once per candidate and only the
+    // first limit positions are sorted. Takes no lock: the doctors' rating and count are atomics.
+    template <typename RankingPolicy>
+    vector<pair<SlotIndex, Doctor *>> rankSlots(const string &speciality, Day day, size_t limit)
+    {
+        if constexpr (RankingPolicy::FOLLOWS_INDEX_ORDER)
+        {
+            return availabilityIndex.getSlots(speciality, day, limit);
+        }
+        vector<pair<SlotIndex, Doctor *>> candidates = availabilityIndex.getSlots(speciality, day);
+        // {key, position in start time order}
+        vector<pair<int64_t, size_t>> keys(candidates.size());
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            Doctor *doctor = candidates[i].second;
+            keys[i] = {RankingPolicy::key({candidates[i].first, doctor->ratingTenths, doctor->doctorAppointmentCount}), i};
+        }
+        size_t rankedCount = min(limit, keys.size());
+        partial_sort(keys.begin(), keys.begin() + rankedCount, keys.end());
+        vector<pair<SlotIndex, Doctor *>> rankedSlots(rankedCount);
+        for (size_t i = 0; i < rankedCount; i++)
+        {
+            rankedSlots[i] = candidates[keys[i].second];
+        }
+        return rankedSlots;
+    }
+
+    static vector<AvailableSlot> toAvailableSlots(const vector<pair<SlotIndex, Doctor *>> &slots)
+    {
+        vector<AvailableSlot> availableSlots(slots.size());
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            availableSlots[i] = {slots[i].second->doctorId, slots[i].second->doctorName, slots[i].first};
+        }
+        return availableSlots;
+    }
+
+    // Orders the items of a batch by doctor, keeping request order within a doctor so waitlists stay first come first served
+    template <typename Request, typename DoctorOf>
+    static vector<int> groupByDoctor(const vector<Request> &requests, DoctorOf doctorOf)
+    {
+        vector<int> order(requests.size());
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&](int a, int b)
+                    { return doctorOf(requests[a]) < doctorOf(requests[b]); });
+        return order;
+    }
+
+    static ResultCode resultCodeOf(ResultCode code)
+    {
+        return code;
+    }
+
+    static ResultCode resultCodeOf(const BookingResult &result)
+    {
+        return result.code;
+    }
+
+    static ResultCode resultCodeOf(const AvailabilityResult &result)
+    {
+        return result.code;
+    }
+
+    static ResultCode resultCodeOf(const SlotSearchResult &result)
+    {
+        return result.code;
+    }
+
+    static ResultCode resultCodeOf(const WithdrawalResult &result)
+    {
+        return result.code;
+    }
+
+    // Searches cannot fail
+    template <typename Result>
+    static ResultCode resultCodeOf(const Result &)
+    {
+        return ResultCode::Ok;
+    }
+
+    // Runs call() as one measured operation. Its latency, from before the first lock to after the journal commit and
+    // the queueing of notifications, goes to operation's histogram and its result code to operation's counters.
+    template <typename Call>
+    static auto measure(MetricOperation operation, Call call)
+    {
+        uint64_t startTicks = Metrics::startTicks();
+        auto result = call();
+        Metrics::record(operation, resultCodeOf(result), startTicks);
+        return result;
+    }
+
+    // The same for a batch call, whose requests are counted one by one under requestOperation
+    template <typename Call>
+    static auto measureBatch(MetricOperation batchOperation, MetricOperation requestOperation, Call call)
+    {
+        auto results = measure(batchOperation, call);
+        for (const auto &result : results)
+        {
+            Metrics::count(requestOperation, resultCodeOf(result));
+        }
+        return results;
+    }
+
+    // Appends to the journal if one is open. Fields passed together form one unit that is never split by a crash.
+    template <typename... Fields>
+    void journalRecord(const Fields &...fields)
+    {
+        Journal *openJournal = journal.load(memory_order_acquire);
+        if (openJournal != nullptr)
+        {
+            openJournal->append(fields...);
+        }
+    }
+
+    // Registration helpers, called with registryMutex held exclusively
+    Doctor *addDoctorLocked(const string &doctorName, const string &doctorSpecialization)
+    {
+        DoctorId doctorId = doctorIds.intern(doctorName);
+        SpecialityId specialityId = specialityIds.intern(doctorSpecialization);
+        Doctor *doctor = doctorPool.create(doctorId, doctorName, specialityId, doctorSpecialization);
+        availabilityIndex.addSpeciality(specialityId, doctorSpecialization);
+        if (!indexesDeferred)
+        {
+            trendingDoctors.addDoctor(doctor);
+        }
+        return doctor;
+    }
+
+    Patient *addPatientLocked(const string &patientName)
+    {
+        PatientId patientId = patientIds.intern(patientName);
+        return patientPool.create(patientId, patientName);
+    }
+
+    // Days are resolved and checked under registryMutex, so that a rollover cannot move the window in between
+    Day resolveDay(Day day)
+    {
+        return day == TODAY ? today.load() : day;
+    }
+
+    bool isInWindow(Day day)
+    {
+        return day >= today && day - today < Calendar::WINDOW_DAYS;
+    }
+
+    // Moves the window to start at newToday. The days that leave it are released in one pass over the doctors, so a
+    // rollover costs O(doctors) per day; bookings for those days expire with them, and patients drop their
+    // appointments lazily. Called with registryMutex held exclusively.
+    void moveWindowLocked(Day newToday)
+    {
+        vector<Day> leavingDays;
+        for (Day day = today; day - today < Calendar::WINDOW_DAYS; day++)
+        {
+            if (day < newToday || day - newToday >= Calendar::WINDOW_DAYS)
+            {
+                leavingDays.push_back(day);
+                availabilityIndex.clearDay(day);
+            }
+        }
+        if (!leavingDays.empty())
+        {
+            doctorPool.forEach([&](Doctor *doctor)
+                               {
+                int oldAppointmentCount = doctor->doctorAppointmentCount;
+                for (Day day : leavingDays)
+                {
+                    doctor->clearDay(day);
+                }
+                if (!indexesDeferred)
+                {
+                    trendingDoctors.updateCount(doctor, oldAppointmentCount);
+                } });
+        }
+        today = newToday;
+        bookingIdToPatientDoctorMap.expireDaysBefore(newToday);
+    }
+
+    // Derives the search index and the trending counts from the doctors' slots. Called with registryMutex held exclusively.
+    void rebuildIndexesLocked()
+    {
+        availabilityIndex.clearSlots();
+        trendingDoctors.clear();
+        doctorPool.forEach([this](Doctor *doctor)
+                           {
+            for (Day day = today; day - today < Calendar::WINDOW_DAYS; day++)
+            {
+                doctor->dayOf(day).availableSlots.forEach([&](SlotIndex slot)
+                                                          { availabilityIndex.addSlot(doctor, day, slot); });
+            }
+            trendingDoctors.addDoctor(doctor); });
+        availabilityIndex.publishStaged();
+    }
+
+    // Parses full slots, e.g. "12:30-13:00", into slots. Returns the number of times that are not a slot.
+    static int parseSlotRanges(const vector<string> &times, SlotMask &slots)
+    {
+        int invalidTimeSlotCount = 0;
+        slots = {};
+        for (const string &time : times)
+        {
+            SlotIndex slot;
+            if (!SlotTime::parseSlotRange(time, slot))
+            {
+                invalidTimeSlotCount++;
+            }
+            else
+            {
+                slots.set(slot);
+            }
+        }
+        return invalidTimeSlotCount;
+    }
+
+    // The helpers below expect registryMutex to be held shared and the doctor's lock to be held.
+    int markAvailabilityLocked(Doctor *doctor, Day day, const vector<string> &times)
+    {
+        SlotMask slots;
+        int invalidTimeSlotCount = parseSlotRanges(times, slots);
+        SlotMask newSlots = slots & ~doctor->dayOf(day).declaredSlots;
+        if (newSlots.any())
+        {
+            declareSlotsLocked(doctor, day, newSlots);
+            journalRecord(JournalRecordType::Availability, doctor->doctorId, int32_t(day), newSlots);
+        }
+        return invalidTimeSlotCount;
+    }
+
+    // Slots outside the grid are ignored
+    void declareSlotsLocked(Doctor *doctor, Day day, SlotMask slots)
+    {
+        slots.forEach([&](SlotIndex slot)
+                      {
+            if (slot < SlotTime::slotsPerDay() && doctor->markAvailability(day, slot) && !indexesDeferred)
+            {
+                availabilityIndex.addSlot(doctor, day, slot);
+            } });
+    }
+
+    BookingResult bookLocked(Doctor *doctor, Patient *patient, Day day, SlotIndex slot)
+    {
+        if (!doctor->isSlotDeclared(day, slot))
+        {
+            return {ResultCode::SlotNotDeclared, 0, ""};
+        }
+        // A patient cannot book two appointments with two different doctors in the same time slot. The appointment is
+        // recorded before the doctor lock is released, so a promotion from the waitlist always finds it.
+        AppointmentStatus status = doctor->isSlotAvailable(day, slot) ? AppointmentStatus::Booked : AppointmentStatus::Waitlisted;
+        AppointmentHandle appointment;
+        if (!patient->bookAppointment({doctor->doctorId, day, slot, status}, today, appointment))
+        {
+            return {ResultCode::SlotConflict, 0, ""};
+        }
+        int bookingId = bookingIdToPatientDoctorMap.newBookingId();
+        if (bookingId == 0)
+        {
+            patient->cancelAppointment(appointment);
+            return {ResultCode::BookingCapacityExceeded, 0, ""};
+        }
+        bool slotBooked = applyBookingLocked(doctor, patient->patientId, day, slot, bookingId, appointment);
+        journalRecord(JournalRecordType::Book, bookingId, doctor->doctorId, patient->patientId, int32_t(day), uint8_t(slot));
+        return {slotBooked ? ResultCode::Booked : ResultCode::Waitlisted, bookingId, ""};
+    }
+
+    // Books the slot, or joins its waitlist, under an id that was already handed out. Returns true if the slot was
+    // booked. The caller has recorded the patient's side of the appointment, as Booked exactly if the slot is available.
+    bool applyBookingLocked(Doctor *doctor, PatientId patientId, Day day, SlotIndex slot, int bookingId, AppointmentHandle appointment)
+    {
+        int oldAppointmentCount = doctor->doctorAppointmentCount;
+        Booking booking = {patientId, doctor->doctorId, day, slot, false, WaitlistHandle(), appointment};
+        bool slotBooked = doctor->bookSlot(day, slot, bookingId);
+        if (slotBooked && !indexesDeferred)
+        {
+            availabilityIndex.removeSlot(doctor, day, slot);
+            trendingDoctors.updateCount(doctor, oldAppointmentCount);
+        }
+        else if (!slotBooked)
+        {
+            booking.isWaitlisted = true;
+            booking.waitlistPosition = doctor->addToWaitlist(day, slot, {bookingId, patientId});
+        }
+        bookingIdToPatientDoctorMap.addBooking(bookingId, booking);
+        return slotBooked;
+    }
+
+    // Replays a booking that was saved, patient side included
+    void restoreBookingLocked(Doctor *doctor, Patient *patient, Day day, SlotIndex slot, int bookingId)
+    {
+        AppointmentStatus status = doctor->isSlotAvailable(day, slot) ? AppointmentStatus::Booked : AppointmentStatus::Waitlisted;
+        AppointmentHandle appointment = patient->restoreAppointment({doctor->doctorId, day, slot, status});
+        applyBookingLocked(doctor, patient->patientId, day, slot, bookingId, appointment);
+    }
+
+    ResultCode cancelLocked(Doctor *doctor, int bookingId)
+    {
+        // Re-read under the doctor lock: a concurrent cancellation may have promoted or removed this booking meanwhile
+        Booking booking;
+        if (!bookingIdToPatientDoctorMap.takeBooking(bookingId, booking))
+        {
+            return ResultCode::BookingNotFound;
+        }
+        int promotedBookingId = 0;
+        if (booking.isWaitlisted)
+        {
+            // A waitlisted patient withdrawing only leaves the queue, the slot stays with its current holder
+            doctor->removeFromWaitlist(booking.day, booking.slot, booking.waitlistPosition);
+        }
+        else
+        {
+            int oldAppointmentCount = doctor->doctorAppointmentCount;
+            WaitlistEntry newPatient = doctor->cancelSlot(booking.day, booking.slot);
+            if (!indexesDeferred)
+            {
+                trendingDoctors.updateCount(doctor, oldAppointmentCount);
+            }
+            if (doctor->isSlotAvailable(booking.day, booking.slot) && !indexesDeferred)
+            {
+                availabilityIndex.addSlot(doctor, booking.day, booking.slot);
+            }
+            if (newPatient.bookingId != 0)
+            {
+                // The handover itself happens here, under the doctor lock; telling the patient is left to the
+                // notification consumer
+                Booking promotedBooking;
+                if (bookingIdToPatientDoctorMap.markBooked(newPatient.bookingId, promotedBooking))
+                {
+                    patientPool.get(newPatient.patientId)->markBooked(promotedBooking.appointment);
+                }
+                promotedBookingId = newPatient.bookingId;
+                if (!indexesDeferred)
+                {
+                    Metrics::countPromotion();
+                }
+                if (notificationQueue.load(memory_order_acquire) != nullptr && !indexesDeferred)
+                {
+                    NotificationCommit::stagedPromotions.push_back({newPatient.bookingId, newPatient.patientId, doctor->doctorId, booking.day, booking.slot});
+                }
+            }
+        }
+        patientPool.get(booking.patientId)->cancelAppointment(booking.appointment);
+        if (promotedBookingId != 0)
+        {
+            journalRecord(JournalRecordType::Cancel, bookingId, JournalRecordType::WaitlistPromote, promotedBookingId);
+        }
+        else
+        {
+            journalRecord(JournalRecordType::Cancel, bookingId);
+        }
+        return ResultCode::Ok;
+    }
+
+    // Takes the slots back from the doctor. Their bookings are cancelled without promoting anyone and appended to
+    // displaced as {bookingId, booking}, per slot the booked one first and then the waitlist in order.
+    void withdrawSlotsLocked(Doctor *doctor, Day day, SlotMask slots, vector<pair<int, Booking>> &displaced)
+    {
+        int oldAppointmentCount = doctor->doctorAppointmentCount;
+        SlotMask withdrawnSlots = slots & doctor->dayOf(day).declaredSlots;
+        vector<int> bookingIds;
+        withdrawnSlots.forEach([&](SlotIndex slot)
+                               {
+            if (doctor->isSlotAvailable(day, slot) && !indexesDeferred)
+            {
+                availabilityIndex.removeSlot(doctor, day, slot);
+            }
+            doctor->withdrawSlot(day, slot, bookingIds); });
+        for (int bookingId : bookingIds)
+        {
+            Booking booking;
+            if (bookingIdToPatientDoctorMap.takeBooking(bookingId, booking))
+            {
+                patientPool.get(booking.patientId)->cancelAppointment(booking.appointment);
+                displaced.push_back({bookingId, booking});
+            }
+        }
+        if (!indexesDeferred)
+        {
+            trendingDoctors.updateCount(doctor, oldAppointmentCount);
+        }
+        if (withdrawnSlots.any())
+        {
+            journalRecord(JournalRecordType::Withdraw, doctor->doctorId, int32_t(day), withdrawnSlots);
+        }
+    }
+
+    // Moves the displaced patients to doctors of the same speciality who are free at the same time. One index search
+    // finds the free doctors of all the slots; then every round hands each slot's waiting patients, in order, to its
+    // doctors not tried yet and books them doctor by doctor, one lock per doctor. A doctor whose slot was taken
+    // meanwhile sends the patient on to the next round. A patient with another appointment at that time is passed
+    // over and stays unbooked. Called with registryMutex held shared and no doctor lock held.
+    vector<Rebooking> rebookLocked(const string &speciality, Day day, const vector<pair<int, Booking>> &displaced)
+    {
+        vector<Rebooking> rebookings(displaced.size());
+        // Per slot, the patients still waiting as positions in displaced
+        array<vector<size_t>, SlotGrid::MAX_SLOTS_PER_DAY> waiting;
+        SlotMask slots = {};
+        for (size_t i = 0; i < displaced.size(); i++)
+        {
+            const Booking &booking = displaced[i].second;
+            rebookings[i] = {displaced[i].first, patientPool.get(booking.patientId)->patientName, booking.slot, booking.isWaitlisted, 0, ""};
+            waiting[booking.slot].push_back(i);
+            slots.set(booking.slot);
+        }
+        // Earliest first, so every slot's doctors are a range; nextDoctor[slot] is the first not tried yet
+        vector<pair<SlotIndex, Doctor *>> freeDoctors = availabilityIndex.getSlotsIn(speciality, day, slots);
+        array<size_t, SlotGrid::MAX_SLOTS_PER_DAY> nextDoctor;
+        nextDoctor.fill(freeDoctors.size());
+        for (size_t i = freeDoctors.size(); i-- > 0;)
+        {
+            nextDoctor[freeDoctors[i].first] = i;
+        }
+        // {doctor, position in displaced}
+        vector<pair<Doctor *, size_t>> assignments;
+        while (true)
+        {
+            assignments.clear();
+            slots.forEach([&](SlotIndex slot)
+                          {
+                for (size_t position : waiting[slot])
+                {
+                    if (nextDoctor[slot] == freeDoctors.size() || freeDoctors[nextDoctor[slot]].first != slot)
+                    {
+                        break;
+                    }
+                    DoctorId otherDoctorId;
+                    if (!patientPool.get(displaced[position].second.patientId)->doctorAt(day, slot, otherDoctorId))
+                    {
+                        assignments.push_back({freeDoctors[nextDoctor[slot]++].second, position});
+                    }
+                }
+                waiting[slot].clear(); });
+            if (assignments.empty())
+            {
+                return rebookings;
+            }
+            stable_sort(assignments.begin(), assignments.end(), [](const pair<Doctor *, size_t> &a, const pair<Doctor *, size_t> &b)
+                        { return a.first < b.first; });
+            for (size_t i = 0; i < assignments.size();)
+            {
+                Doctor *doctor = assignments[i].first;
+                lock_guard<mutex> doctorLock(doctor->doctorMutex);
+                IndexCommit indexCommit(availabilityIndex);
+                for (; i < assignments.size() && assignments[i].first == doctor; i++)
+                {
+                    size_t position = assignments[i].second;
+                    Rebooking &rebooking = rebookings[position];
+                    if (!doctor->isSlotAvailable(day, rebooking.slot))
+                    {
+                        waiting[rebooking.slot].push_back(position);
+                        continue;
+                    }
+                    BookingResult result = bookLocked(doctor, patientPool.get(displaced[position].second.patientId), day, rebooking.slot);
+                    if (result.code == ResultCode::Booked)
+                    {
+                        rebooking.newBookingId = result.bookingId;
+                        rebooking.doctorName = doctor->doctorName;
+                    }
+                }
+            }
+            // The patients sent on keep their place in the queue
+            slots.forEach([&](SlotIndex slot)
+                          { sort(waiting[slot].begin(), waiting[slot].end()); });
+        }
+    }
+
+    // Recovery runs with registryMutex held exclusively and before a journal is attached, so the helpers below
+    // neither lock doctors nor journal the changes they replay.
+
+    // Applies the records of one journal batch. Returns false if the batch cannot be decoded to its end.
+    bool replayRecords(JournalReader &reader, RecoveryResult &result)
+    {
+        while (!reader.atEnd())
+        {
+            bool consistent = replayRecord(JournalRecordType(reader.readByte()), reader);
+            if (!reader.ok)
+            {
+                return false;
+            }
+            result.replayedRecordCount++;
+            result.inconsistentRecordCount += !consistent;
+        }
+        return true;
+    }
+
+    // Returns false if the record does not fit the state recovered so far; it is skipped then
+    bool replayRecord(JournalRecordType type, JournalReader &reader)
+    {
+        switch (type)
+        {
+        case JournalRecordType::RegisterDoctor:
+        {
+            DoctorId doctorId = reader.readUint32();
+            string doctorName(reader.readText());
+            string doctorSpecialization(reader.readText());
+            DoctorId existingDoctorId;
+            if (!reader.ok || doctorIds.find(doctorName, existingDoctorId))
+            {
+                return false;
+            }
+            return addDoctorLocked(doctorName, doctorSpecialization)->doctorId == doctorId;
+        }
+        case JournalRecordType::RegisterPatient:
+        {
+            PatientId patientId = reader.readUint32();
+            string patientName(reader.readText());
+            PatientId existingPatientId;
+            if (!reader.ok || patientIds.find(patientName, existingPatientId))
+            {
+                return false;
+            }
+            return addPatientLocked(patientName)->patientId == patientId;
+        }
+        case JournalRecordType::Availability:
+        {
+            DoctorId doctorId = reader.readUint32();
+            Day day = reader.readInt32();
+            SlotMask slots = reader.readSlotMask();
+            if (!reader.ok || doctorId >= doctorPool.size() || !isInWindow(day))
+            {
+                return false;
+            }
+            declareSlotsLocked(doctorPool.get(doctorId), day, slots);
+            return true;
+        }
+        case JournalRecordType::Book:
+        {
+            int bookingId = reader.readInt32();
+            DoctorId doctorId = reader.readUint32();
+            PatientId patientId = reader.readUint32();
+            Day day = reader.readInt32();
+            SlotIndex slot = reader.readByte();
+            if (!reader.ok || doctorId >= doctorPool.size() || patientId >= patientPool.size() || !isInWindow(day) || slot >= SlotTime::slotsPerDay() ||
+                !bookingIdToPatientDoctorMap.canHold(bookingId) || !doctorPool.get(doctorId)->isSlotDeclared(day, slot))
+            {
+                return false;
+            }
+            // Bookings of different doctors may reach the journal in another order than their ids were handed out
+            bookingIdToPatientDoctorMap.reserveBookingId(bookingId);
+            restoreBookingLocked(doctorPool.get(doctorId), patientPool.get(patientId), day, slot, bookingId);
+            return true;
+        }
+        case JournalRecordType::Cancel:
+        {
+            int bookingId = reader.readInt32();
+            Booking booking;
+            if (!reader.ok || !bookingIdToPatientDoctorMap.findBooking(bookingId, booking))
+            {
+                return false;
+            }
+            return cancelLocked(doctorPool.get(booking.doctorId), bookingId) == ResultCode::Ok;
+        }
+        case JournalRecordType::WaitlistPromote:
+        {
+            // Replaying the Cancel before it promoted the booking already, this only checks that the replay agrees
+            int bookingId = reader.readInt32();
+            Booking booking;
+            return reader.ok && bookingIdToPatientDoctorMap.findBooking(bookingId, booking) && !booking.isWaitlisted;
+        }
+        case JournalRecordType::Rate:
+        {
+            DoctorId doctorId = reader.readUint32();
+            int ratingTenths = reader.readInt32();
+            if (!reader.ok || doctorId >= doctorPool.size())
+            {
+                return false;
+            }
+            doctorPool.get(doctorId)->ratingTenths = ratingTenths;
+            return true;
+        }
+        case JournalRecordType::NewDay:
+        {
+            Day newToday = reader.readInt32();
+            if (!reader.ok)
+            {
+                return false;
+            }
+            moveWindowLocked(newToday);
+            return true;
+        }
+        case JournalRecordType::Withdraw:
+        {
+            DoctorId doctorId = reader.readUint32();
+            Day day = reader.readInt32();
+            SlotMask slots = reader.readSlotMask();
+            if (!reader.ok || doctorId >= doctorPool.size() || !isInWindow(day))
+            {
+                return false;
+            }
+            vector<pair<int, Booking>> displaced;
+            withdrawSlotsLocked(doctorPool.get(doctorId), day, slots, displaced);
+            return true;
+        }
+        }
+        // Unknown record type: nothing after it in this batch can be decoded
+        reader.ok = false;
+        return false;
+    }
+
+    // Replays the journal batches from offset on. Returns the end of the last intact batch.
+    uint64_t replayJournal(const char *data, uint64_t size, uint64_t offset, RecoveryResult &result)
+    {
+        while (size - offset >= Journal::BATCH_HEADER_SIZE)
+        {
+            uint32_t header[2];
+            memcpy(header, data + offset, sizeof(header));
+            uint64_t payloadOffset = offset + Journal::BATCH_HEADER_SIZE;
+            if (header[0] == 0 || header[0] > size - payloadOffset || Crc32::compute(data + payloadOffset, header[0]) != header[1])
+            {
+                break;
+            }
+            JournalReader reader(data + payloadOffset, header[0]);
+            if (!replayRecords(reader, result))
+            {
+                result.inconsistentRecordCount++;
+            }
+            offset = payloadOffset + header[0];
+        }
+        return offset;
+    }
+
+    // Serialises the whole state, see SnapshotHeader. Called with registryMutex held exclusively.
+    string buildSnapshot(uint64_t journalOffset)
+    {
+        vector<SnapshotDoctor> doctors;
+        vector<SnapshotPatient> patients;
+        vector<SnapshotBooking> bookings;
+        string names;
+        auto addName = [&names](const string &name)
+        {
+            uint32_t offset = names.size();
+            names += name;
+            return offset;
+        };
+        doctorPool.forEach([&](Doctor *doctor)
+                           {
+            uint32_t nameOffset = addName(doctor->doctorName);
+            uint32_t specialityOffset = addName(doctor->doctorSpecialization);
+            SnapshotDoctor snapshotDoctor = {nameOffset, uint32_t(doctor->doctorName.size()), specialityOffset, uint32_t(doctor->doctorSpecialization.size()),
+                                             doctor->ratingTenths, 0, {}};
+            for (int i = 0; i < Calendar::WINDOW_DAYS; i++)
+            {
+                snapshotDoctor.declaredSlots[i] = doctor->dayOf(today + i).declaredSlots;
+            }
+            doctors.push_back(snapshotDoctor); });
+        patientPool.forEach([&](Patient *patient)
+                            { patients.push_back({addName(patient->patientName), uint32_t(patient->patientName.size())}); });
+        bookingIdToPatientDoctorMap.forEachLive([&](int bookingId, const Booking &booking)
+                                                { bookings.push_back({bookingId, booking.patientId, booking.doctorId, booking.day, booking.slot}); });
+
+        const SlotGrid &grid = SlotTime::getGrid();
+        SnapshotHeader header = {SnapshotHeader::MAGIC, SnapshotHeader::VERSION, journalOffset, 0, 0, uint32_t(doctors.size()),
+                                 uint32_t(patients.size()), uint32_t(bookings.size()), bookingIdToPatientDoctorMap.firstBookingId(),
+                                 bookingIdToPatientDoctorMap.bookingIdCounter, today, Calendar::WINDOW_DAYS,
+                                 uint32_t(grid.slotMinutes), uint32_t(grid.openMinutes), uint32_t(grid.closeMinutes), uint32_t(grid.slotsPerDay)};
+        string image(sizeof(header), '\0');
+        image.append(reinterpret_cast<const char *>(doctors.data()), doctors.size() * sizeof(SnapshotDoctor));
+        image.append(reinterpret_cast<const char *>(patients.data()), patients.size() * sizeof(SnapshotPatient));
+        image.append(reinterpret_cast<const char *>(bookings.data()), bookings.size() * sizeof(SnapshotBooking));
+        image.append(names);
+        header.payloadBytes = image.size() - sizeof(header);
+        header.payloadCrc = Crc32::compute(image.data() + sizeof(header), header.payloadBytes);
+        memcpy(&image[0], &header, sizeof(header));
+        return image;
+    }
+
+    // Rebuilds the state from a mapped snapshot. Returns false, with nothing restored, if the snapshot is damaged, or if
+    // it was taken at an offset past journalSize; journalOffset is set to that offset then.
+    bool restoreSnapshot(const MappedFile &snapshot, uint64_t journalSize, uint64_t &journalOffset, long long &bookingCount)
+    {
+        SnapshotHeader header;
+        if (snapshot.size < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, snapshot.data, sizeof(header));
+        const char *payload = snapshot.data + sizeof(header);
+        uint64_t arrayBytes = uint64_t(header.doctorCount) * sizeof(SnapshotDoctor) + uint64_t(header.patientCount) * sizeof(SnapshotPatient) +
+                              uint64_t(header.bookingCount) * sizeof(SnapshotBooking);
+        const SlotGrid &grid = SlotTime::getGrid();
+        if (header.magic != SnapshotHeader::MAGIC || header.version != SnapshotHeader::VERSION || header.windowDays != Calendar::WINDOW_DAYS ||
+            header.slotMinutes != uint32_t(grid.slotMinutes) || header.openMinutes != uint32_t(grid.openMinutes) ||
+            header.closeMinutes != uint32_t(grid.closeMinutes) || header.slotsPerDay != uint32_t(grid.slotsPerDay) ||
+            header.firstBookingId < 1 || header.journalOffset < Journal::FILE_HEADER_SIZE || header.payloadBytes != snapshot.size - sizeof(header) ||
+            arrayBytes > header.payloadBytes || Crc32::compute(payload, header.payloadBytes) != header.payloadCrc)
+        {
+            return false;
+        }
+        if (header.journalOffset > journalSize)
+        {
+            journalOffset = header.journalOffset;
+            return false;
+        }
+        // The arrays are read in place from the mapping
+        const SnapshotDoctor *doctors = reinterpret_cast<const SnapshotDoctor *>(payload);
+        const SnapshotPatient *patients = reinterpret_cast<const SnapshotPatient *>(doctors + header.doctorCount);
+        const SnapshotBooking *bookings = reinterpret_cast<const SnapshotBooking *>(patients + header.patientCount);
+        const char *names = reinterpret_cast<const char *>(bookings + header.bookingCount);
+        uint64_t namesSize = header.payloadBytes - arrayBytes;
+        auto nameFits = [namesSize](uint32_t offset, uint32_t length)
+        { return uint64_t(offset) + length <= namesSize; };
+        for (uint32_t i = 0; i < header.doctorCount; i++)
+        {
+            if (!nameFits(doctors[i].nameOffset, doctors[i].nameLength) || !nameFits(doctors[i].specialityOffset, doctors[i].specialityLength))
+            {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < header.patientCount; i++)
+        {
+            if (!nameFits(patients[i].nameOffset, patients[i].nameLength))
+            {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < header.bookingCount; i++)
+        {
+            const SnapshotBooking &booking = bookings[i];
+            if (booking.bookingId < header.firstBookingId || booking.bookingId >= header.nextBookingId || (i > 0 && booking.bookingId <= bookings[i - 1].bookingId) ||
+                (booking.bookingId - 1) / BookingTable::CHUNK_SIZE - (header.firstBookingId - 1) / BookingTable::CHUNK_SIZE >= BookingTable::MAX_CHUNKS ||
+                booking.doctorId >= header.doctorCount || booking.patientId >= header.patientCount || booking.day < header.today ||
+                booking.day - header.today >= Calendar::WINDOW_DAYS || booking.slot < 0 || booking.slot >= SlotTime::slotsPerDay() ||
+                !doctors[booking.doctorId].declaredSlots[booking.day - header.today].test(booking.slot))
+            {
+                return false;
+            }
+        }
+
+        moveWindowLocked(header.today);
+        bookingIdToPatientDoctorMap.restart(header.firstBookingId, header.nextBookingId);
+        doctorIds.reserve(header.doctorCount);
+        patientIds.reserve(header.patientCount);
+        for (uint32_t i = 0; i < header.doctorCount; i++)
+        {
+            Doctor *doctor = addDoctorLocked(string(names + doctors[i].nameOffset, doctors[i].nameLength),
+                                             string(names + doctors[i].specialityOffset, doctors[i].specialityLength));
+            for (int day = 0; day < Calendar::WINDOW_DAYS; day++)
+            {
+                declareSlotsLocked(doctor, header.today + day, doctors[i].declaredSlots[day]);
+            }
+            doctor->ratingTenths = doctors[i].ratingTenths;
+        }
+        for (uint32_t i = 0; i < header.patientCount; i++)
+        {
+            addPatientLocked(string(names + patients[i].nameOffset, patients[i].nameLength));
+        }
+        // In id order, every slot goes to its earliest live booking and the later ones queue up behind it
+        for (uint32_t i = 0; i < header.bookingCount; i++)
+        {
+            restoreBookingLocked(doctorPool.get(bookings[i].doctorId), patientPool.get(bookings[i].patientId), bookings[i].day, bookings[i].slot,
+                                 bookings[i].bookingId);
+        }
+        journalOffset = header.journalOffset;
+        bookingCount = header.bookingCount;
+        return true;
+    }
+
+    void snapshotLoop(int intervalMillis)
+    {
+        unique_lock<mutex> lock(snapshotThreadMutex);
+        while (!snapshotWakeup.wait_for(lock, chrono::milliseconds(intervalMillis), [this]
+                                        { return snapshotStopping; }))
+        {
+            lock.unlock();
+            saveSnapshot();
+            lock.lock();
+        }
+    }
+
+    // Resolves each batch of promotions to names under one shared registry lock and hands it to the handler,
+    // which runs without any FlipCare lock held
+    template <typename Handler>
+    void notificationLoop(BoundedQueue<WaitlistPromotion> *queue, NotificationOptions options, Handler handler)
+    {
+        size_t maxBatch = max<size_t>(1, options.maxBatch);
+        vector<WaitlistPromotion> promotions;
+        vector<SlotNotification> notifications;
+        while (queue->popBatch(promotions, maxBatch))
+        {
+            notifications.resize(promotions.size());
+            {
+                shared_lock<shared_mutex> registryLock(registryMutex);
+                for (size_t i = 0; i < promotions.size(); i++)
+                {
+                    const WaitlistPromotion &promotion = promotions[i];
+                    notifications[i] = {promotion.bookingId, patientPool.get(promotion.patientId)->patientName,
+                                        doctorPool.get(promotion.doctorId)->doctorName, promotion.day, promotion.slot};
+                }
+            }
+            handler(notifications);
+            notificationCount += notifications.size();
+            notificationBatchCount++;
+            if (notifications.size() < maxBatch && options.batchDelayMicros > 0)
+            {
+                this_thread::sleep_for(chrono::microseconds(options.batchDelayMicros));
+            }
+        }
+    }
+
+public:
+    static FlipCare *getInstance()
+    {
+        // Function local statics are initialised exactly once even when several threads race here
+        static FlipCare *instance = new FlipCare();
+        return instance;
+    }
+
+    // A new doctor should be able to register, and mention his/her speciality among (Cardiologist, Dermatologist, Orthopedic, General Physician)
+    ResultCode registerDoctor(string doctorName, string doctorSpecialization)
+    {
+        JournalCommit journalCommit(journal);
+        unique_lock<shared_mutex> registryLock(registryMutex);
+        DoctorId doctorId;
+        if (doctorIds.find(doctorName, doctorId))
+        {
+            return ResultCode::DoctorAlreadyExists;
+        }
+        Doctor *doctor = addDoctorLocked(doctorName, doctorSpecialization);
+        journalRecord(JournalRecordType::RegisterDoctor, doctor->doctorId, string_view(doctorName), string_view(doctorSpecialization));
+        return ResultCode::Ok;
+    }
+
+    // A doctor should be able to declare his/her availability in each slot for the day. For example, the slots will be of 30 mins like 9am-9.30am, 9.30am-10am
+    // Availability is declared per day, for any day of the booking window.
+    AvailabilityResult markDoctorAvailability(string doctorName, vector<string> times, Day day = TODAY)
+    {
+        return measure(MetricOperation::MarkAvailability, [&]() -> AvailabilityResult
+                                                          {
+            JournalCommit journalCommit(journal);
+            shared_lock<shared_mutex> registryLock(registryMutex);
+            Doctor *doctor = findDoctor(doctorName);
+            if (doctor == nullptr)
+            {
+                return {ResultCode::DoctorNotFound, 0};
+            }
+            day = resolveDay(day);
+            if (!isInWindow(day))
+            {
+                return {ResultCode::DayOutOfRange, 0};
+            }
+            lock_guard<mutex> doctorLock(doctor->doctorMutex);
+            IndexCommit indexCommit(availabilityIndex);
+            int invalidTimeSlotCount = markAvailabilityLocked(doctor, day, times);
+            return {invalidTimeSlotCount == 0 ? ResultCode::Ok : ResultCode::InvalidSlot, invalidTimeSlotCount}; });
+    }
+
+    // Doctors declaring the full day at once. Every doctor is looked up and locked once for all of its requests.
+    vector<AvailabilityResult> markAvailabilityBatch(const vector<AvailabilityRequest> &requests)
+    {
+        return measureBatch(MetricOperation::AvailabilityBatch, MetricOperation::MarkAvailability, [&]
+                                                                                                   {
+            vector<AvailabilityResult> results(requests.size());
+            vector<int> order = groupByDoctor(requests, [](const AvailabilityRequest &request) -> const string &
+                                                { return request.doctorName; });
+            JournalCommit journalCommit(journal);
+            shared_lock<shared_mutex> registryLock(registryMutex);
+            for (size_t i = 0; i < order.size();)
+            {
+                const string &doctorName = requests[order[i]].doctorName;
+                size_t groupEnd = i;
+                while (groupEnd < order.size() && requests[order[groupEnd]].doctorName == doctorName)
+                {
+                    groupEnd++;
+                }
+                Doctor *doctor = findDoctor(doctorName);
+                if (doctor == nullptr)
+                {
+                    for (; i < groupEnd; i++)
+                    {
+                        results[order[i]] = {ResultCode::DoctorNotFound, 0};
+                    }
+                    continue;
+                }
+                lock_guard<mutex> doctorLock(doctor->doctorMutex);
+                IndexCommit indexCommit(availabilityIndex);
+                for (; i < groupEnd; i++)
+                {
+                    Day day = resolveDay(requests[order[i]].day);
+                    if (!isInWindow(day))
+                    {
+                        results[order[i]] = {ResultCode::DayOutOfRange, 0};
+                        continue;
+                    }
+                    int invalidTimeSlotCount = markAvailabilityLocked(doctor, day, requests[order[i]].times);
+                    results[order[i]] = {invalidTimeSlotCount == 0 ? ResultCode::Ok : ResultCode::InvalidSlot, invalidTimeSlotCount};
+                }
+            }
+            return results; });
+    }
+
+    // Patients should be able to login
+    ResultCode registerPatient(string patientName)
+    {
+        JournalCommit journalCommit(journal);
+        unique_lock<shared_mutex> registryLock(registryMutex);
+        PatientId patientId;
+        if (patientIds.find(patientName, patientId))
+        {
+            return ResultCode::PatientAlreadyExists;
+        }
+        Patient *patient = addPatientLocked(patientName);
+        journalRecord(JournalRecordType::RegisterPatient, patient->patientId, string_view(patientName));
+        return ResultCode::Ok;
+    }
+
+    // Patients should be able to book appointments with a doctor for an available slot.A patient can book multiple appointments in a day.
+    // A waitlisted appointment gets a booking id too. Any day of the booking window can be booked.
+    BookingResult bookAppointment(string doctorName, string patientName, string time, Day day = TODAY)
+    {
+        return measure(MetricOperation::Book, [&]() -> BookingResult
+                                              {
+            JournalCommit journalCommit(journal);
+            shared_lock<shared_mutex> registryLock(registryMutex);
+            Patient *patient = findPatient(patientName);
+            if (patient == nullptr)
+            {
+                return {ResultCode::PatientNotFound, 0, ""};
+            }
+            Doctor *doctor = findDoctor(doctorName);
+            if (doctor == nullptr)
+            {
+                return {ResultCode::DoctorNotFound, 0, ""};
+            }
+            SlotIndex slot;
+            if (!SlotTime::parseSlotStart(time, slot))
+            {
+                return {ResultCode::InvalidSlot, 0, ""};
+            }
+            day = resolveDay(day);
+            if (!isInWindow(day))
+            {
+                return {ResultCode::DayOutOfRange, 0, ""};
+            }
+            BookingResult result;
+            {
+                lock_guard<mutex> doctorLock(doctor->doctorMutex);
+                IndexCommit indexCommit(availabilityIndex);
+                result = bookLocked(doctor, patient, day, slot);
+            }
+            DoctorId otherDoctorId;
+            if (result.code == ResultCode::SlotConflict && patient->doctorAt(day, slot, otherDoctorId))
+            {
+                result.conflictingDoctorName = doctorPool.get(otherDoctorId)->doctorName;
+            }
+            return result; });
+    }
+
+    // Bulk bookings, e.g. from partner clinics. Every doctor is looked up and locked once for all of its bookings;
+    // within a doctor the bookings are applied in request order.
+    vector<BookingResult> bookAppointmentsBatch(const vector<BookingRequest> &requests)
+    {
+        return measureBatch(MetricOperation::BookBatch, MetricOperation::Book, [&]
+                                                                               {
+            vector<BookingResult> results(requests.size());
+            vector<int> order = groupByDoctor(requests, [](const BookingRequest &request) -> const string &
+                                                { return request.doctorName; });
+            JournalCommit journalCommit(journal);
+            shared_lock<shared_mutex> registryLock(registryMutex);
+            for (size_t i = 0; i < order.size();)
+            {
+                const string &doctorName = requests[order[i]].doctorName;
+                size_t groupEnd = i;
+                while (groupEnd < order.size() && requests[order[groupEnd]].doctorName == doctorName)
+                {
+                    groupEnd++;
+                }
+                Doctor *doctor = findDoctor(doctorName);
+                if (doctor == nullptr)
+                {
+                    for (; i < groupEnd; i++)
+                    {
+                        results[order[i]] = {ResultCode::DoctorNotFound, 0, ""};
+                    }
+                    continue;
+                }
+                lock_guard<mutex> doctorLock(doctor->doctorMutex);
+                IndexCommit indexCommit(availabilityIndex);
+                for (; i < groupEnd; i++)
+                {
+                    const BookingRequest &request = requests[order[i]];
+                    Patient *patient = findPatient(request.patientName);
+                    Day day = resolveDay(request.day);
+                    SlotIndex slot;
+                    if (patient == nullptr)
+                    {
+                        results[order[i]] = {ResultCode::PatientNotFound, 0, ""};
+                    }
+                    else if (!SlotTime::parseSlotStart(request.time, slot))
+                    {
+                        results[order[i]] = {ResultCode::InvalidSlot, 0, ""};
+                    }
+                    else if (!isInWindow(day))
+                    {
+                        results[order[i]] = {ResultCode::DayOutOfRange, 0, ""};
+                    }
+                    else
+                    {
+                        results[order[i]] = bookLocked(doctor, patient, day, slot);
+                    }
+                }
+            }
+            return results; });
+    }
+
+    // Patients can also cancel an appointment, in which case that slot becomes available for someone else to book.
+    ResultCode cancelBookingId(int bookingId)
+    {
+        return measure(MetricOperation::Cancel, [&]() -> ResultCode
+                                                {
+            NotificationCommit notificationCommit(notificationQueue);
+            JournalCommit journalCommit(journal);
+            shared_lock<shared_mutex> registryLock(registryMutex);
+            Booking booking;
+            if (!bookingIdToPatientDoctorMap.findBooking(bookingId, booking))
+            {
+                return ResultCode::BookingNotFound;
+            }
+            Doctor *doctor = doctorPool.get(booking.doctorId);
+            lock_guard<mutex> doctorLock(doctor->doctorMutex);
+            IndexCommit indexCommit(availabilityIndex);
+            return cancelLocked(doctor, bookingId); });
+    }
+
+    // Cancels many bookings at once, taking each affected doctor's lock once
+    vector<ResultCode> cancelBatch(const vector<int> &bookingIds)
+    {
+        return measureBatch(MetricOperation::CancelBatch, MetricOperation::Cancel, [&]
+                                                                                   {
+            vector<ResultCode> results(bookingIds.size(), ResultCode::BookingNotFound);
+            NotificationCommit notificationCommit(notificationQueue);
+            JournalCommit journalCommit(journal);
+            shared_lock<shared_mutex> registryLock(registryMutex);
+            vector<pair<Doctor *, size_t>> cancellations;
+            for (size_t i = 0; i < bookingIds.size(); i++)
+            {
+                Booking booking;
+                if (bookingIdToPatientDoctorMap.findBooking(bookingIds[i], booking))
+                {
+                    cancellations.push_back({doctorPool.get(booking.doctorId), i});
+                }
+            }
+            stable_sort(cancellations.begin(), cancellations.end(), [](const pair<Doctor *, size_t> &a, const pair<Doctor *, size_t> &b)
+                        { return a.first < b.first; });
+            for (size_t i = 0; i < cancellations.size();)
+            {
+                Doctor *doctor = cancellations[i].first;
+                lock_guard<mutex> doctorLock(doctor->doctorMutex);
+                IndexCommit indexCommit(availabilityIndex);
+                for (; i < cancellations.size() && cancellations[i].first == doctor; i++)
+                {
+                    results[cancellations[i].second] = cancelLocked(doctor, bookingIds[cancellations[i].second]);
+                }
+            }
+            return results; });
+    }
+
+    // A doctor who cannot see patients after all, e.g. calls in sick, withdraws slots of a day; no times withdraws the
+    // whole day. Every booking in those slots is cancelled in one pass, and the patients, per slot the booked one
+    // first and then the waitlist in order, are rebooked with other doctors of the same speciality who are free then.
+    WithdrawalResult withdrawDoctor(string doctorName, vector<string> times, Day day = TODAY)
+    {
+        return measure(MetricOperation::Withdraw, [&]() -> WithdrawalResult
+                                                  {
+            JournalCommit journalCommit(journal);
+            shared_lock<shared_mutex> registryLock(registryMutex);
+            Doctor *doctor = findDoctor(doctorName);
+            if (doctor == nullptr)
+            {
+                return {ResultCode::DoctorNotFound, 0, {}};
+            }
+            day = resolveDay(day);
+            if (!isInWindow(day))
+            {
+                return {ResultCode::DayOutOfRange, 0, {}};
+            }
+            SlotMask slots;
+            int invalidTimeSlotCount = parseSlotRanges(times, slots);
+            if (times.empty())
+            {
+                slots = ~SlotMask{};
+            }
+            vector<pair<int, Booking>> displaced;
+            {
+                lock_guard<mutex> doctorLock(doctor->doctorMutex);
+                IndexCommit indexCommit(availabilityIndex);
+                withdrawSlotsLocked(doctor, day, slots, displaced);
+            }
+            return {invalidTimeSlotCount == 0 ? ResultCode::Ok : ResultCode::InvalidSlot, invalidTimeSlotCount,
+                    rebookLocked(doctor->doctorSpecialization, day, displaced)}; });
+    }
+
+    // Day rollover: the window moves on by one day. Registrations and the other days stay; the availability,
+    // waitlists and bookings of the day that ended are released in one pass over the doctors.
+    void startNewDay()
+    {
+        JournalCommit journalCommit(journal);
+        unique_lock<shared_mutex> registryLock(registryMutex);
+        moveWindowLocked(today + 1);
+        journalRecord(JournalRecordType::NewDay, int32_t(today));
+    }
+
+    Day getToday()
+    {
+        shared_lock<shared_mutex> registryLock(registryMutex);
+        return today;
+    }
+
+    // End of day reconciliation: visits every live booking in booking id order as (bookingId, const Booking &).
+    // Bookings are frozen meanwhile.
+    template <typename Visitor>
+    void forEachBooking(Visitor visitor)
+    {
+        unique_lock<shared_mutex> registryLock(registryMutex);
+        bookingIdToPatientDoctorMap.forEachLive(visitor);
+    }
+
+    // Starts the booking window on day instead of the local date. Call before FlipCare is used, and before openJournal.
+    bool setToday(Day day)
+    {
+        unique_lock<shared_mutex> registryLock(registryMutex);
+        if (journal != nullptr || doctorPool.size() > 0 || patientPool.size() > 0)
+        {
+            return false;
+        }
+        today = day;
+        bookingIdToPatientDoctorMap.expireDaysBefore(day);
+        return true;
+    }
+
+    // Restores what was saved under options, the snapshot and then the journal records written after it, and journals
+    // every change from then on. A batch torn by a crash is cut off the journal. Call once, before FlipCare is used.
+    RecoveryResult openJournal(JournalOptions options)
+    {
+        auto start = chrono::steady_clock::now();
+        unique_lock<shared_mutex> registryLock(registryMutex);
+        Day startDay = today;
+        RecoveryResult result = {ResultCode::JournalError, "", false, 0, 0, 0, 0, 0};
+        if (journal != nullptr || doctorPool.size() > 0 || patientPool.size() > 0)
+        {
+            result.errorMessage = "the journal has to be opened before FlipCare is used";
+            return result;
+        }
+        int fd = ::open(options.journalPath.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat fileStat;
+        if (fd < 0 || fstat(fd, &fileStat) != 0)
+        {
+            result.errorMessage = "cannot open " + options.journalPath + ": " + strerror(errno);
+            return result;
+        }
+        uint64_t fileSize = fileStat.st_size;
+        const SlotGrid &grid = SlotTime::getGrid();
+        uint32_t fileHeader[5] = {Journal::MAGIC, Journal::VERSION, uint32_t(grid.slotMinutes), uint32_t(grid.openMinutes), uint32_t(grid.closeMinutes)};
+        if (fileSize < Journal::FILE_HEADER_SIZE)
+        {
+            // A new journal, or one whose header never made it to disk
+            result.discardedBytes = fileSize;
+            if (ftruncate(fd, 0) != 0 || pwrite(fd, fileHeader, sizeof(fileHeader), 0) != sizeof(fileHeader) || fsync(fd) != 0)
+            {
+                result.errorMessage = "cannot write " + options.journalPath + ": " + strerror(errno);
+                ::close(fd);
+                return result;
+            }
+            fileSize = Journal::FILE_HEADER_SIZE;
+        }
+        MappedFile journalFile;
+        if (!journalFile.map(fd, fileSize) || memcmp(journalFile.data, fileHeader, 2 * sizeof(uint32_t)) != 0)
+        {
+            result.errorMessage = options.journalPath + " is not a FlipCare journal";
+            ::close(fd);
+            return result;
+        }
+        // Slot indexes in the records only mean something under the grid they were written with
+        if (memcmp(journalFile.data, fileHeader, sizeof(fileHeader)) != 0)
+        {
+            result.errorMessage = options.journalPath + " was written with a different slot grid";
+            ::close(fd);
+            return result;
+        }
+
+        uint64_t journalOffset = Journal::FILE_HEADER_SIZE;
+        indexesDeferred = true;
+        MappedFile snapshot;
+        if (!options.snapshotPath.empty() && snapshot.open(options.snapshotPath))
+        {
+            result.snapshotLoaded = restoreSnapshot(snapshot, fileSize, journalOffset, result.snapshotBookingCount);
+        }
+        if (journalOffset > fileSize)
+        {
+            // Nothing has been restored yet
+            indexesDeferred = false;
+            result.errorMessage = options.journalPath + " is shorter than the snapshot expects";
+            ::close(fd);
+            return result;
+        }
+        uint64_t journalEnd = replayJournal(journalFile.data, fileSize, journalOffset, result);
+        indexesDeferred = false;
+        rebuildIndexesLocked();
+        if (journalEnd < fileSize)
+        {
+            result.discardedBytes += fileSize - journalEnd;
+            if (ftruncate(fd, journalEnd) != 0 || fsync(fd) != 0)
+            {
+                result.errorMessage = "cannot truncate " + options.journalPath + ": " + strerror(errno);
+                ::close(fd);
+                return result;
+            }
+        }
+        lseek(fd, journalEnd, SEEK_SET);
+
+        journal = new Journal(fd, journalEnd, options);
+        if (journalEnd == Journal::FILE_HEADER_SIZE && !result.snapshotLoaded)
+        {
+            // A new journal starts with the window its records refer to
+            journalRecord(JournalRecordType::NewDay, int32_t(today));
+        }
+        else if (today < startDay)
+        {
+            // The recovered window starts where the journal left it. Restarted on a later date, it moves on to that
+            // date, as the rollovers missed meanwhile would have moved it; it never moves back if the clock did.
+            moveWindowLocked(startDay);
+            journalRecord(JournalRecordType::NewDay, int32_t(today));
+        }
+        if (options.snapshotIntervalMillis > 0 && !options.snapshotPath.empty())
+        {
+            snapshotStopping = false;
+            snapshotThread = thread(&FlipCare::snapshotLoop, this, options.snapshotIntervalMillis);
+        }
+        result.code = ResultCode::Ok;
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    // Writes the whole state to the snapshot file, replacing the previous snapshot in one step. Bookings are frozen
+    // while the state is copied, not while it is written out.
+    ResultCode saveSnapshot()
+    {
+        lock_guard<mutex> snapshotLock(snapshotMutex);
+        Journal *openJournal = journal;
+        if (openJournal == nullptr || openJournal->getOptions().snapshotPath.empty())
+        {
+            return ResultCode::JournalError;
+        }
+        string image;
+        {
+            unique_lock<shared_mutex> registryLock(registryMutex);
+            image = buildSnapshot(openJournal->flush());
+        }
+        return writeFileAtomically(openJournal->getOptions().snapshotPath, image) ? ResultCode::Ok : ResultCode::JournalError;
+    }
+
+    // Ends the periodic snapshots and writes and syncs what is left of the journal. Call once no other thread uses FlipCare.
+    JournalStats closeJournal()
+    {
+        {
+            lock_guard<mutex> lock(snapshotThreadMutex);
+            snapshotStopping = true;
+        }
+        snapshotWakeup.notify_all();
+        if (snapshotThread.joinable())
+        {
+            snapshotThread.join();
+        }
+        unique_lock<shared_mutex> registryLock(registryMutex);
+        Journal *openJournal = journal.exchange(nullptr);
+        if (openJournal == nullptr)
+        {
+            return {0, 0, 0, 0};
+        }
+        openJournal->close();
+        JournalStats stats = openJournal->getStats();
+        delete openJournal;
+        return stats;
+    }
+
+    // A waitlisted patient gets the slot within the cancellation that freed it; telling them is asynchronous.
+    // From now on every promotion becomes a SlotNotification, queued once its cancellation has returned and handed
+    // to handler(const vector<SlotNotification> &) in batches on a background thread, in the order the queue got
+    // them. A full queue makes cancellations wait, so a slow handler holds back cancellations rather than memory.
+    // Call while no notifications are on.
+    template <typename Handler>
+    void startNotifications(NotificationOptions options, Handler handler)
+    {
+        BoundedQueue<WaitlistPromotion> *queue = new BoundedQueue<WaitlistPromotion>(options.queueCapacity);
+        notificationCount = 0;
+        notificationBatchCount = 0;
+        notificationThread = thread(&FlipCare::notificationLoop<Handler>, this, queue, options, handler);
+        notificationQueue.store(queue, memory_order_release);
+    }
+
+    // Delivers what is queued, then ends the notifications. Call once no other thread cancels bookings.
+    NotificationStats stopNotifications()
+    {
+        BoundedQueue<WaitlistPromotion> *queue = notificationQueue.exchange(nullptr);
+        if (queue == nullptr)
+        {
+            return {0, 0, 0};
+        }
+        queue->close();
+        notificationThread.join();
+        NotificationStats stats = {notificationCount, notificationBatchCount, queue->getProducerWaitCount()};
+        delete queue;
+        return stats;
+    }
+
+    // One page of a speciality's available slots in start time order, for clients that scroll through the results.
+    // Every page is a seek into the ordered index plus pageSize steps, however deep the cursor is.
+    // A cursor belongs to the day it was returned for. Like the other speciality search it takes no lock.
+    AvailabilityPage searchAvailableSlots(string speciality, int pageSize, SearchCursor cursor = FIRST_PAGE, Day day = TODAY)
+    {
+        return measure(MetricOperation::SearchPage, [&]() -> AvailabilityPage
+                                                    {
+            AvailabilityPage page = {{}, cursor, false};
+            day = resolveDay(day);
+            if (pageSize <= 0 || !isInWindow(day))
+            {
+                return page;
+            }
+            // One extra slot tells whether another page follows
+            vector<pair<SlotIndex, Doctor *>> slots;
+            if (cursor == FIRST_PAGE)
+            {
+                slots = availabilityIndex.getSlots(speciality, day, pageSize + 1);
+            }
+            else
+            {
+                slots = availabilityIndex.getSlotsAfter(speciality, day, {SlotIndex(cursor >> 32) - 1, DoctorId(cursor)}, pageSize + 1);
+            }
+            page.hasMore = slots.size() > size_t(pageSize);
+            slots.resize(min(slots.size(), size_t(pageSize)));
+            for (const pair<SlotIndex, Doctor *> &slot : slots)
+            {
+                page.slots.push_back({slot.second->doctorId, slot.second->doctorName, slot.first});
+            }
+            if (!slots.empty())
+            {
+                page.nextCursor = (SearchCursor(slots.back().first) + 1) << 32 | slots.back().second->doctorId;
+            }
+            return page; });
+    }
+
+    // Ratings are out of 5; the doctor's latest rating is kept
+    ResultCode rateDoctor(string doctorName, double rating)
+    {
+        JournalCommit journalCommit(journal);
+        shared_lock<shared_mutex> registryLock(registryMutex);
+        Doctor *doctor = findDoctor(doctorName);
+        if (doctor == nullptr)
+        {
+            return ResultCode::DoctorNotFound;
+        }
+        if (!(rating >= 0 && rating <= 5))
+        {
+            return ResultCode::InvalidRating;
+        }
+        // Only taken so that the journal sees ratings of one doctor in the order they were applied
+        lock_guard<mutex> doctorLock(doctor->doctorMutex);
+        doctor->ratingTenths = lround(rating * 10);
+        journalRecord(JournalRecordType::Rate, doctor->doctorId, int32_t(doctor->ratingTenths));
+        return ResultCode::Ok;
+    }
+
+    // The slots should be displayed in a ranked fashion. RankingPolicy decides the order, start time by default;
+    // only the best limit slots are ranked and returned, all of them if limit is negative.
+    // Searches take no lock and never hold up bookings: they read the index version that was current when they
+    // started. A doctor's name never changes and doctors are never freed, so the results can point at them.
+    template <typename RankingPolicy = RankByStartTime>
+    vector<AvailableSlot> getAvailableSlotsBySpeciality(string speciality, int limit = -1, Day day = TODAY)
+    {
+        return measure(MetricOperation::SearchBySpeciality, [&]
+                                                            {
+            vector<pair<SlotIndex, Doctor *>> rankedSlots;
+            day = resolveDay(day);
+            if (isInWindow(day))
+            {
+                rankedSlots = rankSlots<RankingPolicy>(speciality, day, limit < 0 ? SIZE_MAX : size_t(limit));
+            }
+            return toAvailableSlots(rankedSlots); });
+    }
+
+    // "First free cardiologist after 14:00": the earliest slot starting at or after the given time, e.g. "14:00", that
+    // a doctor of the speciality has free, with the first limit doctors free then (all of them if limit is negative).
+    // One mask AND and a find-first-set over the speciality's free slots, however many doctors there are; no slot at
+    // all when nothing is free.
+    SlotSearchResult findEarliestAvailable(string speciality, string after, int limit = -1, Day day = TODAY)
+    {
+        return measure(MetricOperation::FindEarliest, [&]() -> SlotSearchResult
+                                                      {
+            int afterMinutes;
+            if (!SlotTime::parseMinutes(after, afterMinutes))
+            {
+                return {ResultCode::InvalidSlot, {}};
+            }
+            day = resolveDay(day);
+            if (!isInWindow(day))
+            {
+                return {ResultCode::DayOutOfRange, {}};
+            }
+            SlotMask candidateSlots = SlotMask::range(SlotTime::firstSlotStartingFrom(afterMinutes), SlotTime::slotsPerDay());
+            size_t doctorLimit = limit < 0 ? SIZE_MAX : size_t(limit);
+            return {ResultCode::Ok, toAvailableSlots(availabilityIndex.getEarliestSlot(speciality, day, candidateSlots, doctorLimit))}; });
+    }
+
+    // "Anything between 12:00 and 15:00": every free slot of the speciality that starts at or after from and is over by
+    // to, in start time order. Only the slots in the window that someone has free are visited.
+    SlotSearchResult findAvailableInWindow(string speciality, string from, string to, Day day = TODAY)
+    {
+        return measure(MetricOperation::FindInWindow, [&]() -> SlotSearchResult
+                                                      {
+            int fromMinutes, toMinutes;
+            if (!SlotTime::parseMinutes(from, fromMinutes) || !SlotTime::parseMinutes(to, toMinutes, true))
+            {
+                return {ResultCode::InvalidSlot, {}};
+            }
+            day = resolveDay(day);
+            if (!isInWindow(day))
+            {
+                return {ResultCode::DayOutOfRange, {}};
+            }
+            SlotMask candidateSlots = SlotMask::range(SlotTime::firstSlotStartingFrom(fromMinutes), SlotTime::slotsEndingBy(toMinutes));
+            return {ResultCode::Ok, toAvailableSlots(availabilityIndex.getSlotsIn(speciality, day, candidateSlots))}; });
+    }
+
+    // Trending Doctor: the k doctors with the most appointments in the booking window, optionally within one speciality
+    vector<pair<string, int>> getTrendingDoctors(int k, string speciality = "")
+    {
+        shared_lock<shared_mutex> registryLock(registryMutex);
+        vector<pair<DoctorId, int>> topDoctorIds;
+        SpecialityId specialityId;
+        if (speciality.empty())
+        {
+            topDoctorIds = trendingDoctors.getTopDoctors(k);
+        }
+        else if (specialityIds.find(speciality, specialityId))
+        {
+            topDoctorIds = trendingDoctors.getTopDoctors(k, specialityId);
+        }
+        vector<pair<string, int>> topDoctors;
+        for (const pair<DoctorId, int> &topDoctorId : topDoctorIds)
+        {
+            topDoctors.push_back({doctorPool.get(topDoctorId.first)->doctorName, topDoctorId.second});
+        }
+        return topDoctors;
+    }
+
+    DoctorSlotsResult getDoctorSlots(string doctorName, Day day = TODAY)
+    {
+        shared_lock<shared_mutex> registryLock(registryMutex);
+        Doctor *doctor = findDoctor(doctorName);
+        if (doctor == nullptr)
+        {
+            return {ResultCode::DoctorNotFound, {}, {}};
+        }
+        day = resolveDay(day);
+        if (!isInWindow(day))
+        {
+            return {ResultCode::DayOutOfRange, {}, {}};
+        }
+        lock_guard<mutex> doctorLock(doctor->doctorMutex);
+        return {ResultCode::Ok, doctor->dayOf(day).declaredSlots, doctor->dayOf(day).availableSlots};
+    }
+
+    // The counters and latency histograms of every thread added up, and the bookings and waitlists as they are now.
+    // Doctors are locked one at a time, so the gauges are only consistent per doctor.
+    EngineMetrics getMetrics()
+    {
+        EngineMetrics metrics = Metrics::read();
+        shared_lock<shared_mutex> registryLock(registryMutex);
+        doctorPool.forEach([&](Doctor *doctor)
+                           {
+            lock_guard<mutex> doctorLock(doctor->doctorMutex);
+            metrics.liveBookingCount += doctor->doctorAppointmentCount;
+            for (Day day = today; day - today < Calendar::WINDOW_DAYS; day++)
+            {
+                for (auto &[slot, waitlist] : doctor->dayOf(day).slotWaitlists)
+                {
+                    metrics.waitlistedBookingCount += waitlist.size();
+                    metrics.waitlistedSlotCount++;
+                    metrics.longestWaitlist = max<long long>(metrics.longestWaitlist, waitlist.size());
+                }
+            } });
+        metrics.liveBookingCount += metrics.waitlistedBookingCount;
+        return metrics;
+    }
+
+    // The patient's appointments over the booking window, earliest first
+    PatientAppointmentsResult getPatientAppointments(string patientName)
+    {
+        shared_lock<shared_mutex> registryLock(registryMutex);
+        Patient *patient = findPatient(patientName);
+        if (patient == nullptr)
+        {
+            return {ResultCode::PatientNotFound, {}};
+        }
+        vector<PatientAppointment> patientAppointments = patient->getAppointments(today);
+        PatientAppointmentsResult result = {ResultCode::Ok, vector<AppointmentView>(patientAppointments.size())};
+        for (size_t i = 0; i < patientAppointments.size(); i++)
+        {
+            const PatientAppointment &appointment = patientAppointments[i];
+            result.appointments[i] = {doctorPool.get(appointment.doctorId)->doctorName, appointment.day, appointment.slot, appointment.status};
+        }
+        return result;
+    }
+};
+
+// Where rendered text goes. FlipCare itself never writes output: it returns typed results, and a FlipCareConsole
+// renders them into a sink.
+class OutputSink
+{
+public:
+    virtual void write(string_view text) = 0;
+    virtual void flush() {}
+    virtual ~OutputSink() = default;
+};
+
+// Collects text in memory and hands it to the file in large batches instead of one stream write per line
+class BufferedOutputSink : public OutputSink
+{
+private:
+    static const size_t BATCH_SIZE = 64 * 1024;
+    FILE *file;
+    string buffer;
+
+public:
+    BufferedOutputSink(FILE *file)
+    {
+        this->file = file;
+        buffer.reserve(BATCH_SIZE);
+    }
+
+    ~BufferedOutputSink()
+    {
+        flush();
+    }
+
+    void write(string_view text) override
+    {
+        buffer.append(text);
+        if (buffer.size() >= BATCH_SIZE)
+        {
+            flush();
+        }
+    }
+
+    void flush() override
+    {
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        fflush(file);
+        buffer.clear();
+    }
+};
+
+// Drops all output, e.g. for benchmarks
+class NullOutputSink : public OutputSink
+{
+public:
+    void write(string_view) override {}
+};
+
+// The text front end of FlipCare: every call runs the operation on the engine and renders its result into the sink
+class FlipCareConsole
+{
+private:
+    FlipCare *flipCare;
+    OutputSink &sink;
+
+    void append(string_view text)
+    {
+        sink.write(text);
+    }
+
+    void append(long long value)
+    {
+        char buffer[24];
+        int length = snprintf(buffer, sizeof(buffer), "%lld", value);
+        sink.write(string_view(buffer, length));
+    }
+
+    // " on YYYY-MM-DD" for an explicit day; output for today reads as it always did
+    static string onDay(Day day)
+    {
+        return day == TODAY ? "" : " on " + Calendar::toString(day);
+    }
+
+    void printDayOutOfRange(Day day)
+    {
+        print("Sorry, ", Calendar::toString(day), " is outside the ", int(Calendar::WINDOW_DAYS), " day booking window\n");
+    }
+
+    // Returns false, printing nothing, if the search went through
+    bool printSearchError(const SlotSearchResult &result, Day day)
+    {
+        if (result.code == ResultCode::InvalidSlot)
+        {
+            print("Sorry, times are given as HH:MM\n\n");
+        }
+        else if (result.code == ResultCode::DayOutOfRange)
+        {
+            printDayOutOfRange(day);
+            print("\n");
+        }
+        return result.code != ResultCode::Ok;
+    }
+
+    static string formatNumber(double value)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.6g", value);
+        return buffer;
+    }
+
+    void printMetricHeader(string_view name, string_view type, string_view help)
+    {
+        print("# HELP ", name, " ", help, "\n# TYPE ", name, " ", type, "\n");
+    }
+
+    void printMetric(string_view name, string_view type, string_view help, long long value)
+    {
+        printMetricHeader(name, type, help);
+        print(name, " ", value, "\n");
+    }
+
+public:
+    FlipCareConsole(FlipCare *flipCare, OutputSink &sink) : flipCare(flipCare), sink(sink) {}
+
+    template <typename... Parts>
+    void print(const Parts &...parts)
+    {
+        (append(parts), ...);
+    }
+
+    void flush()
+    {
+        sink.flush();
+    }
+
+    ResultCode registerDoctor(string doctorName, string doctorSpecialization)
+    {
+        ResultCode code = flipCare->registerDoctor(doctorName, doctorSpecialization);
+        if (code == ResultCode::Ok)
+        {
+            print("Welcome Dr. ", doctorName, " !!\n");
+        }
+        else
+        {
+            print("Doctor already exists\n\n");
+        }
+        print("\n");
+        return code;
+    }
+
+    AvailabilityResult markDoctorAvailability(string doctorName, vector<string> times, Day day = TODAY)
+    {
+        AvailabilityResult result = flipCare->markDoctorAvailability(doctorName, times, day);
+        if (result.code == ResultCode::Ok)
+        {
+            print("Done Doc!\n");
+        }
+        else if (result.code == ResultCode::InvalidSlot)
+        {
+            print("Sorry Dr. ", doctorName, " slots are ", SlotTime::getGrid().slotMinutes, " mins only\n");
+            print("There are ", result.invalidTimeSlotCount, " invalid slots out of ", times.size(), " slots\n");
+        }
+        else if (result.code == ResultCode::DayOutOfRange)
+        {
+            printDayOutOfRange(day);
+        }
+        else
+        {
+            print("Doctor not found\n");
+        }
+        print("\n");
+        return result;
+    }
+
+    ResultCode registerPatient(string patientName)
+    {
+        ResultCode code = flipCare->registerPatient(patientName);
+        print(code == ResultCode::Ok ? "Registration successful\n" : "Patient already exists\n");
+        return code;
+    }
+
+    BookingResult bookAppointment(string doctorName, string patientName, string time, Day day = TODAY)
+    {
+        BookingResult result = flipCare->bookAppointment(doctorName, patientName, time, day);
+        switch (result.code)
+        {
+        case ResultCode::DayOutOfRange:
+            printDayOutOfRange(day);
+            print("\n");
+            break;
+        case ResultCode::PatientNotFound:
+            print("Patient not found\n");
+            break;
+        case ResultCode::DoctorNotFound:
+            print("Doctor not found\n");
+            break;
+        case ResultCode::SlotConflict:
+            print("Patient ", patientName, " already has an appointment at this time with Dr. ", result.conflictingDoctorName, "\n");
+            print("Hence cannot book appointment with Dr. ", doctorName, " at this time\n\n");
+            break;
+        case ResultCode::BookingCapacityExceeded:
+            print("No more bookings can be taken at the moment\n\n");
+            break;
+        case ResultCode::Booked:
+        case ResultCode::Waitlisted:
+            print("Booked. Booking id: ", result.bookingId, "\n\n");
+            break;
+        default:
+            print("Dr. ", doctorName, " is not available at ", time, "\n\n");
+            break;
+        }
+        return result;
+    }
+
+    ResultCode cancelBookingId(int bookingId)
+    {
+        ResultCode code = flipCare->cancelBookingId(bookingId);
+        if (code == ResultCode::Ok)
+        {
+            print("Booking ID ", bookingId, " is cancelled\n\n");
+        }
+        else
+        {
+            print("Booking not found\n");
+        }
+        return code;
+    }
+
+    WithdrawalResult withdrawDoctor(string doctorName, vector<string> times, Day day = TODAY)
+    {
+        WithdrawalResult result = flipCare->withdrawDoctor(doctorName, times, day);
+        if (result.code == ResultCode::DoctorNotFound)
+        {
+            print("Doctor not found\n\n");
+            return result;
+        }
+        if (result.code == ResultCode::DayOutOfRange)
+        {
+            printDayOutOfRange(day);
+            print("\n");
+            return result;
+        }
+        if (result.code == ResultCode::InvalidSlot)
+        {
+            print("Sorry Dr. ", doctorName, " slots are ", SlotTime::getGrid().slotMinutes, " mins only\n");
+            print("There are ", result.invalidTimeSlotCount, " invalid slots out of ", times.size(), " slots\n");
+        }
+        print("Dr. ", doctorName, "'s slots are withdrawn", onDay(day), "\n");
+        for (const Rebooking &rebooking : result.rebookings)
+        {
+            print("Booking ID ", rebooking.bookingId, " of ", rebooking.patientName, " at ", SlotTime::startTime(rebooking.slot));
+            if (rebooking.newBookingId != 0)
+            {
+                print(" is moved to Dr. ", rebooking.doctorName, ". Booking id: ", rebooking.newBookingId, "\n");
+            }
+            else
+            {
+                print(" is cancelled, no other doctor is available at this time\n");
+            }
+        }
+        print("\n");
+        return result;
+    }
+
+    ResultCode rateDoctor(string doctorName, double rating)
+    {
+        ResultCode code = flipCare->rateDoctor(doctorName, rating);
+        if (code == ResultCode::DoctorNotFound)
+        {
+            print("Doctor not found\n\n");
+        }
+        else if (code == ResultCode::InvalidRating)
+        {
+            print("Rating should be between 0 and 5\n\n");
+        }
+        else
+        {
+            long ratingTenths = lround(rating * 10);
+            print("Dr. ", doctorName, " is rated ", ratingTenths / 10, ".", ratingTenths % 10, "\n\n");
+        }
+        return code;
+    }
+
+    template <typename RankingPolicy = RankByStartTime>
+    void showAvailableSlotsBySpeciality(string speciality, int limit = -1, Day day = TODAY)
+    {
+        vector<AvailableSlot> availableSlots = flipCare->getAvailableSlotsBySpeciality<RankingPolicy>(speciality, limit, day);
+        print("Available slots for ", speciality, onDay(day), " are as follows:\n");
+        for (const AvailableSlot &availableSlot : availableSlots)
+        {
+            print("Dr. ", availableSlot.doctorName, " : ", SlotTime::toString(availableSlot.slot), "\n");
+        }
+        print("\n");
+    }
+
+    AvailabilityPage showAvailableSlotsPage(string speciality, int pageSize, SearchCursor cursor = FIRST_PAGE, Day day = TODAY)
+    {
+        AvailabilityPage page = flipCare->searchAvailableSlots(speciality, pageSize, cursor, day);
+        print("Available slots for ", speciality, onDay(day), " are as follows:\n");
+        for (const AvailableSlot &availableSlot : page.slots)
+        {
+            print("Dr. ", availableSlot.doctorName, " : ", SlotTime::toString(availableSlot.slot), "\n");
+        }
+        print(page.hasMore ? "More slots available\n\n" : "\n");
+        return page;
+    }
+
+    SlotSearchResult showEarliestAvailable(string speciality, string after, int limit = -1, Day day = TODAY)
+    {
+        SlotSearchResult result = flipCare->findEarliestAvailable(speciality, after, limit, day);
+        if (printSearchError(result, day))
+        {
+            return result;
+        }
+        if (result.slots.empty())
+        {
+            print("No available slot for ", speciality, " from ", after, onDay(day), "\n\n");
+            return result;
+        }
+        print("Earliest available slot for ", speciality, " from ", after, onDay(day), " is as follows:\n");
+        for (const AvailableSlot &availableSlot : result.slots)
+        {
+            print("Dr. ", availableSlot.doctorName, " : ", SlotTime::toString(availableSlot.slot), "\n");
+        }
+        print("\n");
+        return result;
+    }
+
+    SlotSearchResult showAvailableInWindow(string speciality, string from, string to, Day day = TODAY)
+    {
+        SlotSearchResult result = flipCare->findAvailableInWindow(speciality, from, to, day);
+        if (printSearchError(result, day))
+        {
+            return result;
+        }
+        print("Available slots for ", speciality, " between ", from, " and ", to, onDay(day), " are as follows:\n");
+        for (const AvailableSlot &availableSlot : result.slots)
+        {
+            print("Dr. ", availableSlot.doctorName, " : ", SlotTime::toString(availableSlot.slot), "\n");
+        }
+        print("\n");
+        return result;
+    }
+
+    void showTrendingDoctors(int k, string speciality = "")
+    {
+        vector<pair<string, int>> topDoctors = flipCare->getTrendingDoctors(k, speciality);
+        print("Trending doctors", speciality.empty() ? "" : " for ", speciality, ":\n");
+        for (size_t i = 0; i < topDoctors.size(); i++)
+        {
+            print(i + 1, ". Dr. ", topDoctors[i].first, " : ", topDoctors[i].second, " appointments\n");
+        }
+        print("\n");
+    }
+
+    void displayDoctorSlots(string doctorName, Day day = TODAY)
+    {
+        DoctorSlotsResult result = flipCare->getDoctorSlots(doctorName, day);
+        if (result.code == ResultCode::Ok)
+        {
+            print("Dr. ", doctorName, " slots' status", onDay(day), " is as follows:\n");
+            result.declaredSlots.forEach([&](SlotIndex slot)
+                                         { print(SlotTime::toString(slot), " : ", result.availableSlots.test(slot) ? "Available\n" : "Not Available\n"); });
+        }
+        else if (result.code == ResultCode::DayOutOfRange)
+        {
+            printDayOutOfRange(day);
+        }
+        else
+        {
+            print("Doctor not found\n");
+        }
+        print("\n");
+    }
+
+    void startNewDay()
+    {
+        flipCare->startNewDay();
+        print("Today is ", Calendar::toString(flipCare->getToday()), "\n\n");
+    }
+
+    // The engine's metrics in the Prometheus text format. Latencies are summaries with the quantiles read off the
+    // histograms, so they are exact to the histogram's 1/16 precision.
+    void dumpMetrics()
+    {
+        EngineMetrics metrics = flipCare->getMetrics();
+        printMetricHeader("flipcare_operations_total", "counter", "Calls by operation and result. Requests of batch calls count under the operation they perform.");
+        for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
+        {
+            for (int code = 0; code < RESULT_CODE_COUNT; code++)
+            {
+                if (metrics.resultCounts[operation][code] > 0)
+                {
+                    print("flipcare_operations_total{operation=\"", metricLabel(MetricOperation(operation)), "\",result=\"",
+                          metricLabel(ResultCode(code)), "\"} ", metrics.resultCounts[operation][code], "\n");
+                }
+            }
+        }
+        printMetricHeader("flipcare_operation_latency_seconds", "summary", "Latency of the calls, journal commit included.");
+        for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
+        {
+            const LatencyHistogram &latency = metrics.latencies[operation];
+            if (latency.count == 0)
+            {
+                continue;
+            }
+            const char *label = metricLabel(MetricOperation(operation));
+            for (double quantile : {0.5, 0.9, 0.99, 0.999})
+            {
+                print("flipcare_operation_latency_seconds{operation=\"", label, "\",quantile=\"", formatNumber(quantile), "\"} ",
+                      formatNumber(latency.valueAt(quantile) * metrics.secondsPerTick), "\n");
+            }
+            print("flipcare_operation_latency_seconds_sum{operation=\"", label, "\"} ", formatNumber(latency.sum * metrics.secondsPerTick), "\n");
+            print("flipcare_operation_latency_seconds_count{operation=\"", label, "\"} ", latency.count, "\n");
+        }
+        printMetric("flipcare_waitlist_promotions_total", "counter", "Waitlisted bookings handed the slot by a cancellation.", metrics.promotionCount);
+        printMetric("flipcare_live_bookings", "gauge", "Bookings in the booking window, waitlisted ones included.", metrics.liveBookingCount);
+        printMetric("flipcare_waitlisted_bookings", "gauge", "Bookings waiting for their slot.", metrics.waitlistedBookingCount);
+        printMetric("flipcare_waitlisted_slots", "gauge", "Slots with a waitlist.", metrics.waitlistedSlotCount);
+        printMetric("flipcare_longest_waitlist", "gauge", "Bookings waiting for the most wanted slot.", metrics.longestWaitlist);
+        print("\n");
+    }
+
+    void displayPatientAppointments(string patientName)
+    {
+        PatientAppointmentsResult result = flipCare->getPatientAppointments(patientName);
+        Day today = flipCare->getToday();
+        if (result.code == ResultCode::Ok)
+        {
+            print("Patient ", patientName, " has the following appointments:\n");
+            for (const AppointmentView &appointment : result.appointments)
+            {
+                // Appointments of later days carry their date
+                string date = appointment.day == today ? "" : Calendar::toString(appointment.day) + " ";
+                print("Dr. ", appointment.doctorName, " : ", date, SlotTime::startTime(appointment.slot), " ", toString(appointment.status), "\n");
+            }
+            if (result.appointments.empty())
+            {
+                print("No appointments\n");
+            }
+        }
+        else
+        {
+            print("Patient not found\n");
+        }
+        print("\n");
+    }
+};
+
+// Replays the README command language, one command per line:
+//   registerDoc -> Curious -> Cardiologist
+//   markDocAvail: Curious 9:30-10:00, 12:30-13:00
+//   withdrawDoc: Curious 12:30-13:00
+//   registerPatient -> PatientA
+//   bookAppointment: (PatientA, Dr.Curious, 12:30)
+//   cancelBookingId: 1
+//   showAvailByspeciality: Cardiologist
+//   findEarliest: Cardiologist 14:00
+//   findInWindow: Cardiologist 12:00 15:00
+//   showTrending: 3 Cardiologist
+//   rateDoc: Curious 4.5
+//   startNewDay
+//   dumpMetrics
+// withdrawDoc without times withdraws the whole day. markDocAvail, withdrawDoc, bookAppointment and the speciality
+// searches take an optional date within the booking window, e.g.
+//   markDocAvail: Curious 2025-06-02 9:30-10:00   bookAppointment: (PatientA, Dr.Curious, 12:30, 2025-06-02)
+//   showAvailByspeciality: Cardiologist 2025-06-02   findEarliest: Cardiologist 14:00 2025-06-02
+// A leading "i:" is ignored, and "o:" lines, blank lines and lines starting with '#' are skipped, so the README
+// examples can be fed in as they are. Input is read in large blocks and tokenised with string_view; the only
+// allocations per command are the strings handed to FlipCare, and those reuse the driver's buffers.
+// Results are rendered through a FlipCareConsole.
+class CommandDriver
+{
+private:
+    FlipCareConsole &console;
+    string doctorName, patientName, argument, fromTime, toTime;
+    vector<string> times;
+    long long commandCount = 0;
+    long long invalidCommandCount = 0;
+
+    static bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    static string_view trim(string_view text)
+    {
+        while (!text.empty() && isSpace(text.front()))
+        {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && isSpace(text.back()))
+        {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    // Splits the last word off text. Returns an empty word, leaving text as it is, if text has no more than one word.
+    static string_view takeLastWord(string_view &text)
+    {
+        size_t lastSpace = text.find_last_of(" \t");
+        if (lastSpace == string_view::npos)
+        {
+            return {};
+        }
+        string_view word = text.substr(lastSpace + 1);
+        text = trim(text.substr(0, lastSpace));
+        return word;
+    }
+
+    static bool equalsIgnoreCase(string_view a, string_view b)
+    {
+        if (a.size() != b.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            if (tolower(static_cast<unsigned char>(a[i])) != tolower(static_cast<unsigned char>(b[i])))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool consumePrefix(string_view &text, string_view prefix)
+    {
+        if (text.size() < prefix.size() || !equalsIgnoreCase(text.substr(0, prefix.size()), prefix))
+        {
+            return false;
+        }
+        text.remove_prefix(prefix.size());
+        return true;
+    }
+
+    // Next token up to any of the separators; separators and surrounding spaces are consumed
+    static string_view nextToken(string_view &text, string_view separators)
+    {
+        text = trim(text);
+        size_t end = text.find_first_of(separators);
+        string_view token = trim(text.substr(0, end));
+        text = end == string_view::npos ? string_view() : text.substr(end + 1);
+        return token;
+    }
+
+    // "-> a -> b" style arguments
+    static string_view nextArrowArgument(string_view &text)
+    {
+        text = trim(text);
+        consumePrefix(text, "->");
+        size_t end = text.find("->");
+        string_view token = trim(text.substr(0, end));
+        text = end == string_view::npos ? string_view() : text.substr(end);
+        return token;
+    }
+
+    static bool parseInt(string_view text, int &value)
+    {
+        if (text.empty() || text.size() > 9)
+        {
+            return false;
+        }
+        value = 0;
+        for (char c : text)
+        {
+            if (!isdigit(static_cast<unsigned char>(c)))
+            {
+                return false;
+            }
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    bool dispatch(string_view line)
+    {
+        size_t nameEnd = 0;
+        while (nameEnd < line.size() && isalpha(static_cast<unsigned char>(line[nameEnd])))
+        {
+            nameEnd++;
+        }
+        string_view command = line.substr(0, nameEnd);
+        string_view arguments = trim(line.substr(nameEnd));
+        consumePrefix(arguments, ":");
+
+        if (equalsIgnoreCase(command, "registerDoc"))
+        {
+            string_view name = nextArrowArgument(arguments);
+            string_view speciality = nextArrowArgument(arguments);
+            if (name.empty() || speciality.empty())
+            {
+                return false;
+            }
+            doctorName.assign(name);
+            argument.assign(speciality);
+            console.registerDoctor(doctorName, argument);
+        }
+        else if (equalsIgnoreCase(command, "registerPatient"))
+        {
+            string_view name = nextArrowArgument(arguments);
+            if (name.empty())
+            {
+                return false;
+            }
+            patientName.assign(name);
+            console.registerPatient(patientName);
+        }
+        else if (equalsIgnoreCase(command, "markDocAvail") || equalsIgnoreCase(command, "withdrawDoc"))
         {
-            return false;
+            string_view name = nextToken(arguments, " \t,");
+            consumePrefix(name, "Dr.");
+            if (name.empty())
+            {
+                return false;
+            }
+            doctorName.assign(name);
+            Day day = TODAY;
+            string_view afterDate = arguments;
+            if (Calendar::parseDate(nextToken(afterDate, " \t,"), day))
+            {
+                arguments = afterDate;
+            }
+            size_t timeCount = 0;
+            for (string_view time = nextToken(arguments, " \t,"); !time.empty() || !arguments.empty(); time = nextToken(arguments, " \t,"))
+            {
+                if (time.empty())
+                {
+                    continue;
+                }
+                if (timeCount == times.size())
+                {
+                    times.emplace_back();
+                }
+                times[timeCount++].assign(time);
+            }
+            times.resize(timeCount);
+            if (equalsIgnoreCase(command, "withdrawDoc"))
+            {
+                console.withdrawDoctor(doctorName, times, day);
+            }
+            else
+            {
+                console.markDoctorAvailability(doctorName, times, day);
+            }
         }
-        if (startHour > endHour || (startHour == endHour && startMin >= endMin))
+        else if (equalsIgnoreCase(command, "bookAppointment"))
         {
-            return false;
+            arguments = trim(arguments);
+            consumePrefix(arguments, "(");
+            if (!arguments.empty() && arguments.back() == ')')
+            {
+                arguments.remove_suffix(1);
+            }
+            string_view patient = nextToken(arguments, ",");
+            string_view doctor = nextToken(arguments, ",");
+            string_view time = nextToken(arguments, ",");
+            string_view date = nextToken(arguments, ",");
+            consumePrefix(doctor, "Dr.");
+            doctor = trim(doctor);
+            Day day = TODAY;
+            if (patient.empty() || doctor.empty() || time.empty() || (!date.empty() && !Calendar::parseDate(date, day)))
+            {
+                return false;
+            }
+            patientName.assign(patient);
+            doctorName.assign(doctor);
+            argument.assign(time);
+            console.bookAppointment(doctorName, patientName, argument, day);
         }
-        if (startMin % 30 != 0 || endMin % 30 != 0)
+        else if (equalsIgnoreCase(command, "cancelBookingId"))
         {
-            return false;
+            int bookingId;
+            if (!parseInt(trim(arguments), bookingId))
+            {
+                return false;
+            }
+            console.cancelBookingId(bookingId);
         }
-        int startTimeVal = (startHour * 60) + startMin;
-        int endTimeVal = (endHour * 60) + endMin;
-        if ((endTimeVal - startTimeVal) != 30)
+        else if (equalsIgnoreCase(command, "showAvailByspeciality"))
         {
-            return false;
+            string_view speciality = trim(arguments);
+            // Specialities may contain spaces, so the date is recognised as the last word
+            Day day = TODAY;
+            size_t lastSpace = speciality.find_last_of(" \t");
+            if (lastSpace != string_view::npos && Calendar::parseDate(speciality.substr(lastSpace + 1), day))
+            {
+                speciality = trim(speciality.substr(0, lastSpace));
+            }
+            if (speciality.empty())
+            {
+                return false;
+            }
+            argument.assign(speciality);
+            console.showAvailableSlotsBySpeciality(argument, -1, day);
         }
-        return true;
-    }
-    int markAvailability(vector<string> times)
-    {
-        int findDashPos, invalidTimeSlotCount;
-        string currStartTime, currEndTime;
-        invalidTimeSlotCount = 0;
-        for (int i = 0; i < times.size(); i++)
+        else if (equalsIgnoreCase(command, "findEarliest") || equalsIgnoreCase(command, "findInWindow"))
         {
-            auto it = find(times[i].begin(), times[i].end(), '-');
-            findDashPos = distance(times[i].begin(), it);
-            currStartTime = times[i].substr(0, findDashPos);
-            currEndTime = times[i].substr(findDashPos + 1);
-            if (isValid(currStartTime, currEndTime))
+            // The times and the date are taken from the end, since specialities may contain spaces
+            bool isWindow = equalsIgnoreCase(command, "findInWindow");
+            string_view speciality = trim(arguments);
+            Day day = TODAY;
+            string_view beforeDate = speciality;
+            if (Calendar::parseDate(takeLastWord(beforeDate), day))
+            {
+                speciality = beforeDate;
+            }
+            string_view to = isWindow ? takeLastWord(speciality) : string_view();
+            string_view from = takeLastWord(speciality);
+            if (from.empty() || (isWindow && to.empty()))
+            {
+                return false;
+            }
+            argument.assign(speciality);
+            fromTime.assign(from);
+            if (isWindow)
             {
-                doctorSlots.push_back(new Slot(currStartTime, currEndTime));
+                toTime.assign(to);
+                console.showAvailableInWindow(argument, fromTime, toTime, day);
             }
             else
             {
-                invalidTimeSlotCount++;
+                console.showEarliestAvailable(argument, fromTime, -1, day);
             }
         }
-        return invalidTimeSlotCount;
-    }
-
-    bool isSlotAvailable(string startTime)
-    {
-        for (int i = 0; i < doctorSlots.size(); i++)
+        else if (equalsIgnoreCase(command, "showTrending"))
         {
-            if (doctorSlots[i]->startTime == startTime)
+            int k;
+            if (!parseInt(nextToken(arguments, " \t"), k))
             {
-                return doctorSlots[i]->isCurrSlotAvailable;
+                return false;
             }
+            argument.assign(trim(arguments));
+            console.showTrendingDoctors(k, argument);
         }
-        return false;
+        else if (equalsIgnoreCase(command, "rateDoc"))
+        {
+            string_view doctor = nextToken(arguments, " \t");
+            consumePrefix(doctor, "Dr.");
+            argument.assign(trim(arguments));
+            char *end;
+            double rating = strtod(argument.c_str(), &end);
+            if (doctor.empty() || argument.empty() || *end != '\0')
+            {
+                return false;
+            }
+            doctorName.assign(trim(doctor));
+            console.rateDoctor(doctorName, rating);
+        }
+        else if (equalsIgnoreCase(command, "startNewDay"))
+        {
+            if (!trim(arguments).empty())
+            {
+                return false;
+            }
+            console.startNewDay();
+        }
+        else if (equalsIgnoreCase(command, "dumpMetrics"))
+        {
+            if (!trim(arguments).empty())
+            {
+                return false;
+            }
+            console.dumpMetrics();
+        }
+        else
+        {
+            return false;
+        }
+        return true;
     }
 
-    bool bookSlot(string startTime, string patientName)
+public:
+    CommandDriver(FlipCareConsole &console) : console(console) {}
+
+    void processLine(string_view line)
     {
-        bool slotBookingDone = false;
-        for (int i = 0; i < doctorSlots.size(); i++)
+        line = trim(line);
+        if (consumePrefix(line, "i:"))
         {
-            if (doctorSlots[i]->startTime == startTime)
-            {
-                if (doctorSlots[i]->isCurrSlotAvailable)
-                {
-                    slotBookingDone = true;
-                    doctorSlots[i]->isCurrSlotAvailable = false;
-                    doctorAppointmentCount++;
-                }
-                // If the patient wishes to book a slot for a particular doctor that is already booked, then add this patient to the waitlist
-                else
-                {
-                    slotBookingDone = false;
-                    doctorSlots[i]->slotWaitListQ.push(patientName);
-                }
-                break;
-            }
+            line = trim(line);
+        }
+        if (line.empty() || line.front() == '#' || consumePrefix(line, "o:"))
+        {
+            return;
+        }
+        commandCount++;
+        if (!dispatch(line))
+        {
+            invalidCommandCount++;
+            // Keeps the report next to the output of the commands before it
+            console.flush();
+            cerr << "Invalid command: " << line << "\n";
         }
-        return slotBookingDone;
     }
 
-    string cancelSlot(string startTime)
+    void run(FILE *input)
     {
-        string newPatient = "";
-        for (int i = 0; i < doctorSlots.size(); i++)
+        const size_t BLOCK_SIZE = 1 << 20;
+        vector<char> buffer(BLOCK_SIZE);
+        size_t carried = 0;
+        while (true)
         {
-            if (doctorSlots[i]->startTime == startTime)
+            if (carried == buffer.size())
             {
-                if (!doctorSlots[i]->isCurrSlotAvailable)
-                {
-                    doctorSlots[i]->isCurrSlotAvailable = true;
-                    doctorAppointmentCount--;
-                    // If the patient with whom the appointment is booked originally, cancels the appointment, then the first in the waitlist gets the appointment.
-                    if (!doctorSlots[i]->slotWaitListQ.empty())
-                    {
-                        newPatient = doctorSlots[i]->slotWaitListQ.front();
-                        doctorSlots[i]->slotWaitListQ.pop();
-                        bool slotBooked = bookSlot(startTime, newPatient); // Book the slot for the patient in the waitlist
-                    }
-                }
-                else
+                // A single line longer than the buffer
+                buffer.resize(buffer.size() * 2);
+            }
+            size_t bytesRead = fread(buffer.data() + carried, 1, buffer.size() - carried, input);
+            size_t available = carried + bytesRead;
+            if (bytesRead == 0)
+            {
+                if (available > 0)
                 {
-                    cout << "Slot is already available\n";
+                    processLine(string_view(buffer.data(), available));
                 }
                 break;
             }
+            const char *lineStart = buffer.data();
+            const char *end = buffer.data() + available;
+            while (const char *newline = static_cast<const char *>(memchr(lineStart, '\n', end - lineStart)))
+            {
+                processLine(string_view(lineStart, newline - lineStart));
+                lineStart = newline + 1;
+            }
+            carried = end - lineStart;
+            memmove(buffer.data(), lineStart, carried);
         }
-        return newPatient;
+    }
+
+    long long getCommandCount()
+    {
+        return commandCount;
+    }
+
+    long long getInvalidCommandCount()
+    {
+        return invalidCommandCount;
     }
 };
 
-class Patient
+// Applies --slot-minutes and --clinic-hours (e.g. "0:00-24:00"). Returns false, after saying why, if they don't
+// make a valid SlotGrid.
+bool configureSlotGrid(int slotMinutes, const string &clinicHours)
 {
-public:
-    string patientName;
-    vector<vector<string>> patientAppointments;
-    Patient(string patientName)
+    int openMinutes, closeMinutes;
+    if (!SlotTime::parseHours(clinicHours, openMinutes, closeMinutes) || !SlotTime::configure(slotMinutes, openMinutes, closeMinutes))
     {
-        this->patientName = patientName;
+        cerr << "Invalid slot grid: " << slotMinutes << " min slots between " << clinicHours << ", at most "
+             << int(SlotGrid::MAX_SLOTS_PER_DAY) << " whole slots a day\n";
+        return false;
     }
+    return true;
+}
+
+string defaultClinicHours()
+{
+    const SlotGrid &grid = SlotTime::getGrid();
+    return SlotGrid::format(grid.openMinutes) + "-" + SlotGrid::format(grid.closeMinutes);
+}
 
-    void bookAppointment(string doctorName, string time, string bookingStatus)
+// Usage: flipcare [--driver [commandFile] [--quiet] [--notify] [--slot-minutes N] [--clinic-hours H:MM-H:MM] [--today YYYY-MM-DD]
+//                           [--journal file [--snapshot file] [--snapshot-every ms] [--sync-commit]]]
+// Without arguments the demo below runs. With --driver the README commands are read from commandFile (or stdin),
+// and the sustained command rate is reported on stderr. --quiet drops FlipCare's console output.
+// --slot-minutes and --clinic-hours replace the 30 min slots from 9:00 to 21:00; a journal has to be reopened with
+// the grid it was written with. --today starts the booking window on that date instead of the local one; a recovered
+// window that starts earlier is moved on to it. --journal recovers the state saved in the journal (and snapshot) by an earlier run
+// before the commands are read, and journals every change; --sync-commit makes every command wait until its change
+// is on disk. --notify writes the waitlist notifications to stderr as they are delivered.
+int runDriver(int argc, char *argv[])
+{
+    FILE *input = stdin;
+    bool quiet = false;
+    bool notify = false;
+    int slotMinutes = SlotTime::getGrid().slotMinutes;
+    string clinicHours = defaultClinicHours();
+    string startDate;
+    JournalOptions journalOptions;
+    for (int i = 2; i < argc; i++)
+    {
+        string flag = argv[i];
+        if (flag == "--quiet")
+        {
+            quiet = true;
+        }
+        else if (flag == "--notify")
+        {
+            notify = true;
+        }
+        else if (flag == "--sync-commit")
+        {
+            journalOptions.synchronousCommit = true;
+        }
+        else if (flag == "--journal" && i + 1 < argc)
+        {
+            journalOptions.journalPath = argv[++i];
+        }
+        else if (flag == "--snapshot" && i + 1 < argc)
+        {
+            journalOptions.snapshotPath = argv[++i];
+        }
+        else if (flag == "--snapshot-every" && i + 1 < argc)
+        {
+            journalOptions.snapshotIntervalMillis = atoi(argv[++i]);
+        }
+        else if (flag == "--slot-minutes" && i + 1 < argc)
+        {
+            slotMinutes = atoi(argv[++i]);
+        }
+        else if (flag == "--clinic-hours" && i + 1 < argc)
+        {
+            clinicHours = argv[++i];
+        }
+        else if (flag == "--today" && i + 1 < argc)
+        {
+            startDate = argv[++i];
+        }
+        else if ((input = fopen(argv[i], "r")) == nullptr)
+        {
+            cerr << "Cannot open " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    if (!configureSlotGrid(slotMinutes, clinicHours))
     {
-        patientAppointments.push_back({doctorName, time, bookingStatus});
+        return 1;
     }
-
-    void cancelAppointment(string doctorName, string time)
+    if (!startDate.empty())
     {
-        for (int i = 0; i < patientAppointments.size(); i++)
+        Day startDay;
+        if (!Calendar::parseDate(startDate, startDay))
         {
-            if (patientAppointments[i][0] == doctorName && patientAppointments[i][1] == time)
+            cerr << "Invalid date " << startDate << ", expected YYYY-MM-DD\n";
+            return 1;
+        }
+        FlipCare::getInstance()->setToday(startDay);
+    }
+    if (!journalOptions.journalPath.empty())
+    {
+        RecoveryResult recovery = FlipCare::getInstance()->openJournal(journalOptions);
+        if (recovery.code != ResultCode::Ok)
+        {
+            cerr << "Cannot open the journal: " << recovery.errorMessage << "\n";
+            return 1;
+        }
+        cerr << "Recovered " << recovery.snapshotBookingCount << " bookings from the snapshot" << (recovery.snapshotLoaded ? "" : " (none loaded)")
+             << " and " << recovery.replayedRecordCount << " journal records (" << recovery.inconsistentRecordCount << " inconsistent, "
+             << recovery.discardedBytes << " torn bytes cut off) in " << recovery.seconds * 1000 << " ms\n";
+    }
+    if (notify)
+    {
+        FlipCare::getInstance()->startNotifications(NotificationOptions(), [](const vector<SlotNotification> &notifications)
+                                                    {
+            string text;
+            for (const SlotNotification &notification : notifications)
             {
-                patientAppointments.erase(patientAppointments.begin() + i);
-                break;
+                text += "Notification to " + notification.patientName + ": you got the slot " + SlotTime::toString(notification.slot) + " on " +
+                        Calendar::toString(notification.day) + " with Dr. " + notification.doctorName + ", booking id " +
+                        to_string(notification.bookingId) + "\n";
             }
-        }
+            cerr << text; });
+    }
+    BufferedOutputSink standardOutput(stdout);
+    NullOutputSink noOutput;
+    FlipCareConsole console(FlipCare::getInstance(), quiet ? static_cast<OutputSink &>(noOutput) : standardOutput);
+    CommandDriver driver(console);
+    auto start = chrono::steady_clock::now();
+    driver.run(input);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    console.flush();
+    if (notify)
+    {
+        NotificationStats stats = FlipCare::getInstance()->stopNotifications();
+        cerr << stats.notificationCount << " waitlist notifications in " << stats.batchCount << " batches\n";
+    }
+    cerr << driver.getCommandCount() << " commands (" << driver.getInvalidCommandCount() << " invalid) in " << seconds << " s, "
+         << (seconds > 0 ? (long long)(driver.getCommandCount() / seconds) : 0) << " commands/s\n";
+    if (!journalOptions.journalPath.empty())
+    {
+        JournalStats stats = FlipCare::getInstance()->closeJournal();
+        cerr << "Journal " << stats.fileBytes << " bytes, " << stats.batchCount << " batches, " << stats.syncCount << " syncs";
+        cerr << (stats.errorNumber != 0 ? string(", write failed: ") + strerror(stats.errorNumber) : string()) << "\n";
+    }
+    if (input != stdin)
+    {
+        fclose(input);
     }
+    return 0;
+}
+
+// Synthetic day for capacity planning and regression checks. Doctors are spread over the four specialities and
+// declare a random 3/4 of the day; patients search, book and cancel in a configurable mix, and bookings pick
+// doctors from a Zipf distribution so that a few popular doctors see most of the contention.
+// The same generator lives in flipkart_machine_coding_praneeth.cpp, so equal flags give comparable numbers for both engines.
+class BenchmarkConfig
+{
+public:
+    int doctorCount = 200;
+    int patientCount = 20000;
+    int operationCount = 20000;
+    // Percentages of search / book / cancel operations
+    int searchPercent = 60;
+    int bookPercent = 30;
+    int cancelPercent = 10;
+    double zipfExponent = 1.0;
+    unsigned seed = 42;
+    // Journals the run into this file, which should not exist yet; a snapshot is written next to it at the end
+    string journalPath;
+    int syncIntervalMicros = 5000;
+    // Peak hour: clientCount threads book operationCount more appointments in batches of batchSize. Skipped when
+    // clientCount is 0.
+    int clientCount = 0;
+    int batchSize = 32;
+    // Waitlist notifications are on when this is 0 or more; the handler spends this long per notification, standing
+    // in for the fan-out to the patients
+    int notifyMicros = -1;
+    // The engine's own metrics, see Metrics
+    bool metrics = true;
 };
 
-class FlipCare
+class ZipfDistribution
 {
 private:
-    static FlipCare *instance;
-    unordered_map<string, Doctor *> doctors;
-    unordered_map<string, Patient *> patients;
-    unordered_map<int, vector<string>> bookingIdToPatientDoctorMap;
-    int bookingIdCounter;
+    vector<double> cumulative;
 
-    FlipCare()
+public:
+    ZipfDistribution(int n, double exponent)
     {
-        bookingIdCounter = 1;
+        cumulative.resize(n);
+        double sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sum += 1.0 / pow(i + 1, exponent);
+            cumulative[i] = sum;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            cumulative[i] /= sum;
+        }
+    }
+
+    int sample(mt19937 &rng)
+    {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return min<int>(lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin(), cumulative.size() - 1);
     }
+};
 
+class LatencyRecorder
+{
 public:
-    static FlipCare *getInstance()
+    string operationName;
+    vector<uint32_t> latenciesNs;
+
+    void record(chrono::steady_clock::duration elapsed)
+    {
+        latenciesNs.push_back(min<long long>(chrono::duration_cast<chrono::nanoseconds>(elapsed).count(), UINT32_MAX));
+    }
+
+    uint32_t percentile(double fraction)
     {
-        if (!instance)
+        if (latenciesNs.empty())
         {
-            instance = new FlipCare();
+            return 0;
         }
-        return instance;
+        size_t rank = min(latenciesNs.size() - 1, (size_t)(fraction * latenciesNs.size()));
+        nth_element(latenciesNs.begin(), latenciesNs.begin() + rank, latenciesNs.end());
+        return latenciesNs[rank];
     }
 
-    // A new doctor should be able to register, and mention his/her speciality among (Cardiologist, Dermatologist, Orthopedic, General Physician)
-    void registerDoctor(string doctorName, string doctorSpecialization)
+    void report()
+    {
+        uint64_t totalNs = accumulate(latenciesNs.begin(), latenciesNs.end(), (uint64_t)0);
+        printf("%-8s %10zu %12.0f %10u %10u %10u %10u\n", operationName.c_str(), latenciesNs.size(),
+               totalNs > 0 ? latenciesNs.size() / (totalNs / 1e9) : 0.0, percentile(0.5), percentile(0.99), percentile(0.999),
+               latenciesNs.empty() ? 0 : *max_element(latenciesNs.begin(), latenciesNs.end()));
+    }
+};
+
+long peakRssKb()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+int runBenchmark(BenchmarkConfig config)
+{
+    const string specialities[] = {"Cardiologist", "Dermatologist", "Orthopedic", "General Physician"};
+    mt19937 rng(config.seed);
+    // Drives the engine directly, so no time goes into rendering results
+    FlipCare *flipCare = FlipCare::getInstance();
+    Metrics::setEnabled(config.metrics);
+    if (!config.journalPath.empty())
     {
-        if (doctors.find(doctorName) == doctors.end())
+        JournalOptions journalOptions;
+        journalOptions.journalPath = config.journalPath;
+        journalOptions.snapshotPath = config.journalPath + ".snapshot";
+        journalOptions.syncIntervalMicros = config.syncIntervalMicros;
+        RecoveryResult recovery = flipCare->openJournal(journalOptions);
+        if (recovery.code != ResultCode::Ok)
         {
-            doctors[doctorName] = new Doctor(doctorName, doctorSpecialization);
-            cout << "Welcome Dr. " << doctorName << " !!\n";
+            cerr << "Cannot open the journal: " << recovery.errorMessage << "\n";
+            return 1;
         }
-        else
+    }
+
+    if (config.notifyMicros >= 0)
+    {
+        flipCare->startNotifications(NotificationOptions(), [&config](const vector<SlotNotification> &notifications)
+                                     { this_thread::sleep_for(chrono::microseconds(config.notifyMicros * notifications.size())); });
+    }
+
+    auto setupStart = chrono::steady_clock::now();
+    vector<string> doctorNames(config.doctorCount), patientNames(config.patientCount);
+    vector<vector<string>> declaredTimes(config.doctorCount);
+    for (int i = 0; i < config.doctorCount; i++)
+    {
+        doctorNames[i] = "Doctor" + to_string(i);
+        flipCare->registerDoctor(doctorNames[i], specialities[i % 4]);
+        vector<string> times;
+        for (SlotIndex slot = 0; slot < SlotTime::slotsPerDay(); slot++)
         {
-            cout << "Doctor already exists\n\n";
+            if (rng() % 4 != 0)
+            {
+                times.push_back(SlotTime::toString(slot));
+                declaredTimes[i].push_back(SlotTime::startTime(slot));
+            }
         }
-        cout << '\n';
+        flipCare->markDoctorAvailability(doctorNames[i], times);
+    }
+    for (int i = 0; i < config.patientCount; i++)
+    {
+        patientNames[i] = "Patient" + to_string(i);
+        flipCare->registerPatient(patientNames[i]);
     }
+    double setupSeconds = chrono::duration<double>(chrono::steady_clock::now() - setupStart).count();
 
-    // A doctor should be able to declare his/her availability in each slot for the day. For example, the slots will be of 30 mins like 9am-9.30am, 9.30am-10am
-    void markDoctorAvailability(string doctorName, vector<string> times)
+    ZipfDistribution popularDoctors(config.doctorCount, config.zipfExponent);
+    LatencyRecorder searches{"search", {}}, bookings{"book", {}}, cancellations{"cancel", {}};
+    vector<int> liveBookingIds;
+    int mixTotal = config.searchPercent + config.bookPercent + config.cancelPercent;
+    auto runStart = chrono::steady_clock::now();
+    for (int i = 0; i < config.operationCount; i++)
     {
-        if (doctors.find(doctorName) != doctors.end())
+        int pick = rng() % mixTotal;
+        if (pick < config.searchPercent)
+        {
+            const string &speciality = specialities[rng() % 4];
+            auto start = chrono::steady_clock::now();
+            flipCare->getAvailableSlotsBySpeciality(speciality);
+            searches.record(chrono::steady_clock::now() - start);
+        }
+        else if (pick < config.searchPercent + config.bookPercent || liveBookingIds.empty())
         {
-            int invalidTimeSlotCount = doctors[doctorName]->markAvailability(times);
-            if (invalidTimeSlotCount == 0)
+            int doctor = popularDoctors.sample(rng);
+            if (declaredTimes[doctor].empty())
             {
-                cout << "Done Doc!\n";
+                continue;
             }
-            else
+            const string &time = declaredTimes[doctor][rng() % declaredTimes[doctor].size()];
+            const string &patient = patientNames[rng() % config.patientCount];
+            auto start = chrono::steady_clock::now();
+            BookingResult result = flipCare->bookAppointment(doctorNames[doctor], patient, time);
+            bookings.record(chrono::steady_clock::now() - start);
+            if (result.code == ResultCode::Booked || result.code == ResultCode::Waitlisted)
             {
-                cout << "Sorry Dr. " << doctorName << " slots are 30 mins only\n";
-                cout << "There are " << invalidTimeSlotCount << " invalid slots out of " << times.size() << " slots\n";
+                liveBookingIds.push_back(result.bookingId);
             }
         }
         else
         {
-            cout << "Doctor not found\n";
+            int position = rng() % liveBookingIds.size();
+            int bookingId = liveBookingIds[position];
+            liveBookingIds[position] = liveBookingIds.back();
+            liveBookingIds.pop_back();
+            auto start = chrono::steady_clock::now();
+            flipCare->cancelBookingId(bookingId);
+            cancellations.record(chrono::steady_clock::now() - start);
         }
-        cout << '\n';
     }
+    double runSeconds = chrono::duration<double>(chrono::steady_clock::now() - runStart).count();
 
-    // Patients should be able to login
-    void registerPatient(string patientName)
+    auto reconcileStart = chrono::steady_clock::now();
+    long long liveBookingCount = 0, waitlistedCount = 0;
+    flipCare->forEachBooking([&](int, const Booking &booking)
+                             {
+        liveBookingCount++;
+        waitlistedCount += booking.isWaitlisted; });
+    double reconcileSeconds = chrono::duration<double>(chrono::steady_clock::now() - reconcileStart).count();
+
+    double peakSeconds = 0;
+    atomic<long long> peakBookingCount(0);
+    if (config.clientCount > 0)
     {
-        if (patients.find(patientName) == patients.end())
+        vector<thread> clients;
+        auto peakStart = chrono::steady_clock::now();
+        for (int client = 0; client < config.clientCount; client++)
         {
-            patients[patientName] = new Patient(patientName);
-            cout << "Registration successful\n";
+            clients.emplace_back([&, client]
+                                 {
+                mt19937 clientRng(config.seed + client + 1);
+                int clientOperationCount = config.operationCount / config.clientCount;
+                for (int done = 0; done < clientOperationCount; done += config.batchSize)
+                {
+                    vector<BookingRequest> requests;
+                    while (int(requests.size()) < min(config.batchSize, clientOperationCount - done))
+                    {
+                        int doctor = popularDoctors.sample(clientRng);
+                        if (!declaredTimes[doctor].empty())
+                        {
+                            requests.push_back({doctorNames[doctor], patientNames[clientRng() % config.patientCount],
+                                                declaredTimes[doctor][clientRng() % declaredTimes[doctor].size()]});
+                        }
+                    }
+                    vector<BookingResult> results = flipCare->bookAppointmentsBatch(requests);
+                    peakBookingCount += count_if(results.begin(), results.end(), [](const BookingResult &result)
+                                                 { return result.code == ResultCode::Booked || result.code == ResultCode::Waitlisted; });
+                } });
         }
-        else
+        for (thread &client : clients)
         {
-            cout << "Patient already exists\n";
+            client.join();
         }
+        peakSeconds = chrono::duration<double>(chrono::steady_clock::now() - peakStart).count();
     }
 
-    // Patients should be able to book appointments with a doctor for an available slot.A patient can book multiple appointments in a day.
-    void bookAppointment(string doctorName, string patientName, string time)
+    printf("FlipCare benchmark: doctors=%d patients=%d operations=%d mix=%d/%d/%d zipf=%.2f seed=%u metrics=%s\n", config.doctorCount,
+           config.patientCount, config.operationCount, config.searchPercent, config.bookPercent, config.cancelPercent, config.zipfExponent,
+           config.seed, config.metrics ? "on" : "off");
+    printf("setup %.3f s, run %.3f s, throughput %.0f ops/s\n", setupSeconds, runSeconds, config.operationCount / runSeconds);
+    printf("%-8s %10s %12s %10s %10s %10s %10s\n", "op", "count", "ops/s", "p50 ns", "p99 ns", "p999 ns", "max ns");
+    searches.report();
+    bookings.report();
+    cancellations.report();
+    printf("reconcile %lld live bookings (%lld waitlisted) in %.3f ms\n", liveBookingCount, waitlistedCount, reconcileSeconds * 1000);
+    if (config.clientCount > 0)
+    {
+        printf("peak hour: %d clients, batches of %d: %lld bookings in %.3f s, %.0f bookings/s\n", config.clientCount, config.batchSize,
+               peakBookingCount.load(), peakSeconds, peakBookingCount / peakSeconds);
+    }
+    if (config.notifyMicros >= 0)
+    {
+        NotificationStats stats = flipCare->stopNotifications();
+        printf("notifications %lld in %lld batches, cancellations waited for queue room %lld times\n", stats.notificationCount,
+               stats.batchCount, stats.producerWaitCount);
+    }
+    if (!config.journalPath.empty())
     {
-        if (patients.find(patientName) == patients.end())
+        auto snapshotStart = chrono::steady_clock::now();
+        ResultCode snapshotCode = flipCare->saveSnapshot();
+        double snapshotSeconds = chrono::duration<double>(chrono::steady_clock::now() - snapshotStart).count();
+        JournalStats stats = flipCare->closeJournal();
+        printf("journal %.1f MiB in %lld batches, %lld syncs%s; snapshot %s in %.3f ms\n", stats.fileBytes / 1048576.0, stats.batchCount,
+               stats.syncCount, stats.errorNumber != 0 ? " (write failed)" : "", snapshotCode == ResultCode::Ok ? "saved" : "failed", snapshotSeconds * 1000);
+    }
+    printf("peak RSS %.1f MiB\n", peakRssKb() / 1024.0);
+    return 0;
+}
+
+// Usage: flipcare --bench [--doctors N] [--patients N] [--ops N] [--mix search,book,cancel] [--zipf S] [--seed N]
+//                        [--slot-minutes N] [--clinic-hours H:MM-H:MM] [--journal file [--sync-interval us]]
+//                        [--clients N [--batch N]] [--notify us] [--metrics on|off]
+int runBenchmark(int argc, char *argv[])
+{
+    BenchmarkConfig config;
+    int slotMinutes = SlotTime::getGrid().slotMinutes;
+    string clinicHours = defaultClinicHours();
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--doctors")
         {
-            cout << "Patient not found\n";
-            return;
+            config.doctorCount = max(1, stoi(value));
         }
-        if (doctors.find(doctorName) == doctors.end())
+        else if (flag == "--patients")
         {
-            cout << "Doctor not found\n";
-            return;
+            config.patientCount = max(1, stoi(value));
         }
-        // Need to check whether the patient has already made the appointment at this time
-        for (int i = 0; i < patients[patientName]->patientAppointments.size(); i++)
+        else if (flag == "--ops")
         {
-            if (patients[patientName]->patientAppointments[i][1] == time)
-            {
-                cout << "Patient " << patientName << " already has an appointment at this time with Dr. " << patients[patientName]->patientAppointments[i][0] << "\n";
-                cout << "Hence cannot book appointment with Dr. " << doctorName << " at this time\n\n";
-                return;
-            }
+            config.operationCount = stoi(value);
         }
-        bool slotBooked = doctors[doctorName]->bookSlot(time, patientName);
-        // cout << "Slot booked status: " << slotBooked << " for patient " << patientName << "with doctor " << doctorName << " at time " << time << "\n";
-        string bookingStatus = (slotBooked) ? "Booked" : "Waitlisted";
-        patients[patientName]->bookAppointment(doctorName, time, bookingStatus);
-        bookingIdToPatientDoctorMap.insert({bookingIdCounter, {patientName, doctorName, time}});
-        cout << "Booked. Booking id: " << bookingIdCounter++ << "\n\n";
-    }
-
-    // Patients can also cancel an appointment, in which case that slot becomes available for someone else to book.
-    void cancelBookingId(int bookingId)
-    {
-        if (bookingIdToPatientDoctorMap.find(bookingId) == bookingIdToPatientDoctorMap.end())
+        else if (flag == "--mix" && sscanf(value.c_str(), "%d,%d,%d", &config.searchPercent, &config.bookPercent, &config.cancelPercent) == 3 && config.searchPercent + config.bookPercent + config.cancelPercent > 0)
         {
-            cout << "Booking not found\n";
-            return;
         }
-        string patientName = bookingIdToPatientDoctorMap[bookingId][0];
-        string doctorName = bookingIdToPatientDoctorMap[bookingId][1];
-        string time = bookingIdToPatientDoctorMap[bookingId][2];
-        string newPatient = doctors[doctorName]->cancelSlot(time);
-        patients[patientName]->cancelAppointment(doctorName, time);
-        cout << "Booking ID " << bookingId << " is cancelled\n\n";
-        if (newPatient != "")
+        else if (flag == "--zipf")
         {
-            for (int i = 0; i < patients[newPatient]->patientAppointments.size(); i++)
-            {
-                if (patients[newPatient]->patientAppointments[i][0] == doctorName)
-                {
-                    patients[newPatient]->patientAppointments[i][2] = "Booked";
-                    break;
-                }
-            }
+            config.zipfExponent = stod(value);
         }
-    }
-
-    // The slots should be displayed in a ranked fashion
-    void showAvailableSlotsBySpeciality(string speciality)
-    {
-        vector<pair<string, string>> availableSlots;
-        for (auto it = doctors.begin(); it != doctors.end(); it++)
+        else if (flag == "--seed")
         {
-            if (it->second->doctorSpecialization == speciality)
-            {
-                for (int i = 0; i < it->second->doctorSlots.size(); i++)
-                {
-                    if (it->second->doctorSlots[i]->isCurrSlotAvailable)
-                    {
-                        availableSlots.push_back({it->first, it->second->doctorSlots[i]->startTime + "-" + it->second->doctorSlots[i]->endTime});
-                    }
-                }
-            }
+            config.seed = stoul(value);
         }
-        // Custom sorting function can be used here to sort the available slots based on our needs.
-        // Use strategy pattern to sort the available slots based on the requirement
-        sort(availableSlots.begin(), availableSlots.end(), [](pair<string, string> a, pair<string, string> b)
-             { return a.second < b.second; });
-        cout << "Available slots for " << speciality << " are as follows:\n";
-        for (int i = 0; i < availableSlots.size(); i++)
+        else if (flag == "--journal")
         {
-            cout << "Dr. " << availableSlots[i].first << " : " << availableSlots[i].second << "\n";
+            config.journalPath = value;
         }
-        cout << '\n';
-    }
-
-    void displayDoctorSlots(string doctorName)
-    {
-        if (doctors.find(doctorName) != doctors.end())
+        else if (flag == "--sync-interval")
         {
-            cout << "Dr. " << doctorName << " slots' status is as follows:\n";
-            for (int i = 0; i < doctors[doctorName]->doctorSlots.size(); i++)
-            {
-                cout << doctors[doctorName]->doctorSlots[i]->startTime << "-" << doctors[doctorName]->doctorSlots[i]->endTime << " : ";
-                if (doctors[doctorName]->doctorSlots[i]->isCurrSlotAvailable)
-                {
-                    cout << "Available\n";
-                }
-                else
-                {
-                    cout << "Not Available\n";
-                }
-            }
+            config.syncIntervalMicros = stoi(value);
         }
-        else
+        else if (flag == "--clients")
         {
-            cout << "Doctor not found\n";
+            config.clientCount = max(0, stoi(value));
         }
-        cout << '\n';
-    }
-
-    void displayPatientAppointments(string patientName)
-    {
-        if (patients.find(patientName) != patients.end())
+        else if (flag == "--batch")
         {
-            cout << "Patient " << patientName << " has the following appointments:\n";
-            for (int i = 0; i < patients[patientName]->patientAppointments.size(); i++)
-            {
-                cout << "Dr. " << patients[patientName]->patientAppointments[i][0] << " : " << patients[patientName]->patientAppointments[i][1] << " " << patients[patientName]->patientAppointments[i][2] << "\n";
-            }
-            if (patients[patientName]->patientAppointments.size() == 0)
-            {
-                cout << "No appointments\n";
-            }
+            config.batchSize = max(1, stoi(value));
+        }
+        else if (flag == "--notify")
+        {
+            config.notifyMicros = max(0, stoi(value));
+        }
+        else if (flag == "--metrics" && (value == "on" || value == "off"))
+        {
+            config.metrics = value == "on";
+        }
+        else if (flag == "--slot-minutes")
+        {
+            slotMinutes = stoi(value);
+        }
+        else if (flag == "--clinic-hours")
+        {
+            clinicHours = value;
         }
         else
         {
-            cout << "Patient not found\n";
+            cerr << "Unknown or invalid option " << flag << " " << value << "\n";
+            return 1;
         }
-        cout << '\n';
     }
-};
-
-FlipCare *FlipCare::instance = nullptr;
+    if (!configureSlotGrid(slotMinutes, clinicHours))
+    {
+        return 1;
+    }
+    return runBenchmark(config);
+}
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "--driver")
+    {
+        return runDriver(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--bench")
+    {
+        return runBenchmark(argc, argv);
+    }
     FlipCare *flipCare = FlipCare::getInstance();
-    flipCare->registerDoctor("Curious", "Cardiologist");
-    flipCare->markDoctorAvailability("Curious", {"09:30-10:30"});
-    flipCare->markDoctorAvailability("Curious", {"09:30-10:00", "12:30-13:00", "16:00-16:30"});
-    flipCare->registerDoctor("Dreadful", "Dermatologist");
-    flipCare->markDoctorAvailability("Dreadful", {"09:30-10:00", "12:30-13:00", "16:00-16:30"});
-    flipCare->showAvailableSlotsBySpeciality("Cardiologist");
-    flipCare->registerPatient("PatientA");
-    flipCare->bookAppointment("Curious", "PatientA", "12:30");
-    flipCare->displayDoctorSlots("Curious");
-    flipCare->displayPatientAppointments("PatientA");
-    flipCare->showAvailableSlotsBySpeciality("Cardiologist");
-    flipCare->cancelBookingId(1);
-    flipCare->displayDoctorSlots("Curious");
-    flipCare->showAvailableSlotsBySpeciality("Cardiologist");
-    flipCare->registerPatient("PatientB");
-    flipCare->bookAppointment("Curious", "PatientB", "12:30");
-    flipCare->displayDoctorSlots("Curious");
-    flipCare->displayPatientAppointments("PatientB");
-    flipCare->registerDoctor("Daring", "Dermatologist");
-    flipCare->markDoctorAvailability("Daring", {"12:30-13:00", "14:00-14:30"});
-    flipCare->bookAppointment("Daring", "PatientB", "12:30");
-    flipCare->displayPatientAppointments("PatientB");
-    flipCare->showAvailableSlotsBySpeciality("Dermatologist");
-    cout << "+++++++++++++\n";
-    flipCare->bookAppointment("Daring", "PatientB", "14:00");
-    flipCare->bookAppointment("Daring", "PatientA", "14:00");
-    flipCare->displayPatientAppointments("PatientB");
-    flipCare->displayPatientAppointments("PatientA");
-    flipCare->cancelBookingId(3);
-    flipCare->displayPatientAppointments("PatientB");
-    flipCare->displayPatientAppointments("PatientA");
+    // A fixed date, so that the demo prints the same every day
+    Day demoToday;
+    Calendar::parseDate("2025-06-02", demoToday);
+    flipCare->setToday(demoToday);
+    BufferedOutputSink standardOutput(stdout);
+    FlipCareConsole console(flipCare, standardOutput);
+    console.registerDoctor("Curious", "Cardiologist");
+    console.markDoctorAvailability("Curious", {"09:30-10:30"});
+    console.markDoctorAvailability("Curious", {"09:30-10:00", "12:30-13:00", "16:00-16:30"});
+    console.registerDoctor("Dreadful", "Dermatologist");
+    console.markDoctorAvailability("Dreadful", {"09:30-10:00", "12:30-13:00", "16:00-16:30"});
+    console.showAvailableSlotsBySpeciality("Cardiologist");
+    console.registerPatient("PatientA");
+    console.bookAppointment("Curious", "PatientA", "12:30");
+    console.displayDoctorSlots("Curious");
+    console.displayPatientAppointments("PatientA");
+    console.showAvailableSlotsBySpeciality("Cardiologist");
+    console.cancelBookingId(1);
+    console.displayDoctorSlots("Curious");
+    console.showAvailableSlotsBySpeciality("Cardiologist");
+    console.registerPatient("PatientB");
+    console.bookAppointment("Curious", "PatientB", "12:30");
+    console.displayDoctorSlots("Curious");
+    console.displayPatientAppointments("PatientB");
+    console.registerDoctor("Daring", "Dermatologist");
+    console.markDoctorAvailability("Daring", {"12:30-13:00", "14:00-14:30"});
+    console.bookAppointment("Daring", "PatientB", "12:30");
+    console.displayPatientAppointments("PatientB");
+    console.showAvailableSlotsBySpeciality("Dermatologist");
+    console.print("+++++++++++++\n");
+    console.bookAppointment("Daring", "PatientB", "14:00");
+    console.bookAppointment("Daring", "PatientA", "14:00");
+    console.displayPatientAppointments("PatientB");
+    console.displayPatientAppointments("PatientA");
+    console.cancelBookingId(3);
+    console.displayPatientAppointments("PatientB");
+    console.displayPatientAppointments("PatientA");
+    console.showTrendingDoctors(1);
+    console.showTrendingDoctors(3, "Dermatologist");
+    console.rateDoctor("Dreadful", 4.2);
+    console.rateDoctor("Daring", 4.8);
+    console.showAvailableSlotsBySpeciality<RankByRating>("Dermatologist", 3);
+    SearchCursor cursor = FIRST_PAGE;
+    AvailabilityPage page;
+    do
+    {
+        page = console.showAvailableSlotsPage("Dermatologist", 2, cursor);
+        cursor = page.nextCursor;
+    } while (page.hasMore);
+    console.showEarliestAvailable("Dermatologist", "14:00");
+    console.showAvailableInWindow("Dermatologist", "12:00", "15:00");
+    // Bookings are open for the next 30 days
+    Day tomorrow = flipCare->getToday() + 1;
+    console.markDoctorAvailability("Daring", {"12:30-13:00", "14:00-14:30"}, tomorrow);
+    console.bookAppointment("Daring", "PatientA", "12:30", tomorrow);
+    console.showAvailableSlotsBySpeciality("Dermatologist", -1, tomorrow);
+    console.displayPatientAppointments("PatientA");
+    // Dr. Daring calls in sick for tomorrow, and Dr. Dreadful takes over the appointment
+    console.markDoctorAvailability("Dreadful", {"12:30-13:00"}, tomorrow);
+    console.withdrawDoctor("Daring", {}, tomorrow);
+    console.displayPatientAppointments("PatientA");
+    flipCare->startNewDay();
+    console.showAvailableSlotsBySpeciality("Dermatologist");
+    console.displayPatientAppointments("PatientA");
     return 0;
 }
\ No newline at end of file
@@ -1,40 +1,412 @@
 #include <iostream>
 #include <vector>
+#include <array>
 #include <unordered_map>
-#include <unordered_set>
 #include <string>
-#include <queue>
+#include <string_view>
+#include <list>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <set>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <sys/resource.h>
 #include <algorithm>
 
 using namespace std;
 
+// Slots are 30 mins long from 9:00 to 21:00 unless SlotTime::configure sets another grid, and are stored as their
+// index 0..slotsPerDay - 1 in the day. Slot strings like "9:00-9:30" are parsed once when they enter the system and
+// formatted only for output.
+using SlotIndex = int;
+
+// Bit i stands for slot i. Two 64 bit words cover the largest grid, so every operation is a couple of word-sized
+// instructions.
+class SlotMask
+{
+public:
+    static const int WORD_COUNT = 2;
+    uint64_t words[WORD_COUNT];
+
+    static SlotMask of(SlotIndex slot)
+    {
+        SlotMask mask = {};
+        mask.set(slot);
+        return mask;
+    }
+
+    // Slots first..last - 1; empty if last <= first
+    static SlotMask range(SlotIndex first, SlotIndex last)
+    {
+        SlotMask mask = {};
+        for (int word = 0; word < WORD_COUNT; word++)
+        {
+            int from = max(first - word * 64, 0);
+            int to = min(last - word * 64, 64);
+            if (from < to)
+            {
+                uint64_t bits = to - from == 64 ? ~uint64_t(0) : ((uint64_t(1) << (to - from)) - 1);
+                mask.words[word] = bits << from;
+            }
+        }
+        return mask;
+    }
+
+    bool test(SlotIndex slot) const
+    {
+        return (words[slot >> 6] >> (slot & 63)) & 1;
+    }
+
+    void set(SlotIndex slot)
+    {
+        words[slot >> 6] |= uint64_t(1) << (slot & 63);
+    }
+
+    void reset(SlotIndex slot)
+    {
+        words[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+    }
+
+    bool any() const
+    {
+        return (words[0] | words[1]) != 0;
+    }
+
+    int count() const
+    {
+        return __builtin_popcountll(words[0]) + __builtin_popcountll(words[1]);
+    }
+
+    // The earliest slot in the mask, or -1 if it is empty
+    SlotIndex first() const
+    {
+        if (words[0] != 0)
+        {
+            return __builtin_ctzll(words[0]);
+        }
+        return words[1] != 0 ? 64 + __builtin_ctzll(words[1]) : -1;
+    }
+
+    SlotMask operator|(const SlotMask &other) const
+    {
+        return {{words[0] | other.words[0], words[1] | other.words[1]}};
+    }
+
+    SlotMask operator&(const SlotMask &other) const
+    {
+        return {{words[0] & other.words[0], words[1] & other.words[1]}};
+    }
+
+    SlotMask operator~() const
+    {
+        return {{~words[0], ~words[1]}};
+    }
+
+    SlotMask &operator|=(const SlotMask &other)
+    {
+        return *this = *this | other;
+    }
+
+    // Calls visitor(slot) for every slot in the mask, earliest first
+    template <typename Visitor>
+    void forEach(Visitor visitor) const
+    {
+        for (int word = 0; word < WORD_COUNT; word++)
+        {
+            for (uint64_t bits = words[word]; bits != 0; bits &= bits - 1)
+            {
+                visitor(SlotIndex(word * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+};
+
+// Slots of slotMinutes each from openMinutes to closeMinutes, in minutes since midnight. The index <-> time tables
+// are built once per grid, so parsing a time is a table lookup and formatting a slot hands out a ready string.
+class SlotGrid
+{
+public:
+    // 15 min slots around the clock
+    static const int MAX_SLOTS_PER_DAY = 96;
+    static const int MINUTES_PER_DAY = 24 * 60;
+    int slotMinutes;
+    int openMinutes;
+    int closeMinutes;
+    int slotsPerDay;
+    // Minute of the day -> the slot that starts then, or -1
+    array<int8_t, MINUTES_PER_DAY + 1> slotStartingAt;
+    // "H:MM" and "H:MM-H:MM" of every slot
+    vector<string> startTexts;
+    vector<string> rangeTexts;
+
+    // The hours have to split into whole slots, and into no more than MAX_SLOTS_PER_DAY of them
+    static bool isValid(int slotMinutes, int openMinutes, int closeMinutes)
+    {
+        return slotMinutes > 0 && openMinutes >= 0 && openMinutes < closeMinutes && closeMinutes <= MINUTES_PER_DAY &&
+               (closeMinutes - openMinutes) % slotMinutes == 0 && (closeMinutes - openMinutes) / slotMinutes <= MAX_SLOTS_PER_DAY;
+    }
+
+    // Expects isValid
+    SlotGrid(int slotMinutes, int openMinutes, int closeMinutes)
+    {
+        this->slotMinutes = slotMinutes;
+        this->openMinutes = openMinutes;
+        this->closeMinutes = closeMinutes;
+        slotsPerDay = (closeMinutes - openMinutes) / slotMinutes;
+        slotStartingAt.fill(-1);
+        for (SlotIndex slot = 0; slot < slotsPerDay; slot++)
+        {
+            int startMinutes = openMinutes + slot * slotMinutes;
+            slotStartingAt[startMinutes] = slot;
+            startTexts.push_back(format(startMinutes));
+            rangeTexts.push_back(format(startMinutes) + "-" + format(startMinutes + slotMinutes));
+        }
+    }
+
+    static string format(int minutes)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%d:%02d", minutes / 60, minutes % 60);
+        return buffer;
+    }
+};
+
+class SlotTime
+{
+private:
+    inline static SlotGrid grid{30, 9 * 60, 21 * 60};
+
+public:
+    // Replaces the slot grid, e.g. with 15 min slots or round the clock hours. Call before an AppointmentSystem is created.
+    // Returns false, keeping the current grid, if SlotGrid::isValid rejects the configuration.
+    static bool configure(int slotMinutes, int openMinutes, int closeMinutes)
+    {
+        if (!SlotGrid::isValid(slotMinutes, openMinutes, closeMinutes))
+        {
+            return false;
+        }
+        grid = SlotGrid(slotMinutes, openMinutes, closeMinutes);
+        return true;
+    }
+
+    static const SlotGrid &getGrid()
+    {
+        return grid;
+    }
+
+    static int slotsPerDay()
+    {
+        return grid.slotsPerDay;
+    }
+
+    // Parses "H:MM" / "HH:MM" into minutes since midnight. "24:00" is only accepted as the end of the day.
+    static bool parseMinutes(const string &time, int &minutes, bool endOfDay = false)
+    {
+        size_t colonPos = time.find(':');
+        if (colonPos == string::npos || colonPos == 0 || colonPos > 2 || time.size() != colonPos + 3)
+        {
+            return false;
+        }
+        int hour = 0, minute = 0;
+        for (size_t i = 0; i < time.size(); i++)
+        {
+            if (i == colonPos)
+            {
+                continue;
+            }
+            if (!isdigit(static_cast<unsigned char>(time[i])))
+            {
+                return false;
+            }
+            int &part = i < colonPos ? hour : minute;
+            part = part * 10 + (time[i] - '0');
+        }
+        if ((hour > 23 || minute > 59) && !(endOfDay && hour == 24 && minute == 0))
+        {
+            return false;
+        }
+        minutes = hour * 60 + minute;
+        return true;
+    }
+
+    // Parses clinic hours, e.g. "9:00-21:00" or "0:00-24:00"
+    static bool parseHours(const string &hours, int &openMinutes, int &closeMinutes)
+    {
+        size_t dashPos = hours.find('-');
+        return dashPos != string::npos && parseMinutes(hours.substr(0, dashPos), openMinutes) &&
+               parseMinutes(hours.substr(dashPos + 1), closeMinutes, true);
+    }
+
+    // Parses the start time of a slot, e.g. "12:30"
+    static bool parseSlotStart(const string &time, SlotIndex &slot)
+    {
+        int minutes;
+        if (!parseMinutes(time, minutes) || grid.slotStartingAt[minutes] < 0)
+        {
+            return false;
+        }
+        slot = grid.slotStartingAt[minutes];
+        return true;
+    }
+
+    // Parses "9:00-9:30"; only slots of the grid are valid
+    static bool parseSlot(const string &slotText, SlotIndex &slot)
+    {
+        size_t dashPos = slotText.find('-');
+        if (dashPos == string::npos)
+        {
+            return false;
+        }
+        int endMinutes;
+        if (!parseSlotStart(slotText.substr(0, dashPos), slot) || !parseMinutes(slotText.substr(dashPos + 1), endMinutes, true))
+        {
+            return false;
+        }
+        return endMinutes == startMinutes(slot) + grid.slotMinutes;
+    }
+
+    static int startMinutes(SlotIndex slot)
+    {
+        return grid.openMinutes + slot * grid.slotMinutes;
+    }
+
+    // The first slot that starts at or after minutes since midnight; slotsPerDay() if there is none
+    static SlotIndex firstSlotStartingFrom(int minutes)
+    {
+        int offset = max(minutes - grid.openMinutes, 0);
+        return min(grid.slotsPerDay, (offset + grid.slotMinutes - 1) / grid.slotMinutes);
+    }
+
+    // The slots 0..slotsEndingBy(minutes) - 1 are over by minutes since midnight
+    static SlotIndex slotsEndingBy(int minutes)
+    {
+        int offset = max(minutes - grid.openMinutes, 0);
+        return min(grid.slotsPerDay, offset / grid.slotMinutes);
+    }
+
+    static const string &startTime(SlotIndex slot)
+    {
+        return grid.startTexts[slot];
+    }
+
+    static const string &toString(SlotIndex slot)
+    {
+        return grid.rangeTexts[slot];
+    }
+};
+
+// Doctors, patients and specialities are known by dense 32 bit ids inside the system; names are resolved once per call.
+// A doctor's or patient's id is its handle in the EntityFactory pool.
+using DoctorId = uint32_t;
+using PatientId = uint32_t;
+using SpecialityId = uint32_t;
+
+class NameInterner
+{
+private:
+    unordered_map<string, uint32_t> idsByName;
+    vector<string> names;
+
+public:
+    // Returns false if the name was never interned
+    bool find(const string &name, uint32_t &id) const
+    {
+        auto it = idsByName.find(name);
+        if (it == idsByName.end())
+        {
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
+
+    // Hands out the next id the first time a name is seen
+    uint32_t intern(const string &name)
+    {
+        auto it = idsByName.find(name);
+        if (it != idsByName.end())
+        {
+            return it->second;
+        }
+        uint32_t id = names.size();
+        idsByName.emplace(name, id);
+        names.push_back(name);
+        return id;
+    }
+
+    const string &nameOf(uint32_t id) const
+    {
+        return names[id];
+    }
+
+    size_t size() const
+    {
+        return names.size();
+    }
+};
+
 class IDoctor
 {
 public:
+    virtual DoctorId getId() const = 0;
+    virtual SpecialityId getSpecialityId() const = 0;
     virtual string getName() const = 0;
     virtual string getSpeciality() const = 0;
-    virtual unordered_set<string> &getAvailableSlots() = 0;
-    virtual unordered_map<int, string> &getAppointments() = 0;
+    virtual SlotMask &getAvailableSlots() = 0;
+    virtual unordered_map<int, SlotIndex> &getAppointments() = 0;
+    virtual int getRatingTenths() const = 0;
+    virtual void setRatingTenths(int ratingTenths) = 0;
     virtual ~IDoctor() = default;
 };
 
 class IPatient
 {
 public:
+    virtual PatientId getId() const = 0;
     virtual string getName() const = 0;
-    virtual unordered_map<int, string> &getAppointments() = 0;
+    virtual unordered_map<int, SlotIndex> &getAppointments() = 0;
+    virtual SlotMask &getBusySlots() = 0;
     virtual ~IPatient() = default;
 };
 
 class Doctor : public IDoctor
 {
 public:
+    DoctorId id;
     string name;
+    SpecialityId specialityId;
     string speciality;
-    unordered_set<string> availableSlots;
-    unordered_map<int, string> appointments;
+    SlotMask availableSlots = {};
+    unordered_map<int, SlotIndex> appointments;
+    // Rating 0..5 in tenths
+    int ratingTenths = 0;
+
+    Doctor(DoctorId id, string name, SpecialityId specialityId, string speciality)
+        : id(id), name(name), specialityId(specialityId), speciality(speciality) {}
+
+    DoctorId getId() const override
+    {
+        return id;
+    }
 
-    Doctor(string name, string speciality) : name(name), speciality(speciality) {}
+    SpecialityId getSpecialityId() const override
+    {
+        return specialityId;
+    }
 
     string getName() const override
     {
@@ -46,439 +418,2707 @@ public:
         return speciality;
     }
 
-    unordered_set<string> &getAvailableSlots() override
+    SlotMask &getAvailableSlots() override
     {
         return availableSlots;
     }
 
-    unordered_map<int, string> &getAppointments() override
+    unordered_map<int, SlotIndex> &getAppointments() override
     {
         return appointments;
     }
+
+    int getRatingTenths() const override
+    {
+        return ratingTenths;
+    }
+
+    void setRatingTenths(int ratingTenths) override
+    {
+        this->ratingTenths = ratingTenths;
+    }
 };
 
 class Patient : public IPatient
 {
 public:
+    PatientId id;
     string name;
-    unordered_map<int, string> appointments;
+    unordered_map<int, SlotIndex> appointments;
+    // Bit i is set while the patient has a booked appointment in slot i
+    SlotMask busySlots = {};
 
-    Patient(string name) : name(name) {}
+    Patient(PatientId id, string name) : id(id), name(name) {}
+
+    PatientId getId() const override
+    {
+        return id;
+    }
 
     string getName() const override
     {
         return name;
     }
 
-    unordered_map<int, string> &getAppointments() override
+    unordered_map<int, SlotIndex> &getAppointments() override
     {
         return appointments;
     }
+
+    SlotMask &getBusySlots() override
+    {
+        return busySlots;
+    }
+};
+
+// Arena for long-lived entities. Objects are constructed in place in blocks of CHUNK_SIZE, so consecutive objects
+// share cache lines, a pointer or handle stays valid for the life of the pool, and everything is destroyed in one
+// deterministic sweep instead of leaking individual allocations.
+template <typename T>
+class ObjectPool
+{
+private:
+    static const size_t CHUNK_SIZE = 1024;
+    struct Chunk
+    {
+        alignas(T) unsigned char storage[CHUNK_SIZE * sizeof(T)];
+    };
+    vector<unique_ptr<Chunk>> chunks;
+    size_t objectCount = 0;
+
+    T *slotFor(size_t handle)
+    {
+        return reinterpret_cast<T *>(chunks[handle / CHUNK_SIZE]->storage) + handle % CHUNK_SIZE;
+    }
+
+public:
+    ObjectPool() = default;
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    ~ObjectPool()
+    {
+        reset();
+    }
+
+    template <typename... Args>
+    T *create(Args &&...args)
+    {
+        if (objectCount == chunks.size() * CHUNK_SIZE)
+        {
+            chunks.push_back(unique_ptr<Chunk>(new Chunk));
+        }
+        T *object = new (slotFor(objectCount)) T(forward<Args>(args)...);
+        objectCount++;
+        return object;
+    }
+
+    // Handles are dense: the n-th created object has handle n
+    T *get(size_t handle)
+    {
+        return slotFor(handle);
+    }
+
+    size_t size() const
+    {
+        return objectCount;
+    }
+
+    // Visits the objects chunk by chunk in creation order
+    template <typename Function>
+    void forEach(Function function)
+    {
+        for (size_t handle = 0; handle < objectCount; handle++)
+        {
+            function(slotFor(handle));
+        }
+    }
+
+    void reset()
+    {
+        forEach([](T *object)
+                { object->~T(); });
+        chunks.clear();
+        objectCount = 0;
+    }
 };
 
+// Creates the entities of one AppointmentSystem out of contiguous pools that are released together with the factory.
+// The n-th doctor or patient created has id n, so an id is resolved by indexing into the pool.
 class EntityFactory
 {
+private:
+    ObjectPool<Doctor> doctorPool;
+    ObjectPool<Patient> patientPool;
+
 public:
-    static IDoctor *createDoctor(const string &name, const string &speciality)
+    IDoctor *createDoctor(DoctorId id, const string &name, SpecialityId specialityId, const string &speciality)
     {
-        return new Doctor(name, speciality);
+        return doctorPool.create(id, name, specialityId, speciality);
     }
 
-    static IPatient *createPatient(const string &name)
+    IPatient *createPatient(PatientId id, const string &name)
     {
-        return new Patient(name);
+        return patientPool.create(id, name);
     }
+
+    IDoctor *getDoctor(DoctorId id)
+    {
+        return doctorPool.get(id);
+    }
+
+    IPatient *getPatient(PatientId id)
+    {
+        return patientPool.get(id);
+    }
+};
+
+// "You got the slot": patientName was handed the slot from the waitlist and holds it under bookingId
+class SlotNotification
+{
+public:
+    int bookingId;
+    string patientName;
+    string doctorName;
+    SlotIndex slot;
 };
 
+// Told about every waitlist promotion, right after the slot changed hands. Must not block on the delivery.
 class IObserver
 {
 public:
-    virtual void update(const string &slot) = 0;
+    virtual void update(const SlotNotification &notification) = 0;
     virtual ~IObserver() = default;
 };
 
-class Waitlist : public IObserver
+// Bounded queue between many producers and one consumer. Producers hand over whole batches and wait while the
+// queue is full, so a consumer that falls behind slows the producers down instead of letting the backlog grow.
+template <typename T>
+class BoundedQueue
+{
+private:
+    mutex queueMutex;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    long long producerWaitCount = 0;
+
+public:
+    BoundedQueue(size_t capacity) : capacity(max<size_t>(1, capacity)) {}
+
+    // Appends the items in order, waiting for room whenever the queue is full. Leaves batch empty.
+    void pushAll(vector<T> &batch)
+    {
+        unique_lock<mutex> lock(queueMutex);
+        for (size_t next = 0; next < batch.size();)
+        {
+            if (items.size() >= capacity)
+            {
+                producerWaitCount++;
+                notFull.wait(lock, [this]
+                             { return items.size() < capacity; });
+            }
+            // The consumer only ever waits for an empty queue
+            if (items.empty())
+            {
+                notEmpty.notify_one();
+            }
+            while (next < batch.size() && items.size() < capacity)
+            {
+                items.push_back(move(batch[next++]));
+            }
+        }
+        batch.clear();
+    }
+
+    // Waits for items and moves up to maxCount of them into batch. Returns false once the queue is closed and empty.
+    bool popBatch(vector<T> &batch, size_t maxCount)
+    {
+        unique_lock<mutex> lock(queueMutex);
+        notEmpty.wait(lock, [this]
+                      { return closed || !items.empty(); });
+        batch.clear();
+        while (!items.empty() && batch.size() < maxCount)
+        {
+            batch.push_back(move(items.front()));
+            items.pop_front();
+        }
+        notFull.notify_all();
+        return !batch.empty();
+    }
+
+    // The consumer drains what is left, then popBatch returns false
+    void close()
+    {
+        lock_guard<mutex> lock(queueMutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+    long long getProducerWaitCount()
+    {
+        lock_guard<mutex> lock(queueMutex);
+        return producerWaitCount;
+    }
+};
+
+// Delivers the promotions to handler(const vector<SlotNotification> &) on a background thread, in batches of up to
+// maxBatch and in the order they happened. update() only queues, so a cancellation never waits for the fan-out,
+// unless queueCapacity notifications are already waiting. After a batch that was not full the consumer waits
+// batchDelayMicros, so that notifications arriving meanwhile go out together and seldom have to wake it.
+class WaitlistNotifier : public IObserver
 {
 private:
-    queue<string> patientQueue;
+    BoundedQueue<SlotNotification> queue;
+    function<void(const vector<SlotNotification> &)> handler;
+    size_t maxBatch;
+    int batchDelayMicros;
+    mutex progressMutex;
+    condition_variable progress;
+    long long publishedCount = 0;
+    long long deliveredCount = 0;
+    long long batchCount = 0;
+    int flushWaiters = 0;
+    thread consumer;
+
+    void consumerLoop()
+    {
+        vector<SlotNotification> batch;
+        while (queue.popBatch(batch, maxBatch))
+        {
+            handler(batch);
+            {
+                lock_guard<mutex> lock(progressMutex);
+                deliveredCount += batch.size();
+                batchCount++;
+                progress.notify_all();
+                // flush() is waiting for this batch
+                if (deliveredCount == publishedCount && flushWaiters > 0)
+                {
+                    continue;
+                }
+            }
+            if (batch.size() < maxBatch && batchDelayMicros > 0)
+            {
+                this_thread::sleep_for(chrono::microseconds(batchDelayMicros));
+            }
+        }
+    }
 
 public:
-    void addPatient(const string &patientName)
+    WaitlistNotifier(function<void(const vector<SlotNotification> &)> handler, size_t queueCapacity = 4096, size_t maxBatch = 256,
+                     int batchDelayMicros = 1000)
+        : queue(queueCapacity), handler(handler), maxBatch(max<size_t>(1, maxBatch)), batchDelayMicros(batchDelayMicros)
     {
-        patientQueue.push(patientName);
+        consumer = thread(&WaitlistNotifier::consumerLoop, this);
+    }
+
+    // Delivers what is queued before returning
+    ~WaitlistNotifier()
+    {
+        queue.close();
+        consumer.join();
+    }
+
+    void update(const SlotNotification &notification) override
+    {
+        {
+            lock_guard<mutex> lock(progressMutex);
+            publishedCount++;
+        }
+        vector<SlotNotification> batch = {notification};
+        queue.pushAll(batch);
+    }
+
+    // Waits until everything queued so far has been through the handler
+    void flush()
+    {
+        unique_lock<mutex> lock(progressMutex);
+        flushWaiters++;
+        progress.wait(lock, [this]
+                      { return deliveredCount == publishedCount; });
+        flushWaiters--;
+    }
+
+    long long getDeliveredCount()
+    {
+        lock_guard<mutex> lock(progressMutex);
+        return deliveredCount;
+    }
+
+    long long getBatchCount()
+    {
+        lock_guard<mutex> lock(progressMutex);
+        return batchCount;
+    }
+
+    long long getProducerWaitCount()
+    {
+        return queue.getProducerWaitCount();
+    }
+};
+
+// Patients waiting for one (doctor, slot). Entries are patient handles, and every patient's position is
+// indexed so that a patient who withdraws is removed in O(1).
+class Waitlist
+{
+private:
+    list<IPatient *> patientQueue;
+    unordered_map<IPatient *, list<IPatient *>::iterator> positions;
+
+public:
+    bool addPatient(IPatient *patient)
+    {
+        if (positions.find(patient) != positions.end())
+        {
+            return false;
+        }
+        positions[patient] = patientQueue.insert(patientQueue.end(), patient);
+        return true;
+    }
+
+    bool removePatient(IPatient *patient)
+    {
+        auto it = positions.find(patient);
+        if (it == positions.end())
+        {
+            return false;
+        }
+        patientQueue.erase(it->second);
+        positions.erase(it);
+        return true;
+    }
+
+    bool isEmpty() const
+    {
+        return patientQueue.empty();
+    }
+
+    size_t size() const
+    {
+        return patientQueue.size();
+    }
+
+    IPatient *getNextPatient()
+    {
+        IPatient *nextPatient = patientQueue.front();
+        patientQueue.pop_front();
+        positions.erase(nextPatient);
+        return nextPatient;
+    }
+};
+
+// Waitlists are per (doctor, slot) and only exist while somebody is waiting
+using WaitlistKey = pair<DoctorId, SlotIndex>;
+
+struct WaitlistKeyHash
+{
+    size_t operator()(const WaitlistKey &key) const
+    {
+        return hash<uint64_t>()(uint64_t(key.first) << 32 | uint32_t(key.second));
+    }
+};
+
+// Available slots of one speciality ordered by start time: {slot, doctorId}
+using SpecialitySlots = set<pair<SlotIndex, DoctorId>>;
+
+class AvailabilityIndex
+{
+private:
+    // Indexed by SpecialityId
+    vector<SpecialitySlots> slotsBySpeciality;
+    // The slots at least one doctor of the speciality has free, so that a query by time can rule out or find a slot
+    // with a mask AND instead of walking the set
+    vector<SlotMask> freeSlotsBySpeciality;
+    SpecialitySlots emptySlots;
+
+    // Appends the doctors free in slot, by id, until slots holds limit entries
+    void appendDoctors(SpecialityId specialityId, SlotIndex slot, size_t limit, vector<pair<SlotIndex, DoctorId>> &slots) const
+    {
+        const SpecialitySlots &specialitySlots = slotsBySpeciality[specialityId];
+        auto end = specialitySlots.lower_bound({slot + 1, 0});
+        for (auto it = specialitySlots.lower_bound({slot, 0}); it != end && slots.size() < limit; it++)
+        {
+            slots.push_back(*it);
+        }
+    }
+
+public:
+    void addSlot(SpecialityId specialityId, DoctorId doctorId, SlotIndex slot)
+    {
+        if (slotsBySpeciality.size() <= specialityId)
+        {
+            slotsBySpeciality.resize(specialityId + 1);
+            freeSlotsBySpeciality.resize(specialityId + 1, SlotMask{});
+        }
+        slotsBySpeciality[specialityId].emplace(slot, doctorId);
+        freeSlotsBySpeciality[specialityId].set(slot);
+    }
+
+    void removeSlot(SpecialityId specialityId, DoctorId doctorId, SlotIndex slot)
+    {
+        if (specialityId < slotsBySpeciality.size())
+        {
+            SpecialitySlots &specialitySlots = slotsBySpeciality[specialityId];
+            specialitySlots.erase({slot, doctorId});
+            auto next = specialitySlots.lower_bound({slot, 0});
+            if (next == specialitySlots.end() || next->first != slot)
+            {
+                freeSlotsBySpeciality[specialityId].reset(slot);
+            }
+        }
+    }
+
+    const SpecialitySlots &getSlots(SpecialityId specialityId) const
+    {
+        return specialityId < slotsBySpeciality.size() ? slotsBySpeciality[specialityId] : emptySlots;
+    }
+
+    // The earliest of candidateSlots that a doctor of the speciality has free, once for each of the first limit
+    // doctors free then
+    vector<pair<SlotIndex, DoctorId>> getEarliestSlot(SpecialityId specialityId, SlotMask candidateSlots, size_t limit) const
+    {
+        vector<pair<SlotIndex, DoctorId>> slots;
+        if (specialityId < freeSlotsBySpeciality.size())
+        {
+            SlotIndex slot = (freeSlotsBySpeciality[specialityId] & candidateSlots).first();
+            if (slot >= 0)
+            {
+                appendDoctors(specialityId, slot, limit, slots);
+            }
+        }
+        return slots;
+    }
+
+    // Every free slot of the speciality among candidateSlots, earliest first
+    vector<pair<SlotIndex, DoctorId>> getSlotsIn(SpecialityId specialityId, SlotMask candidateSlots) const
+    {
+        vector<pair<SlotIndex, DoctorId>> slots;
+        if (specialityId < freeSlotsBySpeciality.size())
+        {
+            (freeSlotsBySpeciality[specialityId] & candidateSlots).forEach([&](SlotIndex slot)
+                                                                           { appendDoctors(specialityId, slot, SIZE_MAX, slots); });
+        }
+        return slots;
+    }
+};
+
+// Ranking policies for the speciality search. A policy turns every candidate slot into one integer key up front and
+// candidates are ordered by that key alone (lower first; ties keep start time order), so ranking makes no virtual
+// call or string comparison per comparison. Policies are template parameters, so the key is inlined.
+class RankingInput
+{
+public:
+    SlotIndex slot;
+    // Doctor rating 0..5 in tenths
+    int ratingTenths;
+    int appointmentCount;
+};
+
+class RankByStartTime
+{
+public:
+    // The availability index is already ordered by start time, so the top k are just its first k entries
+    static constexpr bool FOLLOWS_INDEX_ORDER = true;
+    static int64_t key(const RankingInput &input)
+    {
+        return input.slot;
+    }
+};
+
+class RankByRating
+{
+public:
+    static constexpr bool FOLLOWS_INDEX_ORDER = false;
+    static int64_t key(const RankingInput &input)
+    {
+        return -input.ratingTenths;
+    }
+};
+
+class RankByAppointmentCount
+{
+public:
+    static constexpr bool FOLLOWS_INDEX_ORDER = false;
+    static int64_t key(const RankingInput &input)
+    {
+        return -input.appointmentCount;
+    }
+};
+
+// Higher rating and more appointments rank a slot up, a later start ranks it down
+template <int RatingWeight, int AppointmentCountWeight, int StartTimeWeight>
+class RankWeighted
+{
+public:
+    static constexpr bool FOLLOWS_INDEX_ORDER = false;
+    static int64_t key(const RankingInput &input)
+    {
+        return -int64_t(RatingWeight) * input.ratingTenths - int64_t(AppointmentCountWeight) * input.appointmentCount +
+               int64_t(StartTimeWeight) * input.slot;
+    }
+};
+
+// Ranked slots as {slot, doctorId}, best first
+using RankedSlots = vector<pair<SlotIndex, DoctorId>>;
+
+// Where rendered text goes. AppointmentSystem never writes output itself: it returns typed results, and
+// AppointmentConsole renders them into a sink.
+class OutputSink
+{
+public:
+    virtual void write(string_view text) = 0;
+    virtual void flush() {}
+    virtual ~OutputSink() = default;
+};
+
+// Collects text in memory and hands it to the file in large batches instead of flushing every line
+class BufferedOutputSink : public OutputSink
+{
+private:
+    static constexpr size_t BATCH_SIZE = 64 * 1024;
+    FILE *file;
+    string buffer;
+
+public:
+    explicit BufferedOutputSink(FILE *file) : file(file)
+    {
+        buffer.reserve(BATCH_SIZE);
+    }
+
+    ~BufferedOutputSink() override
+    {
+        flush();
+    }
+
+    void write(string_view text) override
+    {
+        buffer.append(text);
+        if (buffer.size() >= BATCH_SIZE)
+        {
+            flush();
+        }
+    }
+
+    void flush() override
+    {
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        fflush(file);
+        buffer.clear();
+    }
+};
+
+// Drops all output, e.g. for benchmarks
+class NullOutputSink : public OutputSink
+{
+public:
+    void write(string_view) override {}
+};
+
+class IDisplayStrategy
+{
+public:
+    virtual void display(const RankedSlots &slots, const NameInterner &doctorNames, OutputSink &sink) = 0;
+    virtual ~IDisplayStrategy() = default;
+};
+
+class DisplayByStartTime : public IDisplayStrategy
+{
+public:
+    void display(const RankedSlots &slots, const NameInterner &doctorNames, OutputSink &sink) override
+    {
+        // The slots arrive already ranked, by start time unless another ranking policy was asked for.
+        for (const auto &[slot, doctorId] : slots)
+        {
+            sink.write("Dr." + doctorNames.nameOf(doctorId) + ": (" + SlotTime::toString(slot) + ")\n");
+        }
+    }
+};
+
+// One booked appointment; a fixed size record with no heap allocations of its own
+class BookedSlot
+{
+public:
+    SlotIndex slot;
+    PatientId patientId;
+    DoctorId doctorId;
+};
+
+// Booking ids come from a counter starting at 1, so bookings are kept in a dense table indexed by id instead of a
+// hash map: fixed size chunks that never move, and a tombstone per cancelled booking so that the live bookings
+// can be walked in id order.
+class BookingTable
+{
+private:
+    static const int CHUNK_SIZE = 4096;
+    struct Chunk
+    {
+        BookedSlot bookings[CHUNK_SIZE];
+        bool live[CHUNK_SIZE] = {};
+    };
+    vector<unique_ptr<Chunk>> chunks;
+
+public:
+    void add(int bookingId, const BookedSlot &booking)
+    {
+        int position = bookingId - 1;
+        while (chunks.size() <= size_t(position / CHUNK_SIZE))
+        {
+            chunks.push_back(make_unique<Chunk>());
+        }
+        chunks[position / CHUNK_SIZE]->bookings[position % CHUNK_SIZE] = booking;
+        chunks[position / CHUNK_SIZE]->live[position % CHUNK_SIZE] = true;
+    }
+
+    // Returns nullptr if the booking does not exist or was cancelled
+    BookedSlot *find(int bookingId)
+    {
+        int position = bookingId - 1;
+        if (position < 0 || size_t(position / CHUNK_SIZE) >= chunks.size() || !chunks[position / CHUNK_SIZE]->live[position % CHUNK_SIZE])
+        {
+            return nullptr;
+        }
+        return &chunks[position / CHUNK_SIZE]->bookings[position % CHUNK_SIZE];
+    }
+
+    void remove(int bookingId)
+    {
+        if (find(bookingId) != nullptr)
+        {
+            chunks[(bookingId - 1) / CHUNK_SIZE]->live[(bookingId - 1) % CHUNK_SIZE] = false;
+        }
+    }
+
+    // Visits the live bookings in id order as (bookingId, const BookedSlot &)
+    template <typename Visitor>
+    void forEachLive(Visitor visitor) const
+    {
+        for (size_t chunkIndex = 0; chunkIndex < chunks.size(); chunkIndex++)
+        {
+            const Chunk &chunk = *chunks[chunkIndex];
+            for (int offset = 0; offset < CHUNK_SIZE; offset++)
+            {
+                if (chunk.live[offset])
+                {
+                    visitor(int(chunkIndex) * CHUNK_SIZE + offset + 1, chunk.bookings[offset]);
+                }
+            }
+        }
+    }
+};
+
+enum class ResultCode
+{
+    Ok,
+    Booked,
+    Waitlisted,
+    AlreadyWaitlisted,
+    AlreadyRegistered,
+    DoctorNotFound,
+    PatientNotFound,
+    InvalidSlot,
+    SlotConflict,
+    BookingNotFound,
+    NotOnWaitlist,
+    InvalidRating
+};
+
+class BookingResult
+{
+public:
+    ResultCode code;
+    // Set when code is Booked
+    int bookingId;
+    SlotIndex slot;
+};
+
+class AvailabilityResult
+{
+public:
+    ResultCode code;
+    // Positions of the rejected slot strings in the request
+    vector<int> invalidSlotPositions;
+};
+
+class CancellationResult
+{
+public:
+    ResultCode code;
+    SlotIndex slot;
+    string doctorName;
+    // Set when the first waitlisted patient was handed the freed slot
+    bool promoted;
+    string promotedPatientName;
+    BookingResult promotion;
+};
+
+class AppointmentsResult
+{
+public:
+    ResultCode code;
+    // {bookingId, slot}
+    vector<pair<int, SlotIndex>> appointments;
+};
+
+// What became of one patient of a withdrawn slot
+class Rebooking
+{
+public:
+    // 0 for a patient from the waitlist
+    int bookingId;
+    string patientName;
+    SlotIndex slot;
+    // The patient's new booking with doctorName at the same time, or 0 if no doctor of the speciality could take them
+    int newBookingId;
+    string doctorName;
+};
+
+class WithdrawalResult
+{
+public:
+    ResultCode code;
+    // Positions of the rejected slot strings in the request
+    vector<int> invalidSlotPositions;
+    // Per slot, the booked patients first and then the waitlist in order
+    vector<Rebooking> rebookings;
+};
+
+// Slots found by time, earliest first. InvalidSlot if a time does not parse.
+class SlotSearchResult
+{
+public:
+    ResultCode code;
+    RankedSlots slots;
+};
+
+// Instrumentation: per operation counters by result and latency histograms, recorded by the engine itself.
+// Every thread records into a MetricsShard of its own, so an operation costs two timestamps and a few plain adds on
+// cache lines no other thread writes: no locks and no atomic read-modify-writes. Reading the metrics adds the shards up.
+enum class MetricOperation : uint8_t
+{
+    Book,
+    Cancel,
+    MarkAvailability,
+    SearchBySpeciality,
+    FindEarliest,
+    FindInWindow,
+    Withdraw
+};
+
+const int METRIC_OPERATION_COUNT = int(MetricOperation::Withdraw) + 1;
+const int RESULT_CODE_COUNT = int(ResultCode::InvalidRating) + 1;
+
+// Label values, as Prometheus spells them
+const char *metricLabel(MetricOperation operation)
+{
+    static const char *const labels[METRIC_OPERATION_COUNT] = {"book", "cancel", "mark_availability", "search_by_speciality",
+                                                               "find_earliest", "find_in_window", "withdraw"};
+    return labels[int(operation)];
+}
+
+const char *metricLabel(ResultCode code)
+{
+    static const char *const labels[RESULT_CODE_COUNT] = {"ok", "booked", "waitlisted", "already_waitlisted", "already_registered",
+                                                          "doctor_not_found", "patient_not_found", "invalid_slot", "slot_conflict",
+                                                          "booking_not_found", "not_on_waitlist", "invalid_rating"};
+    return labels[int(code)];
+}
+
+// Timestamps for the latency histograms: the time stamp counter on x86, which runs at a constant rate and is read
+// without a system call, steady_clock elsewhere. Ticks are converted to seconds only when the metrics are read.
+class MetricsClock
+{
+public:
+    static uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+private:
+    // The tick rate is measured from here on
+    inline static const uint64_t startTicks = now();
+    inline static const chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+
+public:
+    static double secondsPerTick()
+    {
+        uint64_t ticks = now() - startTicks;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        return ticks > 0 ? seconds / ticks : 0;
+    }
+};
+
+// Log-linear buckets in the style of HdrHistogram: values below SUB_BUCKET_COUNT get a bucket each, and every power of
+// two above is split into SUB_BUCKET_COUNT equal buckets. A bucket is thus never wider than 1/16 of the values in
+// it, and 592 buckets cover everything up to 2^40 ticks, several minutes; longer calls land in the last bucket.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int MAX_VALUE_BITS = 40;
+    static const int BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+    array<uint64_t, BUCKET_COUNT> bucketCounts = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    static int bucketOf(uint64_t value)
+    {
+        value = min(value, (uint64_t(1) << MAX_VALUE_BITS) - 1);
+        if (value < SUB_BUCKET_COUNT)
+        {
+            return int(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKET_COUNT + int(value >> shift) - SUB_BUCKET_COUNT;
+    }
+
+    // Largest value that falls into bucket
+    static uint64_t highestValueOf(int bucket)
+    {
+        if (bucket < SUB_BUCKET_COUNT)
+        {
+            return bucket;
+        }
+        int shift = bucket / SUB_BUCKET_COUNT - 1;
+        return ((uint64_t(bucket % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT) + 1) << shift) - 1;
+    }
+
+    // The value that quantile of the recorded values do not exceed, rounded up to the end of its bucket
+    uint64_t valueAt(double quantile) const
+    {
+        uint64_t rank = max<uint64_t>(1, ceil(quantile * count));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKET_COUNT; bucket++)
+        {
+            seen += bucketCounts[bucket];
+            if (seen >= rank)
+            {
+                return highestValueOf(bucket);
+            }
+        }
+        return 0;
+    }
+};
+
+// One thread's counts. Only the thread holding the shard writes it.
+class alignas(64) MetricsShard
+{
+public:
+    atomic<uint64_t> resultCounts[METRIC_OPERATION_COUNT][RESULT_CODE_COUNT];
+    atomic<uint64_t> latencyCounts[METRIC_OPERATION_COUNT][LatencyHistogram::BUCKET_COUNT];
+    atomic<uint64_t> latencySums[METRIC_OPERATION_COUNT];
+    atomic<uint64_t> promotionCount;
+    // Held by a live thread
+    atomic<bool> leased;
+};
+
+// Everything the metrics know at one point of time. The gauges come from the engine's state, see AppointmentSystem::getMetrics.
+class EngineMetrics
+{
+public:
+    array<array<uint64_t, RESULT_CODE_COUNT>, METRIC_OPERATION_COUNT> resultCounts = {};
+    // In ticks
+    array<LatencyHistogram, METRIC_OPERATION_COUNT> latencies;
+    double secondsPerTick = 0;
+    // Waitlisted patients who were handed the slot by a cancellation
+    uint64_t promotionCount = 0;
+    long long liveBookingCount = 0;
+    long long waitlistedPatientCount = 0;
+    // Slots with a waitlist, and the longest waitlist of them
+    long long waitlistedSlotCount = 0;
+    long long longestWaitlist = 0;
+};
+
+// The process wide registry of shards. A shard outlives its thread and is handed to the next thread that starts
+// recording, so totals never go down and there are never more shards than threads ever ran at the same time.
+class Metrics
+{
+private:
+    // Gives the shard back when its thread ends
+    class ShardLease
+    {
+    public:
+        MetricsShard *shard;
+
+        ShardLease() : shard(nullptr) {}
+
+        ~ShardLease()
+        {
+            if (shard != nullptr)
+            {
+                shard->leased.store(false, memory_order_release);
+            }
+        }
+    };
+
+    inline static atomic<bool> enabled{true};
+    inline static mutex shardsMutex;
+    inline static vector<unique_ptr<MetricsShard>> shards;
+    inline static thread_local ShardLease lease;
+
+    static MetricsShard &localShard()
+    {
+        if (lease.shard == nullptr)
+        {
+            lock_guard<mutex> lock(shardsMutex);
+            for (unique_ptr<MetricsShard> &shard : shards)
+            {
+                if (!shard->leased.load(memory_order_acquire))
+                {
+                    lease.shard = shard.get();
+                    break;
+                }
+            }
+            if (lease.shard == nullptr)
+            {
+                // Value-initialised, so every count starts at zero
+                shards.push_back(unique_ptr<MetricsShard>(new MetricsShard()));
+                lease.shard = shards.back().get();
+            }
+            lease.shard->leased.store(true, memory_order_relaxed);
+        }
+        return *lease.shard;
+    }
+
+    // The owning thread is the only writer, so a relaxed load and store make a plain add
+    static void add(atomic<uint64_t> &counter, uint64_t amount)
+    {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+public:
+    // On by default. While off, operations are neither timed nor counted.
+    static void setEnabled(bool on)
+    {
+        enabled.store(on, memory_order_relaxed);
+    }
+
+    // Taken before a measured call; 0 while the metrics are off
+    static uint64_t startTicks()
+    {
+        return enabled.load(memory_order_relaxed) ? MetricsClock::now() : 0;
+    }
+
+    static void record(MetricOperation operation, ResultCode code, uint64_t startTicks)
+    {
+        if (startTicks == 0)
+        {
+            return;
+        }
+        uint64_t endTicks = MetricsClock::now();
+        // The counters of two cores may be slightly apart
+        uint64_t elapsedTicks = endTicks > startTicks ? endTicks - startTicks : 0;
+        MetricsShard &shard = localShard();
+        add(shard.resultCounts[int(operation)][int(code)], 1);
+        add(shard.latencyCounts[int(operation)][LatencyHistogram::bucketOf(elapsedTicks)], 1);
+        add(shard.latencySums[int(operation)], elapsedTicks);
+    }
+
+    static void countPromotion()
+    {
+        if (enabled.load(memory_order_relaxed))
+        {
+            add(localShard().promotionCount, 1);
+        }
+    }
+
+    // Adds up the shards. The gauges are left at zero.
+    static EngineMetrics read()
+    {
+        EngineMetrics metrics;
+        metrics.secondsPerTick = MetricsClock::secondsPerTick();
+        lock_guard<mutex> lock(shardsMutex);
+        for (unique_ptr<MetricsShard> &shard : shards)
+        {
+            for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
+            {
+                for (int code = 0; code < RESULT_CODE_COUNT; code++)
+                {
+                    metrics.resultCounts[operation][code] += shard->resultCounts[operation][code].load(memory_order_relaxed);
+                }
+                LatencyHistogram &latency = metrics.latencies[operation];
+                for (int bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT; bucket++)
+                {
+                    uint64_t bucketCount = shard->latencyCounts[operation][bucket].load(memory_order_relaxed);
+                    latency.bucketCounts[bucket] += bucketCount;
+                    latency.count += bucketCount;
+                }
+                latency.sum += shard->latencySums[operation].load(memory_order_relaxed);
+            }
+            metrics.promotionCount += shard->promotionCount.load(memory_order_relaxed);
+        }
+        return metrics;
+    }
+};
+
+// The booking engine. It does no I/O: every operation returns a typed result, and AppointmentConsole renders them.
+class AppointmentSystem
+{
+private:
+    EntityFactory entityFactory;
+    NameInterner doctorIds;
+    NameInterner patientIds;
+    NameInterner specialityIds;
+    unordered_map<WaitlistKey, Waitlist *, WaitlistKeyHash> waitlists;
+    BookingTable bookedSlots;
+    AvailabilityIndex availabilityIndex;
+    int bookingCounter = 0;
+    IObserver *waitlistObserver = nullptr;
+
+    int generateBookingId()
+    {
+        return ++bookingCounter;
+    }
+
+    // Records the patient's booking of a slot that is not on offer to anyone else. Returns its booking id.
+    int recordBooking(IPatient *patient, IDoctor *doctor, SlotIndex slot)
+    {
+        int bookingId = generateBookingId();
+        bookedSlots.add(bookingId, {slot, patient->getId(), doctor->getId()});
+        patient->getAppointments()[bookingId] = slot;
+        patient->getBusySlots().set(slot);
+        doctor->getAppointments()[bookingId] = slot;
+        return bookingId;
+    }
+
+    static ResultCode resultCodeOf(const BookingResult &result)
+    {
+        return result.code;
+    }
+
+    static ResultCode resultCodeOf(const AvailabilityResult &result)
+    {
+        return result.code;
+    }
+
+    static ResultCode resultCodeOf(const CancellationResult &result)
+    {
+        return result.code;
+    }
+
+    // Searches cannot fail
+    static ResultCode resultCodeOf(const RankedSlots &)
+    {
+        return ResultCode::Ok;
+    }
+
+    static ResultCode resultCodeOf(const SlotSearchResult &result)
+    {
+        return result.code;
+    }
+
+    static ResultCode resultCodeOf(const WithdrawalResult &result)
+    {
+        return result.code;
+    }
+
+    // Runs call() as one measured operation: its latency goes to operation's histogram and its result code to
+    // operation's counters
+    template <typename Call>
+    static auto measure(MetricOperation operation, Call call)
+    {
+        uint64_t startTicks = Metrics::startTicks();
+        auto result = call();
+        Metrics::record(operation, resultCodeOf(result), startTicks);
+        return result;
+    }
+
+    // Keys are computed once per candidate and only the first limit positions are sorted
+    template <typename RankingPolicy>
+    RankedSlots rankSlots(const SpecialitySlots &candidates, size_t limit)
+    {
+        size_t rankedCount = min(limit, candidates.size());
+        if constexpr (RankingPolicy::FOLLOWS_INDEX_ORDER)
+        {
+            return RankedSlots(candidates.begin(), next(candidates.begin(), rankedCount));
+        }
+        RankedSlots startTimeOrder(candidates.begin(), candidates.end());
+        // {key, position in start time order}
+        vector<pair<int64_t, size_t>> keys(startTimeOrder.size());
+        for (size_t i = 0; i < startTimeOrder.size(); i++)
+        {
+            IDoctor *doctor = entityFactory.getDoctor(startTimeOrder[i].second);
+            keys[i] = {RankingPolicy::key({startTimeOrder[i].first, doctor->getRatingTenths(), int(doctor->getAppointments().size())}), i};
+        }
+        partial_sort(keys.begin(), keys.begin() + rankedCount, keys.end());
+        RankedSlots rankedSlots(rankedCount);
+        for (size_t i = 0; i < rankedCount; i++)
+        {
+            rankedSlots[i] = startTimeOrder[keys[i].second];
+        }
+        return rankedSlots;
+    }
+
+    BookingResult bookAppointment(IPatient *patient, IDoctor *doctor, SlotIndex slot)
+    {
+        if (patient->getBusySlots().test(slot))
+        {
+            return {ResultCode::SlotConflict, 0, slot};
+        }
+
+        SlotMask &availableSlots = doctor->getAvailableSlots();
+        if (availableSlots.test(slot))
+        {
+            int bookingId = recordBooking(patient, doctor, slot);
+            availableSlots.reset(slot);
+            availabilityIndex.removeSlot(doctor->getSpecialityId(), doctor->getId(), slot);
+            return {ResultCode::Booked, bookingId, slot};
+        }
+        Waitlist *&waitlist = waitlists[{doctor->getId(), slot}];
+        if (waitlist == nullptr)
+        {
+            waitlist = new Waitlist();
+        }
+        return {waitlist->addPatient(patient) ? ResultCode::Waitlisted : ResultCode::AlreadyWaitlisted, 0, slot};
+    }
+
+public:
+    // Told about every waitlist promotion, or nullptr
+    void setWaitlistObserver(IObserver *observer)
+    {
+        waitlistObserver = observer;
+    }
+
+    ~AppointmentSystem()
+    {
+        // Doctors and patients are owned by entityFactory's pools
+        for (auto &[key, waitlist] : waitlists)
+        {
+            delete waitlist;
+        }
+    }
+
+    const NameInterner &getDoctorNames() const
+    {
+        return doctorIds;
+    }
+
+    ResultCode registerDoctor(const string &name, const string &speciality)
+    {
+        DoctorId doctorId;
+        if (doctorIds.find(name, doctorId))
+        {
+            return ResultCode::AlreadyRegistered;
+        }
+        doctorId = doctorIds.intern(name);
+        entityFactory.createDoctor(doctorId, name, specialityIds.intern(speciality), speciality);
+        return ResultCode::Ok;
+    }
+
+    AvailabilityResult markDoctorAvailability(const string &name, const vector<string> &slots)
+    {
+        return measure(MetricOperation::MarkAvailability, [&]() -> AvailabilityResult
+                                                          {
+            DoctorId doctorId;
+            if (!doctorIds.find(name, doctorId))
+            {
+                return {ResultCode::DoctorNotFound, {}};
+            }
+            AvailabilityResult result = {ResultCode::Ok, {}};
+            IDoctor *doctor = entityFactory.getDoctor(doctorId);
+            for (size_t i = 0; i < slots.size(); i++)
+            {
+                SlotIndex slot;
+                if (SlotTime::parseSlot(slots[i], slot))
+                {
+                    SlotMask &availableSlots = doctor->getAvailableSlots();
+                    if (!availableSlots.test(slot))
+                    {
+                        availableSlots.set(slot);
+                        availabilityIndex.addSlot(doctor->getSpecialityId(), doctorId, slot);
+                    }
+                }
+                else
+                {
+                    result.invalidSlotPositions.push_back(i);
+                }
+            }
+            return result; });
+    }
+
+    ResultCode registerPatient(const string &name)
+    {
+        PatientId patientId;
+        if (patientIds.find(name, patientId))
+        {
+            return ResultCode::AlreadyRegistered;
+        }
+        patientId = patientIds.intern(name);
+        entityFactory.createPatient(patientId, name);
+        return ResultCode::Ok;
+    }
+
+    ResultCode rateDoctor(const string &name, double rating)
+    {
+        DoctorId doctorId;
+        if (!doctorIds.find(name, doctorId))
+        {
+            return ResultCode::DoctorNotFound;
+        }
+        if (!(rating >= 0 && rating <= 5))
+        {
+            return ResultCode::InvalidRating;
+        }
+        entityFactory.getDoctor(doctorId)->setRatingTenths(lround(rating * 10));
+        return ResultCode::Ok;
+    }
+
+    // RankingPolicy decides the order, start time by default; only the best limit slots are ranked and returned,
+    // all of them if limit is negative.
+    template <typename RankingPolicy = RankByStartTime>
+    RankedSlots getAvailableSlotsBySpeciality(const string &speciality, int limit = -1)
+    {
+        return measure(MetricOperation::SearchBySpeciality, [&]() -> RankedSlots
+                                                            {
+            SpecialityId specialityId;
+            if (!specialityIds.find(speciality, specialityId))
+            {
+                return {};
+            }
+            return rankSlots<RankingPolicy>(availabilityIndex.getSlots(specialityId), limit < 0 ? SIZE_MAX : size_t(limit)); });
+    }
+
+    // The earliest slot starting at or after the given time, e.g. "14:00", that a doctor of the speciality has free,
+    // with the first limit doctors free then (all of them if limit is negative). A find-first-set over the speciality's
+    // free slot mask finds it, however many doctors there are.
+    SlotSearchResult findEarliestAvailable(const string &speciality, const string &after, int limit = -1)
+    {
+        return measure(MetricOperation::FindEarliest, [&]() -> SlotSearchResult
+                                                      {
+            int afterMinutes;
+            if (!SlotTime::parseMinutes(after, afterMinutes))
+            {
+                return {ResultCode::InvalidSlot, {}};
+            }
+            SpecialityId specialityId;
+            if (!specialityIds.find(speciality, specialityId))
+            {
+                return {ResultCode::Ok, {}};
+            }
+            SlotMask candidateSlots = SlotMask::range(SlotTime::firstSlotStartingFrom(afterMinutes), SlotTime::slotsPerDay());
+            return {ResultCode::Ok, availabilityIndex.getEarliestSlot(specialityId, candidateSlots, limit < 0 ? SIZE_MAX : size_t(limit))}; });
+    }
+
+    // Every free slot of the speciality that starts at or after from and is over by to, e.g. "12:00" to "15:00"
+    SlotSearchResult findAvailableInWindow(const string &speciality, const string &from, const string &to)
+    {
+        return measure(MetricOperation::FindInWindow, [&]() -> SlotSearchResult
+                                                      {
+            int fromMinutes, toMinutes;
+            if (!SlotTime::parseMinutes(from, fromMinutes) || !SlotTime::parseMinutes(to, toMinutes, true))
+            {
+                return {ResultCode::InvalidSlot, {}};
+            }
+            SpecialityId specialityId;
+            if (!specialityIds.find(speciality, specialityId))
+            {
+                return {ResultCode::Ok, {}};
+            }
+            SlotMask candidateSlots = SlotMask::range(SlotTime::firstSlotStartingFrom(fromMinutes), SlotTime::slotsEndingBy(toMinutes));
+            return {ResultCode::Ok, availabilityIndex.getSlotsIn(specialityId, candidateSlots)}; });
+    }
+
+    BookingResult bookAppointment(const string &patientName, const string &doctorName, const string &slotText)
+    {
+        uint64_t startTicks = Metrics::startTicks();
+        SlotIndex slot;
+        if (!SlotTime::parseSlot(slotText, slot))
+        {
+            Metrics::record(MetricOperation::Book, ResultCode::InvalidSlot, startTicks);
+            return {ResultCode::InvalidSlot, 0, 0};
+        }
+        return bookAppointment(patientName, doctorName, slot);
+    }
+
+    BookingResult bookAppointment(const string &patientName, const string &doctorName, SlotIndex slot)
+    {
+        return measure(MetricOperation::Book, [&]() -> BookingResult
+                                              {
+            PatientId patientId;
+            DoctorId doctorId;
+            if (!patientIds.find(patientName, patientId))
+            {
+                return {ResultCode::PatientNotFound, 0, slot};
+            }
+            if (!doctorIds.find(doctorName, doctorId))
+            {
+                return {ResultCode::DoctorNotFound, 0, slot};
+            }
+            return bookAppointment(entityFactory.getPatient(patientId), entityFactory.getDoctor(doctorId), slot); });
+    }
+
+    CancellationResult cancelBooking(int bookingId)
+    {
+        return measure(MetricOperation::Cancel, [&]() -> CancellationResult
+                                                {
+            BookedSlot *bookedSlot = bookedSlots.find(bookingId);
+            if (bookedSlot == nullptr)
+            {
+                return {ResultCode::BookingNotFound, 0, "", false, "", {}};
+            }
+            BookedSlot booked = *bookedSlot;
+            bookedSlots.remove(bookingId);
+            IPatient *patient = entityFactory.getPatient(booked.patientId);
+            IDoctor *doctor = entityFactory.getDoctor(booked.doctorId);
+            patient->getAppointments().erase(bookingId);
+            patient->getBusySlots().reset(booked.slot);
+            doctor->getAppointments().erase(bookingId);
+            CancellationResult result = {ResultCode::Ok, booked.slot, doctor->getName(), false, "", {}};
+
+            // The slot goes straight to the first waitlisted patient who is still free at that time, without ever
+            // being on offer in between. Patients who booked that time elsewhere meanwhile leave the waitlist.
+            auto waitlistIt = waitlists.find({booked.doctorId, booked.slot});
+            while (waitlistIt != waitlists.end() && !result.promoted)
+            {
+                IPatient *nextPatient = waitlistIt->second->getNextPatient();
+                if (waitlistIt->second->isEmpty())
+                {
+                    delete waitlistIt->second;
+                    waitlists.erase(waitlistIt);
+                    waitlistIt = waitlists.end();
+                }
+                if (!nextPatient->getBusySlots().test(booked.slot))
+                {
+                    result.promoted = true;
+                    Metrics::countPromotion();
+                    result.promotedPatientName = nextPatient->getName();
+                    result.promotion = {ResultCode::Booked, recordBooking(nextPatient, doctor, booked.slot), booked.slot};
+                }
+            }
+            if (!result.promoted)
+            {
+                doctor->getAvailableSlots().set(booked.slot);
+                availabilityIndex.addSlot(doctor->getSpecialityId(), booked.doctorId, booked.slot);
+                return result;
+            }
+            // Declaring a booked slot again puts it back on offer; now that it has a holder again it comes off
+            if (doctor->getAvailableSlots().test(booked.slot))
+            {
+                doctor->getAvailableSlots().reset(booked.slot);
+                availabilityIndex.removeSlot(doctor->getSpecialityId(), booked.doctorId, booked.slot);
+            }
+            if (waitlistObserver != nullptr)
+            {
+                // Telling the patient is the observer's business and happens asynchronously
+                waitlistObserver->update({result.promotion.bookingId, result.promotedPatientName, result.doctorName, booked.slot});
+            }
+            return result; });
+    }
+
+    // A doctor who cannot see patients after all, e.g. calls in sick, takes slots back; no slots takes back the whole
+    // day. The slots' bookings and waitlists are cleared in one pass, and the patients, per slot the booked ones first
+    // and then the waitlist in order, are rebooked with other doctors of the speciality who are free at the same time,
+    // all found with one index search. A patient who has booked that time elsewhere meanwhile is not rebooked.
+    WithdrawalResult withdrawDoctor(const string &name, const vector<string> &slots)
+    {
+        return measure(MetricOperation::Withdraw, [&]() -> WithdrawalResult
+                                                  {
+            DoctorId doctorId;
+            if (!doctorIds.find(name, doctorId))
+            {
+                return {ResultCode::DoctorNotFound, {}, {}};
+            }
+            WithdrawalResult result = {ResultCode::Ok, {}, {}};
+            SlotMask withdrawnSlots = slots.empty() ? SlotMask::range(0, SlotTime::slotsPerDay()) : SlotMask{};
+            for (size_t i = 0; i < slots.size(); i++)
+            {
+                SlotIndex slot;
+                if (SlotTime::parseSlot(slots[i], slot))
+                {
+                    withdrawnSlots.set(slot);
+                }
+                else
+                {
+                    result.invalidSlotPositions.push_back(i);
+                }
+            }
+            IDoctor *doctor = entityFactory.getDoctor(doctorId);
+            SlotMask &availableSlots = doctor->getAvailableSlots();
+            (availableSlots & withdrawnSlots).forEach([&](SlotIndex slot)
+                                                      { availabilityIndex.removeSlot(doctor->getSpecialityId(), doctorId, slot); });
+            availableSlots = availableSlots & ~withdrawnSlots;
+            // {slot, bookingId}, so that every slot's booked patients come first come first served
+            vector<pair<SlotIndex, int>> bookings;
+            for (const auto &[bookingId, slot] : doctor->getAppointments())
+            {
+                if (withdrawnSlots.test(slot))
+                {
+                    bookings.push_back({slot, bookingId});
+                }
+            }
+            sort(bookings.begin(), bookings.end());
+            // The displaced patients, in the order of result.rebookings
+            vector<IPatient *> patients;
+            auto bookingIt = bookings.begin();
+            withdrawnSlots.forEach([&](SlotIndex slot)
+                                   {
+                for (; bookingIt != bookings.end() && bookingIt->first == slot; bookingIt++)
+                {
+                    int bookingId = bookingIt->second;
+                    IPatient *patient = entityFactory.getPatient(bookedSlots.find(bookingId)->patientId);
+                    bookedSlots.remove(bookingId);
+                    patient->getAppointments().erase(bookingId);
+                    patient->getBusySlots().reset(slot);
+                    doctor->getAppointments().erase(bookingId);
+                    result.rebookings.push_back({bookingId, patient->getName(), slot, 0, ""});
+                    patients.push_back(patient);
+                }
+                auto waitlistIt = waitlists.find({doctorId, slot});
+                if (waitlistIt != waitlists.end())
+                {
+                    while (!waitlistIt->second->isEmpty())
+                    {
+                        IPatient *patient = waitlistIt->second->getNextPatient();
+                        result.rebookings.push_back({0, patient->getName(), slot, 0, ""});
+                        patients.push_back(patient);
+                    }
+                    delete waitlistIt->second;
+                    waitlists.erase(waitlistIt);
+                } });
+            // Earliest first like the rebookings, so one pass pairs every slot's patients with its free doctors
+            vector<pair<SlotIndex, DoctorId>> freeDoctors = availabilityIndex.getSlotsIn(doctor->getSpecialityId(), withdrawnSlots);
+            size_t nextDoctor = 0;
+            for (size_t i = 0; i < result.rebookings.size(); i++)
+            {
+                Rebooking &rebooking = result.rebookings[i];
+                while (nextDoctor < freeDoctors.size() && freeDoctors[nextDoctor].first < rebooking.slot)
+                {
+                    nextDoctor++;
+                }
+                if (nextDoctor == freeDoctors.size() || freeDoctors[nextDoctor].first != rebooking.slot || patients[i]->getBusySlots().test(rebooking.slot))
+                {
+                    continue;
+                }
+                IDoctor *peer = entityFactory.getDoctor(freeDoctors[nextDoctor++].second);
+                rebooking.newBookingId = bookAppointment(patients[i], peer, rebooking.slot).bookingId;
+                rebooking.doctorName = peer->getName();
+            }
+            return result; });
+    }
+
+    ResultCode withdrawFromWaitlist(const string &patientName, const string &doctorName, const string &slotText)
+    {
+        SlotIndex slot;
+        PatientId patientId;
+        DoctorId doctorId;
+        auto waitlistIt = waitlists.end();
+        if (patientIds.find(patientName, patientId) && doctorIds.find(doctorName, doctorId) && SlotTime::parseSlot(slotText, slot))
+        {
+            waitlistIt = waitlists.find({doctorId, slot});
+        }
+        if (waitlistIt == waitlists.end() || !waitlistIt->second->removePatient(entityFactory.getPatient(patientId)))
+        {
+            return ResultCode::NotOnWaitlist;
+        }
+        if (waitlistIt->second->isEmpty())
+        {
+            delete waitlistIt->second;
+            waitlists.erase(waitlistIt);
+        }
+        return ResultCode::Ok;
+    }
+
+    AppointmentsResult getPatientAppointments(const string &patientName)
+    {
+        PatientId patientId;
+        if (!patientIds.find(patientName, patientId))
+        {
+            return {ResultCode::PatientNotFound, {}};
+        }
+        const unordered_map<int, SlotIndex> &appointments = entityFactory.getPatient(patientId)->getAppointments();
+        return {ResultCode::Ok, vector<pair<int, SlotIndex>>(appointments.begin(), appointments.end())};
+    }
+
+    AppointmentsResult getDoctorAppointments(const string &doctorName)
+    {
+        DoctorId doctorId;
+        if (!doctorIds.find(doctorName, doctorId))
+        {
+            return {ResultCode::DoctorNotFound, {}};
+        }
+        const unordered_map<int, SlotIndex> &appointments = entityFactory.getDoctor(doctorId)->getAppointments();
+        return {ResultCode::Ok, vector<pair<int, SlotIndex>>(appointments.begin(), appointments.end())};
+    }
+
+    // The counters and latency histograms of every thread added up, and the bookings and waitlists as they are now
+    EngineMetrics getMetrics()
+    {
+        EngineMetrics metrics = Metrics::read();
+        for (DoctorId doctorId = 0; doctorId < doctorIds.size(); doctorId++)
+        {
+            metrics.liveBookingCount += entityFactory.getDoctor(doctorId)->getAppointments().size();
+        }
+        for (auto &[key, waitlist] : waitlists)
+        {
+            metrics.waitlistedPatientCount += waitlist->size();
+            metrics.waitlistedSlotCount++;
+            metrics.longestWaitlist = max<long long>(metrics.longestWaitlist, waitlist->size());
+        }
+        return metrics;
+    }
+
+    // End of day reconciliation: visits every live booking in booking id order as (bookingId, const BookedSlot &)
+    template <typename Visitor>
+    void forEachBooking(Visitor visitor) const
+    {
+        bookedSlots.forEachLive(visitor);
+    }
+};
+
+// Text front end of AppointmentSystem: runs each operation and renders its result into an OutputSink
+class AppointmentConsole
+{
+private:
+    AppointmentSystem &system;
+    OutputSink &sink;
+    IDisplayStrategy *displayStrategy = nullptr;
+    // Waitlist promotions are rendered on the notifier's thread into notificationText, and moved to the sink by
+    // the console's own thread, so the sink is only ever written by one thread
+    mutex notificationMutex;
+    string notificationText;
+    WaitlistNotifier notifier;
+
+    void append(string_view text)
+    {
+        sink.write(text);
+    }
+
+    void append(int value)
+    {
+        append(static_cast<long long>(value));
+    }
+
+    void append(long long value)
+    {
+        char buffer[24];
+        int length = snprintf(buffer, sizeof(buffer), "%lld", value);
+        sink.write(string_view(buffer, length));
+    }
+
+    void append(double value)
+    {
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "%g", value);
+        sink.write(string_view(buffer, length));
+    }
+
+    void printBookingOutcome(const BookingResult &result)
+    {
+        switch (result.code)
+        {
+        case ResultCode::Booked:
+            print("Booked. Booking id: ", result.bookingId, "\n");
+            break;
+        case ResultCode::Waitlisted:
+            print("Added patient to waitlist for slot ", SlotTime::toString(result.slot), "\n");
+            break;
+        case ResultCode::AlreadyWaitlisted:
+            print("Patient is already on the waitlist for slot ", SlotTime::toString(result.slot), "\n");
+            break;
+        case ResultCode::SlotConflict:
+            print("Patient already has an appointment in the same slot.\n");
+            break;
+        case ResultCode::InvalidSlot:
+            print("Invalid slot.\n");
+            break;
+        default:
+            print("Patient or Doctor not found.\n");
+            break;
+        }
+    }
+
+    void printNotifications()
+    {
+        notifier.flush();
+        lock_guard<mutex> lock(notificationMutex);
+        append(notificationText);
+        notificationText.clear();
+    }
+
+    // Renders a search by time through the display strategy
+    void showSearchResult(const SlotSearchResult &result)
+    {
+        if (result.code == ResultCode::InvalidSlot)
+        {
+            print("Invalid time.\n");
+        }
+        else if (!displayStrategy)
+        {
+            print("No display strategy set.\n");
+        }
+        else if (result.slots.empty())
+        {
+            print("No slots available.\n");
+        }
+        else
+        {
+            displayStrategy->display(result.slots, system.getDoctorNames(), sink);
+        }
+        print("\n");
+    }
+
+    void printAppointments(const AppointmentsResult &result)
+    {
+        for (const auto &[bookingId, slot] : result.appointments)
+        {
+            print("Booking ID: ", bookingId, ", Slot: ", SlotTime::toString(slot), "\n");
+        }
+    }
+
+    static string formatNumber(double value)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.6g", value);
+        return buffer;
+    }
+
+    void printMetricHeader(string_view name, string_view type, string_view help)
+    {
+        print("# HELP ", name, " ", help, "\n# TYPE ", name, " ", type, "\n");
+    }
+
+    void printMetric(string_view name, string_view type, string_view help, long long value)
+    {
+        printMetricHeader(name, type, help);
+        print(name, " ", value, "\n");
+    }
+
+public:
+    AppointmentConsole(AppointmentSystem &system, OutputSink &sink)
+        : system(system), sink(sink), notifier([this](const vector<SlotNotification> &notifications)
+                                               {
+            lock_guard<mutex> lock(notificationMutex);
+            for (const SlotNotification &notification : notifications)
+            {
+                notificationText += "Notifying " + notification.patientName + " for slot " + SlotTime::toString(notification.slot) + "\n";
+            } })
+    {
+        system.setWaitlistObserver(&notifier);
+    }
+
+    ~AppointmentConsole()
+    {
+        system.setWaitlistObserver(nullptr);
+    }
+
+    template <typename... Parts>
+    void print(const Parts &...parts)
+    {
+        (append(parts), ...);
+    }
+
+    void flush()
+    {
+        sink.flush();
+    }
+
+    void setDisplayStrategy(IDisplayStrategy *strategy)
+    {
+        displayStrategy = strategy;
+    }
+
+    ResultCode registerDoctor(const string &name, const string &speciality)
+    {
+        print("Registering Doctor: ", name, ", Speciality: ", speciality, "\n");
+        ResultCode code = system.registerDoctor(name, speciality);
+        print(code == ResultCode::Ok ? "Welcome Dr. " + name + " !!\n" : "Doctor already registered.\n", "\n");
+        return code;
+    }
+
+    AvailabilityResult markDoctorAvailability(const string &name, const vector<string> &slots)
+    {
+        print("Marking availability for Dr. ", name, " with slots: ");
+        for (const string &slot : slots)
+        {
+            print(slot, " ");
+        }
+        print("\n");
+        AvailabilityResult result = system.markDoctorAvailability(name, slots);
+        if (result.code == ResultCode::Ok)
+        {
+            for (int position : result.invalidSlotPositions)
+            {
+                const SlotGrid &grid = SlotTime::getGrid();
+                print("Sorry Dr. ", name, ", slots are ", grid.slotMinutes, " mins only between ", SlotGrid::format(grid.openMinutes), " and ",
+                      SlotGrid::format(grid.closeMinutes), ". Invalid slot: ", slots[position], "\n");
+            }
+            print("Done Doc!\n");
+        }
+        else
+        {
+            print("Doctor not found.\n");
+        }
+        print("\n");
+        return result;
+    }
+
+    ResultCode registerPatient(const string &name)
+    {
+        print("Registering Patient: ", name, "\n");
+        ResultCode code = system.registerPatient(name);
+        print(code == ResultCode::Ok ? "Registration successful\n" : "Patient already registered.\n", "\n");
+        return code;
+    }
+
+    ResultCode rateDoctor(const string &name, double rating)
+    {
+        print("Rating Dr. ", name, ": ", rating, "\n");
+        ResultCode code = system.rateDoctor(name, rating);
+        if (code == ResultCode::DoctorNotFound)
+        {
+            print("Doctor not found.\n");
+        }
+        else if (code == ResultCode::InvalidRating)
+        {
+            print("Rating should be between 0 and 5.\n");
+        }
+        else
+        {
+            print("Thanks for rating!\n");
+        }
+        print("\n");
+        return code;
+    }
+
+    template <typename RankingPolicy = RankByStartTime>
+    void showAvailableSlotsBySpeciality(const string &speciality, int limit = -1)
+    {
+        print("Showing available slots for speciality: ", speciality, "\n");
+        if (displayStrategy)
+        {
+            displayStrategy->display(system.getAvailableSlotsBySpeciality<RankingPolicy>(speciality, limit), system.getDoctorNames(), sink);
+        }
+        else
+        {
+            print("No display strategy set.\n");
+        }
+        print("\n");
+    }
+
+    void showEarliestAvailable(const string &speciality, const string &after, int limit = -1)
+    {
+        print("Showing earliest available slot for speciality: ", speciality, " from ", after, "\n");
+        showSearchResult(system.findEarliestAvailable(speciality, after, limit));
+    }
+
+    void showAvailableInWindow(const string &speciality, const string &from, const string &to)
+    {
+        print("Showing available slots for speciality: ", speciality, " between ", from, " and ", to, "\n");
+        showSearchResult(system.findAvailableInWindow(speciality, from, to));
+    }
+
+    BookingResult bookAppointment(const string &patientName, const string &doctorName, const string &slotText)
+    {
+        BookingResult result = system.bookAppointment(patientName, doctorName, slotText);
+        print("Booking appointment for Patient: ", patientName, " with Dr. ", doctorName, " for slot: ",
+              result.code == ResultCode::InvalidSlot ? slotText : SlotTime::toString(result.slot), "\n");
+        printBookingOutcome(result);
+        return result;
+    }
+
+    BookingResult bookAppointment(const string &patientName, const string &doctorName, SlotIndex slot)
+    {
+        BookingResult result = system.bookAppointment(patientName, doctorName, slot);
+        print("Booking appointment for Patient: ", patientName, " with Dr. ", doctorName, " for slot: ", SlotTime::toString(slot), "\n");
+        printBookingOutcome(result);
+        return result;
+    }
+
+    CancellationResult cancelBooking(int bookingId)
+    {
+        print("Cancelling booking with ID: ", bookingId, "\n");
+        CancellationResult result = system.cancelBooking(bookingId);
+        if (result.code == ResultCode::Ok)
+        {
+            print("Booking Cancelled\n");
+            if (result.promoted)
+            {
+                // Waits for the notification so that the transcript stays in order; callers of the system don't wait
+                printNotifications();
+                string slot = SlotTime::toString(result.slot);
+                print("Booking appointment for Patient: ", result.promotedPatientName, " with Dr. ", result.doctorName, " for slot: ", slot, "\n");
+                printBookingOutcome(result.promotion);
+                if (result.promotion.code == ResultCode::Booked)
+                {
+                    print("Appointment booked for ", result.promotedPatientName, " with booking ID ", result.promotion.bookingId, "\n");
+                }
+            }
+        }
+        else
+        {
+            print("No booking found for the given booking ID.\n");
+        }
+        print("\n");
+        return result;
     }
 
-    void update(const string &slot) override
+    WithdrawalResult withdrawDoctor(const string &name, const vector<string> &slots)
     {
-        if (!patientQueue.empty())
+        print("Withdrawing Dr. ", name, slots.empty() ? " for the whole day" : " from slots: ");
+        for (const string &slot : slots)
+        {
+            print(slot, " ");
+        }
+        print("\n");
+        WithdrawalResult result = system.withdrawDoctor(name, slots);
+        if (result.code != ResultCode::Ok)
+        {
+            print("Doctor not found.\n\n");
+            return result;
+        }
+        for (int position : result.invalidSlotPositions)
+        {
+            print("Invalid slot: ", slots[position], "\n");
+        }
+        for (const Rebooking &rebooking : result.rebookings)
         {
-            string nextPatient = patientQueue.front();
-            patientQueue.pop();
-            cout << "Notifying " << nextPatient << " for slot " << slot << endl;
+            print("Patient ", rebooking.patientName, rebooking.bookingId != 0 ? " with booking ID " + to_string(rebooking.bookingId) : " on the waitlist",
+                  " for slot: ", SlotTime::toString(rebooking.slot));
+            if (rebooking.newBookingId != 0)
+            {
+                print(" moved to Dr. ", rebooking.doctorName, " with booking ID ", rebooking.newBookingId, "\n");
+            }
+            else
+            {
+                print(" could not be moved to another doctor\n");
+            }
         }
+        print("Slots withdrawn\n\n");
+        return result;
     }
 
-    bool isEmpty() const
+    ResultCode withdrawFromWaitlist(const string &patientName, const string &doctorName, const string &slotText)
     {
-        return patientQueue.empty();
+        print("Withdrawing Patient: ", patientName, " from the waitlist of Dr. ", doctorName, " for slot: ", slotText, "\n");
+        ResultCode code = system.withdrawFromWaitlist(patientName, doctorName, slotText);
+        print(code == ResultCode::Ok ? "Removed from waitlist\n" : "Patient is not on this waitlist.\n", "\n");
+        return code;
     }
 
-    string getNextPatient()
+    void showPatientAppointments(const string &patientName)
     {
-        string nextPatient = patientQueue.front();
-        patientQueue.pop();
-        return nextPatient;
+        print("Showing appointments for Patient: ", patientName, "\n");
+        AppointmentsResult result = system.getPatientAppointments(patientName);
+        if (result.code == ResultCode::Ok)
+        {
+            print("Appointments for ", patientName, ":\n");
+            printAppointments(result);
+        }
+        else
+        {
+            print("Patient not found.\n");
+        }
+        print("\n");
     }
-};
 
-class IDisplayStrategy
-{
-public:
-    virtual void display(const unordered_map<string, IDoctor *> &doctors, const string &speciality) = 0;
-    virtual ~IDisplayStrategy() = default;
-};
+    void showDoctorAppointments(const string &doctorName)
+    {
+        print("Showing appointments for Dr. ", doctorName, "\n");
+        AppointmentsResult result = system.getDoctorAppointments(doctorName);
+        if (result.code == ResultCode::Ok)
+        {
+            print("Appointments for Dr. ", doctorName, ":\n");
+            printAppointments(result);
+        }
+        else
+        {
+            print("Doctor not found.\n");
+        }
+        print("\n");
+    }
 
-class DisplayByStartTime : public IDisplayStrategy
-{
-public:
-    void display(const unordered_map<string, IDoctor *> &doctors, const string &speciality) override
+    // The system's metrics in the Prometheus text format. Latencies are summaries with the quantiles read off the
+    // histograms, so they are exact to the histogram's 1/16 precision.
+    void dumpMetrics()
     {
-        vector<pair<string, string>> slots;
-        for (const auto &[name, doctor] : doctors)
+        EngineMetrics metrics = system.getMetrics();
+        printMetricHeader("appointments_operations_total", "counter", "Calls by operation and result.");
+        for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
         {
-            if (doctor->getSpeciality() == speciality)
+            for (int code = 0; code < RESULT_CODE_COUNT; code++)
             {
-                for (const string &slot : doctor->getAvailableSlots())
+                if (metrics.resultCounts[operation][code] > 0)
                 {
-                    slots.emplace_back(slot, name);
+                    print("appointments_operations_total{operation=\"", metricLabel(MetricOperation(operation)), "\",result=\"",
+                          metricLabel(ResultCode(code)), "\"} ", static_cast<long long>(metrics.resultCounts[operation][code]), "\n");
                 }
             }
         }
-        sort(slots.begin(), slots.end(), [](const pair<string, string> &a, const pair<string, string> &b)
-             {
-            int startHourA = stoi(a.first.substr(0, a.first.find(':')));
-            int startMinuteA = stoi(a.first.substr(a.first.find(':') + 1, a.first.find('-') - a.first.find(':') - 1));
-            int startHourB = stoi(b.first.substr(0, b.first.find(':')));
-            int startMinuteB = stoi(b.first.substr(b.first.find(':') + 1, b.first.find('-') - b.first.find(':') - 1));
-            return (startHourA * 60 + startMinuteA) < (startHourB * 60 + startMinuteB); });
-        for (const auto &[slot, name] : slots)
+        printMetricHeader("appointments_operation_latency_seconds", "summary", "Latency of the calls.");
+        for (int operation = 0; operation < METRIC_OPERATION_COUNT; operation++)
         {
-            cout << "Dr." << name << ": (" << slot << ")" << endl;
+            const LatencyHistogram &latency = metrics.latencies[operation];
+            if (latency.count == 0)
+            {
+                continue;
+            }
+            const char *label = metricLabel(MetricOperation(operation));
+            for (double quantile : {0.5, 0.9, 0.99, 0.999})
+            {
+                print("appointments_operation_latency_seconds{operation=\"", label, "\",quantile=\"", formatNumber(quantile), "\"} ",
+                      formatNumber(latency.valueAt(quantile) * metrics.secondsPerTick), "\n");
+            }
+            print("appointments_operation_latency_seconds_sum{operation=\"", label, "\"} ", formatNumber(latency.sum * metrics.secondsPerTick), "\n");
+            print("appointments_operation_latency_seconds_count{operation=\"", label, "\"} ", static_cast<long long>(latency.count), "\n");
         }
+        printMetric("appointments_waitlist_promotions_total", "counter", "Waitlisted patients handed the slot by a cancellation.",
+                    metrics.promotionCount);
+        printMetric("appointments_live_bookings", "gauge", "Booked appointments.", metrics.liveBookingCount);
+        printMetric("appointments_waitlisted_patients", "gauge", "Patients waiting for a slot.", metrics.waitlistedPatientCount);
+        printMetric("appointments_waitlisted_slots", "gauge", "Slots with a waitlist.", metrics.waitlistedSlotCount);
+        printMetric("appointments_longest_waitlist", "gauge", "Patients waiting for the most wanted slot.", metrics.longestWaitlist);
+        print("\n");
     }
 };
 
-class AppointmentSystem
+// Replays the README command language from a stream, one command per line, e.g.
+//   registerDoc -> Curious -> Cardiologist
+//   markDocAvail: Curious 9:30-10:00, 12:30-13:00
+//   withdrawDoc: Curious 12:30-13:00
+//   registerPatient -> PatientA
+//   bookAppointment: (PatientA, Dr.Curious, 12:30)
+//   cancelBookingId: 1
+//   showAvailByspeciality: Cardiologist
+//   findEarliest: Cardiologist 14:00
+//   findInWindow: Cardiologist 12:00 15:00
+//   rateDoc: Curious 4.5
+//   dumpMetrics
+// withdrawDoc without slots withdraws the whole day. README prefixes ("i:"), "o:" lines, blank lines and '#' comments
+// are skipped. Lines are tokenised in place with string_view over large input blocks; only the arguments handed to
+// AppointmentConsole are copied, into reused buffers.
+class CommandDriver
 {
 private:
-    unordered_map<string, IDoctor *> doctors;
-    unordered_map<string, IPatient *> patients;
-    unordered_map<string, Waitlist *> waitlists;
-    unordered_map<int, tuple<string, string, string>> bookedSlots;
-    IDisplayStrategy *displayStrategy;
-    int bookingCounter = 0;
+    AppointmentConsole &console;
+    string doctorName, patientName, argument, fromTime, toTime;
+    vector<string> slots;
+    long long commandCount = 0;
+    long long invalidCommandCount = 0;
 
-    bool isValidSlot(const string &slot)
+    static string_view trim(string_view text)
     {
-        size_t dashPos = slot.find('-');
-        size_t colonPos1 = slot.find(':');
-        size_t colonPos2 = slot.find(':', dashPos);
-
-        if (dashPos == string::npos || colonPos1 == string::npos || colonPos2 == string::npos)
+        while (!text.empty() && isspace(static_cast<unsigned char>(text.front())))
         {
-            return false;
+            text.remove_prefix(1);
         }
-
-        int startHour = stoi(slot.substr(0, colonPos1));
-        int startMinute = stoi(slot.substr(colonPos1 + 1, dashPos - colonPos1 - 1));
-        int endHour = stoi(slot.substr(dashPos + 1, colonPos2 - dashPos - 1));
-        int endMinute = stoi(slot.substr(colonPos2 + 1));
-
-        int duration = (endHour * 60 + endMinute) - (startHour * 60 + startMinute);
-        return duration == 30;
+        while (!text.empty() && isspace(static_cast<unsigned char>(text.back())))
+        {
+            text.remove_suffix(1);
+        }
+        return text;
     }
 
-    int generateBookingId()
+    // Splits the last word off text. Returns an empty word, leaving text as it is, if text has no more than one word.
+    static string_view takeLastWord(string_view &text)
     {
-        return ++bookingCounter;
+        size_t lastSpace = text.find_last_of(" \t");
+        if (lastSpace == string_view::npos)
+        {
+            return {};
+        }
+        string_view word = text.substr(lastSpace + 1);
+        text = trim(text.substr(0, lastSpace));
+        return word;
     }
 
-public:
-    AppointmentSystem() : displayStrategy(nullptr) {}
+    static bool equalsIgnoreCase(string_view a, string_view b)
+    {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y)
+                                             { return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y)); });
+    }
 
-    ~AppointmentSystem()
+    static bool consumePrefix(string_view &text, string_view prefix)
     {
-        for (auto &[name, doctor] : doctors)
+        if (text.size() < prefix.size() || !equalsIgnoreCase(text.substr(0, prefix.size()), prefix))
         {
-            delete doctor;
-        }
-        for (auto &[name, patient] : patients)
-        {
-            delete patient;
-        }
-        for (auto &[slot, waitlist] : waitlists)
-        {
-            delete waitlist;
+            return false;
         }
+        text.remove_prefix(prefix.size());
+        return true;
     }
 
-    void setDisplayStrategy(IDisplayStrategy *strategy)
+    static string_view nextToken(string_view &text, string_view separators)
     {
-        displayStrategy = strategy;
+        text = trim(text);
+        size_t end = text.find_first_of(separators);
+        string_view token = trim(text.substr(0, end));
+        text = end == string_view::npos ? string_view() : text.substr(end + 1);
+        return token;
     }
 
-    void registerDoctor(const string &name, const string &speciality)
+    static string_view nextArrowArgument(string_view &text)
     {
-        cout << "Registering Doctor: " << name << ", Speciality: " << speciality << endl;
-        if (doctors.find(name) == doctors.end())
-        {
-            doctors[name] = EntityFactory::createDoctor(name, speciality);
-            cout << "Welcome Dr. " << name << " !!" << endl;
-        }
-        else
-        {
-            cout << "Doctor already registered." << endl;
-        }
-        cout << endl;
+        text = trim(text);
+        consumePrefix(text, "->");
+        size_t end = text.find("->");
+        string_view token = trim(text.substr(0, end));
+        text = end == string_view::npos ? string_view() : text.substr(end);
+        return token;
     }
 
-    void markDoctorAvailability(const string &name, const vector<string> &slots)
+    bool dispatch(string_view line)
     {
-        cout << "Marking availability for Dr. " << name << " with slots: ";
-        for (const string &slot : slots)
+        size_t nameEnd = 0;
+        while (nameEnd < line.size() && isalpha(static_cast<unsigned char>(line[nameEnd])))
         {
-            cout << slot << " ";
+            nameEnd++;
         }
-        cout << endl;
+        string_view command = line.substr(0, nameEnd);
+        string_view arguments = trim(line.substr(nameEnd));
+        consumePrefix(arguments, ":");
 
-        if (doctors.find(name) != doctors.end())
+        if (equalsIgnoreCase(command, "registerDoc"))
+        {
+            string_view name = nextArrowArgument(arguments);
+            string_view speciality = nextArrowArgument(arguments);
+            if (name.empty() || speciality.empty())
+            {
+                return false;
+            }
+            doctorName.assign(name);
+            argument.assign(speciality);
+            console.registerDoctor(doctorName, argument);
+        }
+        else if (equalsIgnoreCase(command, "registerPatient"))
+        {
+            string_view name = nextArrowArgument(arguments);
+            if (name.empty())
+            {
+                return false;
+            }
+            patientName.assign(name);
+            console.registerPatient(patientName);
+        }
+        else if (equalsIgnoreCase(command, "markDocAvail") || equalsIgnoreCase(command, "withdrawDoc"))
         {
-            for (const string &slot : slots)
+            string_view name = nextToken(arguments, " \t,");
+            consumePrefix(name, "Dr.");
+            if (name.empty())
+            {
+                return false;
+            }
+            doctorName.assign(name);
+            size_t slotCount = 0;
+            while (!arguments.empty())
             {
-                if (isValidSlot(slot))
+                string_view slot = nextToken(arguments, " \t,");
+                if (slot.empty())
                 {
-                    doctors[name]->getAvailableSlots().insert(slot);
+                    continue;
                 }
-                else
+                if (slotCount == slots.size())
                 {
-                    cout << "Sorry Dr. " << name << ", slots are 30 mins only. Invalid slot: " << slot << endl;
+                    slots.emplace_back();
                 }
+                slots[slotCount++].assign(slot);
+            }
+            slots.resize(slotCount);
+            if (equalsIgnoreCase(command, "withdrawDoc"))
+            {
+                console.withdrawDoctor(doctorName, slots);
+            }
+            else
+            {
+                console.markDoctorAvailability(doctorName, slots);
             }
-            cout << "Done Doc!" << endl;
         }
-        else
+        else if (equalsIgnoreCase(command, "bookAppointment"))
+        {
+            arguments = trim(arguments);
+            consumePrefix(arguments, "(");
+            if (!arguments.empty() && arguments.back() == ')')
+            {
+                arguments.remove_suffix(1);
+            }
+            string_view patient = nextToken(arguments, ",");
+            string_view doctor = nextToken(arguments, ",");
+            string_view time = nextToken(arguments, ",");
+            consumePrefix(doctor, "Dr.");
+            doctor = trim(doctor);
+            argument.assign(time);
+            SlotIndex slot;
+            // The README books by start time ("12:30"); a full "12:30-13:00" slot is accepted too
+            if (patient.empty() || doctor.empty() || !(SlotTime::parseSlotStart(argument, slot) || SlotTime::parseSlot(argument, slot)))
+            {
+                return false;
+            }
+            patientName.assign(patient);
+            doctorName.assign(doctor);
+            console.bookAppointment(patientName, doctorName, slot);
+        }
+        else if (equalsIgnoreCase(command, "cancelBookingId"))
+        {
+            string_view id = trim(arguments);
+            if (id.empty() || id.size() > 9 || !all_of(id.begin(), id.end(), [](char c)
+                                                        { return isdigit(static_cast<unsigned char>(c)); }))
+            {
+                return false;
+            }
+            int bookingId = 0;
+            for (char c : id)
+            {
+                bookingId = bookingId * 10 + (c - '0');
+            }
+            console.cancelBooking(bookingId);
+        }
+        else if (equalsIgnoreCase(command, "showAvailByspeciality"))
         {
-            cout << "Doctor not found." << endl;
+            string_view speciality = trim(arguments);
+            if (speciality.empty())
+            {
+                return false;
+            }
+            argument.assign(speciality);
+            console.showAvailableSlotsBySpeciality(argument);
         }
-        cout << endl;
-    }
-
-    void registerPatient(const string &name)
-    {
-        cout << "Registering Patient: " << name << endl;
-        if (patients.find(name) == patients.end())
+        else if (equalsIgnoreCase(command, "findEarliest") || equalsIgnoreCase(command, "findInWindow"))
         {
-            patients[name] = EntityFactory::createPatient(name);
-            cout << "Registration successful" << endl;
+            // The times come last, since specialities may contain spaces
+            bool isWindow = equalsIgnoreCase(command, "findInWindow");
+            string_view speciality = trim(arguments);
+            string_view to = isWindow ? takeLastWord(speciality) : string_view();
+            string_view from = takeLastWord(speciality);
+            if (from.empty() || (isWindow && to.empty()))
+            {
+                return false;
+            }
+            argument.assign(speciality);
+            fromTime.assign(from);
+            if (isWindow)
+            {
+                toTime.assign(to);
+                console.showAvailableInWindow(argument, fromTime, toTime);
+            }
+            else
+            {
+                console.showEarliestAvailable(argument, fromTime);
+            }
+        }
+        else if (equalsIgnoreCase(command, "rateDoc"))
+        {
+            string_view doctor = nextToken(arguments, " \t");
+            consumePrefix(doctor, "Dr.");
+            argument.assign(trim(arguments));
+            char *end;
+            double rating = strtod(argument.c_str(), &end);
+            if (doctor.empty() || argument.empty() || *end != '\0')
+            {
+                return false;
+            }
+            doctorName.assign(trim(doctor));
+            console.rateDoctor(doctorName, rating);
+        }
+        else if (equalsIgnoreCase(command, "dumpMetrics"))
+        {
+            if (!trim(arguments).empty())
+            {
+                return false;
+            }
+            console.dumpMetrics();
         }
         else
         {
-            cout << "Patient already registered." << endl;
+            return false;
         }
-        cout << endl;
+        return true;
     }
 
-    void showAvailableSlotsBySpeciality(const string &speciality)
+public:
+    CommandDriver(AppointmentConsole &console) : console(console) {}
+
+    void processLine(string_view line)
     {
-        cout << "Showing available slots for speciality: " << speciality << endl;
-        if (displayStrategy)
+        line = trim(line);
+        if (consumePrefix(line, "i:"))
         {
-            displayStrategy->display(doctors, speciality);
+            line = trim(line);
         }
-        else
+        if (line.empty() || line.front() == '#' || consumePrefix(line, "o:"))
         {
-            cout << "No display strategy set." << endl;
+            return;
+        }
+        commandCount++;
+        if (!dispatch(line))
+        {
+            invalidCommandCount++;
+            // Keeps the report next to the output of the commands before it
+            console.flush();
+            cerr << "Invalid command: " << line << "\n";
         }
-        cout << endl;
     }
 
-    int bookAppointment(const string &patientName, const string &doctorName, const string &slot)
+    void run(FILE *input)
     {
-        cout << "Booking appointment for Patient: " << patientName << " with Dr. " << doctorName << " for slot: " << slot << endl;
-        if (patients.find(patientName) != patients.end() && doctors.find(doctorName) != doctors.end())
+        vector<char> buffer(1 << 20);
+        size_t carried = 0;
+        while (true)
         {
-            for (const auto &[bookingId, bookedSlot] : patients[patientName]->getAppointments())
-            {
-                if (bookedSlot == slot)
-                {
-                    cout << "Patient already has an appointment in the same slot." << endl;
-                    return -1;
-                }
-            }
-
-            if (doctors[doctorName]->getAvailableSlots().find(slot) != doctors[doctorName]->getAvailableSlots().end())
+            if (carried == buffer.size())
             {
-                int bookingId = generateBookingId();
-                bookedSlots[bookingId] = make_tuple(slot, patientName, doctorName);
-                patients[patientName]->getAppointments()[bookingId] = slot;
-                doctors[doctorName]->getAppointments()[bookingId] = slot;
-                doctors[doctorName]->getAvailableSlots().erase(slot);
-                cout << "Booked. Booking id: " << bookingId << endl;
-                return bookingId;
+                buffer.resize(buffer.size() * 2);
             }
-            else
+            size_t bytesRead = fread(buffer.data() + carried, 1, buffer.size() - carried, input);
+            size_t available = carried + bytesRead;
+            if (bytesRead == 0)
             {
-                if (waitlists.find(slot) == waitlists.end())
+                if (available > 0)
                 {
-                    waitlists[slot] = new Waitlist();
+                    processLine(string_view(buffer.data(), available));
                 }
-                waitlists[slot]->addPatient(patientName);
-                cout << "Added patient to waitlist for slot " << slot << endl;
-                return -1;
+                break;
             }
+            const char *lineStart = buffer.data();
+            const char *end = buffer.data() + available;
+            while (const char *newline = static_cast<const char *>(memchr(lineStart, '\n', end - lineStart)))
+            {
+                processLine(string_view(lineStart, newline - lineStart));
+                lineStart = newline + 1;
+            }
+            carried = end - lineStart;
+            memmove(buffer.data(), lineStart, carried);
         }
-        else
+    }
+
+    long long getCommandCount() const
+    {
+        return commandCount;
+    }
+
+    long long getInvalidCommandCount() const
+    {
+        return invalidCommandCount;
+    }
+};
+
+// Applies --slot-minutes and --clinic-hours (e.g. "0:00-24:00"). Returns false, after saying why, if they don't
+// make a valid SlotGrid.
+bool configureSlotGrid(int slotMinutes, const string &clinicHours)
+{
+    int openMinutes, closeMinutes;
+    if (!SlotTime::parseHours(clinicHours, openMinutes, closeMinutes) || !SlotTime::configure(slotMinutes, openMinutes, closeMinutes))
+    {
+        cerr << "Invalid slot grid: " << slotMinutes << " min slots between " << clinicHours << ", at most "
+             << int(SlotGrid::MAX_SLOTS_PER_DAY) << " whole slots a day" << endl;
+        return false;
+    }
+    return true;
+}
+
+string defaultClinicHours()
+{
+    const SlotGrid &grid = SlotTime::getGrid();
+    return SlotGrid::format(grid.openMinutes) + "-" + SlotGrid::format(grid.closeMinutes);
+}
+
+// Usage: appointments [--driver [commandFile] [--quiet] [--slot-minutes N] [--clinic-hours H:MM-H:MM]]
+// Reads README commands from commandFile or stdin and reports the sustained command rate on stderr.
+// --quiet renders into a NullOutputSink so that only the engine and the parser are measured.
+// --slot-minutes and --clinic-hours replace the 30 min slots from 9:00 to 21:00.
+int runDriver(int argc, char *argv[])
+{
+    FILE *input = stdin;
+    bool quiet = false;
+    int slotMinutes = SlotTime::getGrid().slotMinutes;
+    string clinicHours = defaultClinicHours();
+    for (int i = 2; i < argc; i++)
+    {
+        string flag = argv[i];
+        if (flag == "--quiet")
+        {
+            quiet = true;
+        }
+        else if (flag == "--slot-minutes" && i + 1 < argc)
+        {
+            slotMinutes = atoi(argv[++i]);
+        }
+        else if (flag == "--clinic-hours" && i + 1 < argc)
+        {
+            clinicHours = argv[++i];
+        }
+        else if ((input = fopen(argv[i], "r")) == nullptr)
         {
-            cout << "Patient or Doctor not found." << endl;
-            return -1;
+            cerr << "Cannot open " << argv[i] << endl;
+            return 1;
         }
-        cout << endl;
     }
+    if (!configureSlotGrid(slotMinutes, clinicHours))
+    {
+        return 1;
+    }
+    AppointmentSystem system;
+    BufferedOutputSink standardOutput(stdout);
+    NullOutputSink noOutput;
+    AppointmentConsole console(system, quiet ? static_cast<OutputSink &>(noOutput) : standardOutput);
+    DisplayByStartTime displayByStartTime;
+    console.setDisplayStrategy(&displayByStartTime);
+    CommandDriver driver(console);
+    auto start = chrono::steady_clock::now();
+    driver.run(input);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    console.flush();
+    cerr << driver.getCommandCount() << " commands (" << driver.getInvalidCommandCount() << " invalid) in " << seconds << " s, "
+         << (seconds > 0 ? static_cast<long long>(driver.getCommandCount() / seconds) : 0) << " commands/s" << endl;
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+    return 0;
+}
+
+// Synthetic day for capacity planning and regression checks. Doctors are spread over the four specialities and
+// declare a random 3/4 of the day; patients search, book and cancel in a configurable mix, and bookings pick
+// doctors from a Zipf distribution so that a few popular doctors see most of the contention.
+// The same generator lives in flipkart_machine_coding.cpp, so equal flags give comparable numbers for both engines.
+class BenchmarkConfig
+{
+public:
+    int doctorCount = 200;
+    int patientCount = 20000;
+    int operationCount = 20000;
+    // Percentages of search / book / cancel operations
+    int searchPercent = 60;
+    int bookPercent = 30;
+    int cancelPercent = 10;
+    double zipfExponent = 1.0;
+    unsigned seed = 42;
+    // Waitlist notifications are on when this is 0 or more; the handler spends this long per notification, standing
+    // in for the fan-out to the patients
+    int notifyMicros = -1;
+    // The system's own metrics, see Metrics
+    bool metrics = true;
+};
+
+class ZipfDistribution
+{
+private:
+    vector<double> cumulative;
 
-    void cancelBooking(int bookingId)
+public:
+    ZipfDistribution(int n, double exponent)
     {
-        cout << "Cancelling booking with ID: " << bookingId << endl;
-        if (bookedSlots.find(bookingId) != bookedSlots.end())
+        cumulative.resize(n);
+        double sum = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sum += 1.0 / pow(i + 1, exponent);
+            cumulative[i] = sum;
+        }
+        for (int i = 0; i < n; i++)
         {
-            string slot = get<0>(bookedSlots[bookingId]);
-            string patientName = get<1>(bookedSlots[bookingId]);
-            string doctorName = get<2>(bookedSlots[bookingId]);
-            bookedSlots.erase(bookingId);
-            patients[patientName]->getAppointments().erase(bookingId);
-            doctors[doctorName]->getAppointments().erase(bookingId);
-            doctors[doctorName]->getAvailableSlots().insert(slot);
+            cumulative[i] /= sum;
+        }
+    }
 
-            cout << "Booking Cancelled" << endl;
+    int sample(mt19937 &rng)
+    {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        return min<int>(lower_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin(), cumulative.size() - 1);
+    }
+};
 
-            if (waitlists.find(slot) != waitlists.end() && !waitlists[slot]->isEmpty())
-            {
-                string nextPatient = waitlists[slot]->getNextPatient();
-                cout << "Notifying " << nextPatient << " for slot " << slot << endl;
-                int newBookingId = bookAppointment(nextPatient, doctorName, slot);
-                if (newBookingId != -1)
-                {
-                    cout << "Appointment booked for " << nextPatient << " with booking ID " << newBookingId << endl;
-                }
-            }
-        }
-        else
+class LatencyRecorder
+{
+public:
+    string operationName;
+    vector<uint32_t> latenciesNs;
+
+    void record(chrono::steady_clock::duration elapsed)
+    {
+        latenciesNs.push_back(min<long long>(chrono::duration_cast<chrono::nanoseconds>(elapsed).count(), UINT32_MAX));
+    }
+
+    uint32_t percentile(double fraction)
+    {
+        if (latenciesNs.empty())
         {
-            cout << "No booking found for the given booking ID." << endl;
+            return 0;
         }
-        cout << endl;
+        size_t rank = min(latenciesNs.size() - 1, static_cast<size_t>(fraction * latenciesNs.size()));
+        nth_element(latenciesNs.begin(), latenciesNs.begin() + rank, latenciesNs.end());
+        return latenciesNs[rank];
     }
 
-    void showPatientAppointments(const string &patientName)
+    void report()
+    {
+        uint64_t totalNs = accumulate(latenciesNs.begin(), latenciesNs.end(), static_cast<uint64_t>(0));
+        printf("%-8s %10zu %12.0f %10u %10u %10u %10u\n", operationName.c_str(), latenciesNs.size(),
+               totalNs > 0 ? latenciesNs.size() / (totalNs / 1e9) : 0.0, percentile(0.5), percentile(0.99), percentile(0.999),
+               latenciesNs.empty() ? 0 : *max_element(latenciesNs.begin(), latenciesNs.end()));
+    }
+};
+
+long peakRssKb()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+int runBenchmark(BenchmarkConfig config)
+{
+    const string specialities[] = {"Cardiologist", "Dermatologist", "Orthopedic", "General Physician"};
+    mt19937 rng(config.seed);
+    // Drives the engine directly, so no time goes into rendering results
+    AppointmentSystem system;
+    Metrics::setEnabled(config.metrics);
+    unique_ptr<WaitlistNotifier> notifier;
+    if (config.notifyMicros >= 0)
     {
-        cout << "Showing appointments for Patient: " << patientName << endl;
-        if (patients.find(patientName) != patients.end())
+        notifier.reset(new WaitlistNotifier([&config](const vector<SlotNotification> &notifications)
+                                            { this_thread::sleep_for(chrono::microseconds(config.notifyMicros * notifications.size())); }));
+        system.setWaitlistObserver(notifier.get());
+    }
+
+    auto setupStart = chrono::steady_clock::now();
+    vector<string> doctorNames(config.doctorCount), patientNames(config.patientCount);
+    vector<vector<SlotIndex>> declaredSlots(config.doctorCount);
+    for (int i = 0; i < config.doctorCount; i++)
+    {
+        doctorNames[i] = "Doctor" + to_string(i);
+        system.registerDoctor(doctorNames[i], specialities[i % 4]);
+        vector<string> times;
+        for (SlotIndex slot = 0; slot < SlotTime::slotsPerDay(); slot++)
+        {
+            if (rng() % 4 != 0)
+            {
+                times.push_back(SlotTime::toString(slot));
+                declaredSlots[i].push_back(slot);
+            }
+        }
+        system.markDoctorAvailability(doctorNames[i], times);
+    }
+    for (int i = 0; i < config.patientCount; i++)
+    {
+        patientNames[i] = "Patient" + to_string(i);
+        system.registerPatient(patientNames[i]);
+    }
+    double setupSeconds = chrono::duration<double>(chrono::steady_clock::now() - setupStart).count();
+
+    ZipfDistribution popularDoctors(config.doctorCount, config.zipfExponent);
+    LatencyRecorder searches{"search", {}}, bookings{"book", {}}, cancellations{"cancel", {}};
+    vector<int> liveBookingIds;
+    int mixTotal = config.searchPercent + config.bookPercent + config.cancelPercent;
+    auto runStart = chrono::steady_clock::now();
+    for (int i = 0; i < config.operationCount; i++)
+    {
+        int pick = rng() % mixTotal;
+        if (pick < config.searchPercent)
+        {
+            const string &speciality = specialities[rng() % 4];
+            auto start = chrono::steady_clock::now();
+            system.getAvailableSlotsBySpeciality(speciality);
+            searches.record(chrono::steady_clock::now() - start);
+        }
+        else if (pick < config.searchPercent + config.bookPercent || liveBookingIds.empty())
         {
-            cout << "Appointments for " << patientName << ":" << endl;
-            for (const auto &[bookingId, slot] : patients[patientName]->getAppointments())
+            int doctor = popularDoctors.sample(rng);
+            if (declaredSlots[doctor].empty())
+            {
+                continue;
+            }
+            SlotIndex slot = declaredSlots[doctor][rng() % declaredSlots[doctor].size()];
+            const string &patient = patientNames[rng() % config.patientCount];
+            auto start = chrono::steady_clock::now();
+            BookingResult result = system.bookAppointment(patient, doctorNames[doctor], slot);
+            bookings.record(chrono::steady_clock::now() - start);
+            if (result.code == ResultCode::Booked)
             {
-                cout << "Booking ID: " << bookingId << ", Slot: " << slot << endl;
+                liveBookingIds.push_back(result.bookingId);
             }
         }
         else
         {
-            cout << "Patient not found." << endl;
+            int position = rng() % liveBookingIds.size();
+            int bookingId = liveBookingIds[position];
+            liveBookingIds[position] = liveBookingIds.back();
+            liveBookingIds.pop_back();
+            auto start = chrono::steady_clock::now();
+            system.cancelBooking(bookingId);
+            cancellations.record(chrono::steady_clock::now() - start);
         }
-        cout << endl;
     }
+    double runSeconds = chrono::duration<double>(chrono::steady_clock::now() - runStart).count();
+
+    auto reconcileStart = chrono::steady_clock::now();
+    long long liveBookingCount = 0;
+    system.forEachBooking([&](int, const BookedSlot &)
+                          { liveBookingCount++; });
+    double reconcileSeconds = chrono::duration<double>(chrono::steady_clock::now() - reconcileStart).count();
+
+    printf("AppointmentSystem benchmark: doctors=%d patients=%d operations=%d mix=%d/%d/%d zipf=%.2f seed=%u metrics=%s\n", config.doctorCount,
+           config.patientCount, config.operationCount, config.searchPercent, config.bookPercent, config.cancelPercent, config.zipfExponent,
+           config.seed, config.metrics ? "on" : "off");
+    printf("setup %.3f s, run %.3f s, throughput %.0f ops/s\n", setupSeconds, runSeconds, config.operationCount / runSeconds);
+    printf("%-8s %10s %12s %10s %10s %10s %10s\n", "op", "count", "ops/s", "p50 ns", "p99 ns", "p999 ns", "max ns");
+    searches.report();
+    bookings.report();
+    cancellations.report();
+    printf("reconcile %lld live bookings in %.3f ms\n", liveBookingCount, reconcileSeconds * 1000);
+    if (notifier)
+    {
+        system.setWaitlistObserver(nullptr);
+        notifier->flush();
+        printf("notifications %lld in %lld batches, cancellations waited for queue room %lld times\n", notifier->getDeliveredCount(),
+               notifier->getBatchCount(), notifier->getProducerWaitCount());
+    }
+    printf("peak RSS %.1f MiB\n", peakRssKb() / 1024.0);
+    return 0;
+}
 
-    void showDoctorAppointments(const string &doctorName)
+// Usage: appointments --bench [--doctors N] [--patients N] [--ops N] [--mix search,book,cancel] [--zipf S] [--seed N]
+//                            [--slot-minutes N] [--clinic-hours H:MM-H:MM] [--notify us] [--metrics on|off]
+int runBenchmark(int argc, char *argv[])
+{
+    BenchmarkConfig config;
+    int slotMinutes = SlotTime::getGrid().slotMinutes;
+    string clinicHours = defaultClinicHours();
+    for (int i = 2; i + 1 < argc; i += 2)
     {
-        cout << "Showing appointments for Dr. " << doctorName << endl;
-        if (doctors.find(doctorName) != doctors.end())
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--doctors")
         {
-            cout << "Appointments for Dr. " << doctorName << ":" << endl;
-            for (const auto &[bookingId, slot] : doctors[doctorName]->getAppointments())
-            {
-                cout << "Booking ID: " << bookingId << ", Slot: " << slot << endl;
-            }
+            config.doctorCount = max(1, stoi(value));
+        }
+        else if (flag == "--patients")
+        {
+            config.patientCount = max(1, stoi(value));
+        }
+        else if (flag == "--ops")
+        {
+            config.operationCount = stoi(value);
+        }
+        else if (flag == "--mix" && sscanf(value.c_str(), "%d,%d,%d", &config.searchPercent, &config.bookPercent, &config.cancelPercent) == 3 && config.searchPercent + config.bookPercent + config.cancelPercent > 0)
+        {
+        }
+        else if (flag == "--zipf")
+        {
+            config.zipfExponent = stod(value);
+        }
+        else if (flag == "--seed")
+        {
+            config.seed = stoul(value);
+        }
+        else if (flag == "--notify")
+        {
+            config.notifyMicros = max(0, stoi(value));
+        }
+        else if (flag == "--metrics" && (value == "on" || value == "off"))
+        {
+            config.metrics = value == "on";
+        }
+        else if (flag == "--slot-minutes")
+        {
+            slotMinutes = stoi(value);
+        }
+        else if (flag == "--clinic-hours")
+        {
+            clinicHours = value;
         }
         else
         {
-            cout << "Doctor not found." << endl;
+            cerr << "Unknown or invalid option " << flag << " " << value << endl;
+            return 1;
         }
-        cout << endl;
     }
-};
+    if (!configureSlotGrid(slotMinutes, clinicHours))
+    {
+        return 1;
+    }
+    return runBenchmark(config);
+}
 
-int main()
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && string(argv[1]) == "--driver")
+    {
+        return runDriver(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--bench")
+    {
+        return runBenchmark(argc, argv);
+    }
     AppointmentSystem system;
+    BufferedOutputSink standardOutput(stdout);
+    AppointmentConsole console(system, standardOutput);
+    DisplayByStartTime displayByStartTime;
+
+    console.print("\n");
 
-    cout << endl;
+    console.registerDoctor("Mahesh", "Cardiologist");
+    console.markDoctorAvailability("Mahesh", {"10:00-10:30", "10:30-11:00", "11:00-11:30", "11:30-12:00"});
 
-    system.registerDoctor("Mahesh", "Cardiologist");
-    system.markDoctorAvailability("Mahesh", {"10:00-10:30", "10:30-11:00", "11:00-11:30", "11:30-12:00"});
+    console.registerDoctor("devansh", "Cardiologist");
+    console.markDoctorAvailability("devansh", {"9:00-9:30", "9:30-10:00"});
 
-    system.registerDoctor("devansh", "Cardiologist");
-    system.markDoctorAvailability("devansh", {"9:00-9:30", "9:30-10:00"});
+    console.registerDoctor("raj", "Ortho");
+    console.markDoctorAvailability("raj", {"8:30-9:00", "9:00-9:30"});
 
-    system.registerDoctor("raj", "Ortho");
-    system.markDoctorAvailability("raj", {"8:30-9:00", "9:00-9:30"});
+    console.setDisplayStrategy(&displayByStartTime);
+    console.showAvailableSlotsBySpeciality("Cardiologist");
 
-    system.setDisplayStrategy(new DisplayByStartTime());
-    system.showAvailableSlotsBySpeciality("Cardiologist");
+    console.registerPatient("Sneha");
+    int bookingIdA = console.bookAppointment("Sneha", "devansh", "9:00-9:30").bookingId;
 
-    system.registerPatient("Sneha");
-    int bookingIdA = system.bookAppointment("Sneha", "devansh", "9:00-9:30");
+    console.registerPatient("praneeth");
+    int Praneeth = console.bookAppointment("praneeth", "devansh", "9:00-9:30").bookingId;
 
-    system.registerPatient("praneeth");
-    int Praneeth = system.bookAppointment("praneeth", "devansh", "9:00-9:30");
+    console.cancelBooking(bookingIdA);
 
-    system.cancelBooking(bookingIdA);
+    int Praneeth2 = console.bookAppointment("praneeth", "raj", "9:00-9:30").bookingId;
 
-    int Praneeth2 = system.bookAppointment("praneeth", "raj", "9:00-9:30");
+    console.rateDoctor("Mahesh", 4.6);
+    console.rateDoctor("devansh", 3.9);
+    console.showAvailableSlotsBySpeciality<RankByRating>("Cardiologist", 3);
+    console.showEarliestAvailable("Cardiologist", "9:15");
+    console.showAvailableInWindow("Ortho", "9:00", "12:00");
+    // Dr. devansh calls in sick, and Dr. Mahesh takes over the appointment
+    console.markDoctorAvailability("Mahesh", {"9:00-9:30"});
+    console.withdrawDoctor("devansh", {});
+    console.showPatientAppointments("praneeth");
     /*
-    system.registerDoctor("Curious", "Cardiologist");
-    system.markDoctorAvailability("Curious", {"9:30-10:30"});
+    console.registerDoctor("Curious", "Cardiologist");
+    console.markDoctorAvailability("Curious", {"9:30-10:30"});
 
-    system.markDoctorAvailability("Curious", {"9:30-10:00", "12:30-13:00", "16:00-16:30"});
-    system.registerDoctor("Dreadful", "Dermatologist");
-    system.markDoctorAvailability("Dreadful", {"9:30-10:00", "12:30-13:00", "16:00-16:30"});
+    console.markDoctorAvailability("Curious", {"9:30-10:00", "12:30-13:00", "16:00-16:30"});
+    console.registerDoctor("Dreadful", "Dermatologist");
+    console.markDoctorAvailability("Dreadful", {"9:30-10:00", "12:30-13:00", "16:00-16:30"});
 
-    system.setDisplayStrategy(new DisplayByStartTime());
-    system.showAvailableSlotsBySpeciality("Cardiologist");
+    console.setDisplayStrategy(&displayByStartTime);
+    console.showAvailableSlotsBySpeciality("Cardiologist");
 
-    system.registerPatient("PatientA");
-    int bookingIdA = system.bookAppointment("PatientA", "Curious", "12:30-13:00");
+    console.registerPatient("PatientA");
+    int bookingIdA = console.bookAppointment("PatientA", "Curious", "12:30-13:00").bookingId;
 
-    int bookingIdA2 = system.bookAppointment("PatientA", "Dreadful", "12:30-13:00");
+    int bookingIdA2 = console.bookAppointment("PatientA", "Dreadful", "12:30-13:00").bookingId;
 
-    system.registerPatient("PatientC");
-    int bookingIdC = system.bookAppointment("PatientC", "Curious", "12:30-13:00");
+    console.registerPatient("PatientC");
+    int bookingIdC = console.bookAppointment("PatientC", "Curious", "12:30-13:00").bookingId;
 
-    system.showAvailableSlotsBySpeciality("Cardiologist");
+    console.showAvailableSlotsBySpeciality("Cardiologist");
 
-    system.cancelBooking(bookingIdA);
+    console.cancelBooking(bookingIdA);
 
-    system.showAvailableSlotsBySpeciality("Cardiologist");
+    console.showAvailableSlotsBySpeciality("Cardiologist");
 
-    system.registerPatient("PatientB");
-    system.bookAppointment("PatientB", "Curious", "12:30-13:00");
+    console.registerPatient("PatientB");
+    console.bookAppointment("PatientB", "Curious", "12:30-13:00");
 
-    system.registerDoctor("Daring", "Dermatologist");
-    system.markDoctorAvailability("Daring", {"11:30-12:00", "14:00-14:30"});
+    console.registerDoctor("Daring", "Dermatologist");
+    console.markDoctorAvailability("Daring", {"11:30-12:00", "14:00-14:30"});
 
-    system.setDisplayStrategy(new DisplayByStartTime());
-    system.showAvailableSlotsBySpeciality("Dermatologist");
+    console.setDisplayStrategy(&displayByStartTime);
+    console.showAvailableSlotsBySpeciality("Dermatologist");
 
-    system.showPatientAppointments("PatientC");
+    console.showPatientAppointments("PatientC");
 
-    system.showDoctorAppointments("Curious");
+    console.showDoctorAppointments("Curious");
     */
     return 0;
 }
\ No newline at end of file